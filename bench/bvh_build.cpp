@@ -0,0 +1,56 @@
+#include <Magpie/bvh.h>
+#include <Magpie/scene.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace Magpie;
+
+// Times BVH builds over a random triangle soup with 1, 2, 4, ... threads.
+// usage: MagpieBenchBVH [triangle count] [repetitions]
+int main(int argc, char** argv) {
+    int triangleCount = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    int repetitions = argc > 2 ? std::atoi(argv[2]) : 3;
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> offset(-0.5f, 0.5f);
+    std::vector<AABB> bounds(triangleCount);
+    for (int i = 0; i < triangleCount; i++) {
+        Vec3 p(position(rng), position(rng), position(rng));
+        Triangle t;
+        t.a = p;
+        t.b = p + Vec3(offset(rng), offset(rng), offset(rng));
+        t.c = p + Vec3(offset(rng), offset(rng), offset(rng));
+        t.materialIndex = 0;
+        bounds[i] = Bounds::Of(t);
+    }
+
+    unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    double baseline = 0.0;
+    std::cout << triangleCount << " triangles, best of " << repetitions << std::endl;
+    for (unsigned int threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        ThreadPool pool(threads);
+        double best = 0.0;
+        std::size_t nodeCount = 0;
+        pool.ResetStats();
+        for (int r = 0; r < repetitions; r++) {
+            BVH bvh;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bvh.Build(bounds, &pool);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if (r == 0 || elapsed.count() < best) best = elapsed.count();
+            nodeCount = bvh.GetNodes().size();
+        }
+        if (threads == 1) baseline = best;
+        ThreadPoolStats stats = pool.GetStats();
+        std::cout << threads << " threads: " << best << " ms, " << nodeCount << " nodes, "
+                  << baseline / best << "x, " << stats.steals << " steals, "
+                  << stats.idleSeconds * 1000.0 / (repetitions * threads) << " ms idle per thread" << std::endl;
+        if (threads == maxThreads) break;
+    }
+    return 0;
+}
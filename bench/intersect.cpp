@@ -0,0 +1,97 @@
+#include <Magpie/bvh.h>
+#include <Magpie/intersect.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace Magpie;
+
+// Times the ray-primitive kernels of every instruction set the CPU supports, one ray
+// against packets of primitives at a time, and checks that all of them agree. By
+// default the packets are the leaves of a BVH over the primitives, as the CPU
+// backend tests them, which is what Intersect::DetectLevel is tuned for.
+// usage: MagpieBenchIntersect [primitives per packet, 0 for BVH leaves] [rays]
+int main(int argc, char** argv) {
+    int packetSize = argc > 1 ? std::atoi(argv[1]) : 0;
+    int rayCount = argc > 2 ? std::atoi(argv[2]) : 200000;
+    const int primitiveCount = 4096;
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> offset(-2.0f, 2.0f);
+    std::uniform_real_distribution<float> radius(0.1f, 1.0f);
+    TriangleSoA triangles;
+    SphereSoA spheres;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < primitiveCount; i++) {
+        Vec3 p(position(rng), position(rng), position(rng));
+        Triangle t;
+        t.a = p;
+        t.b = p + Vec3(offset(rng), offset(rng), offset(rng));
+        t.c = p + Vec3(offset(rng), offset(rng), offset(rng));
+        t.materialIndex = 0;
+        Intersect::Append(triangles, t);
+        bounds.push_back(Bounds::Of(t));
+        Sphere s;
+        s.center = Vec3(position(rng), position(rng), position(rng));
+        s.radius = radius(rng);
+        s.materialIndex = 0;
+        Intersect::Append(spheres, s);
+    }
+    Intersect::Pad(triangles);
+    Intersect::Pad(spheres);
+
+    // the leaf ranges index the tree's primitive order, the kernels only need their sizes
+    std::vector<int> leafSizes;
+    if (packetSize <= 0) {
+        BVH bvh;
+        bvh.Build(bounds);
+        const std::vector<BVHNode>& nodes = bvh.GetNodes();
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            if (nodes[i].count > 0) leafSizes.push_back(nodes[i].count);
+        }
+    }
+
+    std::vector<Vec3> origins(rayCount), directions(rayCount);
+    std::vector<int> packets(rayCount), counts(rayCount);
+    long long tested = 0;
+    for (int r = 0; r < rayCount; r++) {
+        origins[r] = Vec3(position(rng), position(rng), -20.0f);
+        directions[r] = Vector::Normalize(Vec3(offset(rng) * 0.1f, offset(rng) * 0.1f, 1.0f));
+        counts[r] = packetSize > 0 ? packetSize : leafSizes[rng() % leafSizes.size()];
+        packets[r] = rng() % (primitiveCount - counts[r] + 1);
+        tested += counts[r];
+    }
+
+    if (packetSize > 0) {
+        std::cout << rayCount << " rays against packets of " << packetSize << " primitives" << std::endl;
+    } else {
+        std::cout << rayCount << " rays against BVH leaves of " << (double)tested / rayCount << " primitives on average" << std::endl;
+    }
+    long long reference = -1;
+    for (int l = (int)SIMDLevel::Scalar; l <= (int)SIMDLevel::AVX512; l++) {
+        SIMDLevel level = (SIMDLevel)l;
+        if (!Intersect::IsSupported(level)) {
+            std::cout << Intersect::LevelName(level) << ": not supported" << std::endl;
+            continue;
+        }
+        Intersect::Kernels kernels = Intersect::GetKernels(level);
+        // sums the indices of the hits so every level can be checked against the scalar one
+        long long checksum = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rayCount; r++) {
+            float distance = 1e30f;
+            checksum += kernels.triangles(triangles, packets[r], counts[r], origins[r], directions[r], distance);
+            checksum += kernels.spheres(spheres, packets[r], counts[r], origins[r], directions[r], distance);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double rate = 2.0 * tested / elapsed.count();
+        if (reference < 0) reference = checksum;
+        std::cout << Intersect::LevelName(level) << ": " << rate / 1e6 << " M intersections/s"
+                  << (checksum == reference ? "" : ", MISMATCH") << std::endl;
+    }
+    std::cout << "selected by default: " << Intersect::LevelName(Intersect::DetectLevel()) << std::endl;
+    return 0;
+}
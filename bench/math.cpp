@@ -0,0 +1,96 @@
+#include <Magpie/mat.h>
+
+#include "math_legacy.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace Magpie;
+
+// Compares the header-only vector and matrix types against the previous out-of-line
+// ones on the operations that dominate host-side scene preparation and ray setup.
+// usage: MagpieBenchMath [element count] [repetitions]
+
+template<typename Body>
+static double BestNanoseconds(int repetitions, std::size_t count, Body body) {
+    double best = 0.0;
+    for (int r = 0; r < repetitions; r++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        double perElement = elapsed.count() / count;
+        if (r == 0 || perElement < best) best = perElement;
+    }
+    return best;
+}
+
+static void Report(const char* name, double legacy, double current) {
+    std::cout << name << ": " << legacy << " ns -> " << current << " ns, " << legacy / current << "x" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::size_t count = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    int repetitions = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> value(-10.0f, 10.0f);
+    std::vector<Vec3> points(count), results(count);
+    std::vector<Legacy::Vec3> legacyPoints, legacyResults(count);
+    for (std::size_t i = 0; i < count; i++) {
+        points[i] = Vec3(value(rng), value(rng), value(rng));
+        legacyPoints.push_back(Legacy::Vec3(points[i].x, points[i].y, points[i].z));
+    }
+    Mat4 transform = Matrix::Translate(Vec3(1.0f, 2.0f, 3.0f)) * Matrix::Rotate(0.5f, Vec3(0.0f, 1.0f, 0.0f));
+    Legacy::Mat4 legacyTransform;
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            legacyTransform.m[c][r] = transform[c][r];
+        }
+    }
+    Vec3 offset(0.5f, -0.25f, 1.0f);
+    Legacy::Vec3 legacyOffset(0.5f, -0.25f, 1.0f);
+
+    std::cout << count << " elements, best of " << repetitions << ", time per element" << std::endl;
+    // what ray generation and bounds computation do most
+    double legacy = BestNanoseconds(repetitions, count, [&]() {
+        for (std::size_t i = 0; i < count; i++) {
+            legacyResults[i] = Legacy::Normalize(Legacy::Add(Legacy::Scale(legacyPoints[i], 2.0f), legacyOffset));
+        }
+    });
+    double current = BestNanoseconds(repetitions, count, [&]() {
+        for (std::size_t i = 0; i < count; i++) {
+            results[i] = Vector::Normalize(points[i] * 2.0f + offset);
+        }
+    });
+    Report("normalize(p * s + o)", legacy, current);
+
+    legacy = BestNanoseconds(repetitions, count, [&]() {
+        for (std::size_t i = 0; i < count; i++) {
+            Legacy::Vec4 p = Legacy::Multiply(legacyTransform, Legacy::Vec4(legacyPoints[i].x, legacyPoints[i].y, legacyPoints[i].z, 1.0f));
+            legacyResults[i] = Legacy::Vec3(p.x, p.y, p.z);
+        }
+    });
+    current = BestNanoseconds(repetitions, count, [&]() {
+        for (std::size_t i = 0; i < count; i++) {
+            Vec4 p = transform * Vec4(points[i].x, points[i].y, points[i].z, 1.0f);
+            results[i] = Vec3(p.x, p.y, p.z);
+        }
+    });
+    Report("Mat4 * Vec4", legacy, current);
+
+    current = BestNanoseconds(repetitions, count, [&]() {
+        Matrix::TransformPoints(transform, points.data(), results.data(), count);
+    });
+    Report("TransformPoints", legacy, current);
+
+    // keeps the results alive
+    float checksum = 0.0f;
+    for (std::size_t i = 0; i < count; i += count / 16 + 1) {
+        checksum += results[i].x + legacyResults[i].x;
+    }
+    std::cout << "checksum " << checksum << std::endl;
+    return 0;
+}
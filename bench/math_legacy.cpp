@@ -0,0 +1,57 @@
+#include "math_legacy.h"
+
+#include <math.h>
+
+using namespace Legacy;
+
+Vec3::Vec3() {}
+
+Vec3::Vec3(float x, float y, float z) {
+    this->x = x;
+    this->y = y;
+    this->z = z;
+}
+
+Vec3::Vec3(const Vec3& other) {
+    this->x = other.x;
+    this->y = other.y;
+    this->z = other.z;
+}
+
+Vec4::Vec4() {}
+
+Vec4::Vec4(float x, float y, float z, float w) {
+    this->x = x;
+    this->y = y;
+    this->z = z;
+    this->w = w;
+}
+
+Vec4::Vec4(const Vec4& other) {
+    this->x = other.x;
+    this->y = other.y;
+    this->z = other.z;
+    this->w = other.w;
+}
+
+Vec3 Legacy::Add(Vec3 lhs, const Vec3& rhs) {
+    return Vec3(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z);
+}
+
+Vec3 Legacy::Scale(Vec3 lhs, float rhs) {
+    return Vec3(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs);
+}
+
+Vec3 Legacy::Normalize(Vec3 v) {
+    float m = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+    return Vec3(v.x / m, v.y / m, v.z / m);
+}
+
+Vec4 Legacy::Multiply(Mat4 lhs, Vec4 rhs) {
+    float v[4] = {rhs.x, rhs.y, rhs.z, rhs.w};
+    float result[4];
+    for (int r = 0; r < 4; r++) {
+        result[r] = (lhs.m[0][r] * v[0] + lhs.m[1][r] * v[1]) + (lhs.m[2][r] * v[2] + lhs.m[3][r] * v[3]);
+    }
+    return Vec4(result[0], result[1], result[2], result[3]);
+}
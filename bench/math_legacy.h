@@ -0,0 +1,37 @@
+#pragma once
+
+// The math types as they were before they became header-only: user-defined copy
+// constructors, and every operation out of line in math_legacy.cpp. Kept only so
+// MagpieBenchMath has something to compare against.
+namespace Legacy {
+    class Vec3 {
+        public:
+            Vec3();
+            Vec3(float x, float y, float z);
+            Vec3(const Vec3& other);
+            float x;
+            float y;
+            float z;
+    };
+
+    class Vec4 {
+        public:
+            Vec4();
+            Vec4(float x, float y, float z, float w);
+            Vec4(const Vec4& other);
+            float x;
+            float y;
+            float z;
+            float w;
+    };
+
+    // column-major, converted element by element on every product like the glm path
+    struct Mat4 {
+        float m[4][4];
+    };
+
+    Vec3 Add(Vec3 lhs, const Vec3& rhs);
+    Vec3 Scale(Vec3 lhs, float rhs);
+    Vec3 Normalize(Vec3 v);
+    Vec4 Multiply(Mat4 lhs, Vec4 rhs);
+}
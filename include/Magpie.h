@@ -1,7 +1,15 @@
 #pragma once
 
 #include "Magpie/angle.h"
+#include "Magpie/bvh.h"
+#include "Magpie/checkpoint.h"
+#include "Magpie/gltf.h"
+#include "Magpie/image.h"
+#include "Magpie/intersect.h"
 #include "Magpie/mat.h"
+#include "Magpie/mesh_file.h"
 #include "Magpie/pathtracer.h"
+#include "Magpie/render_service.h"
 #include "Magpie/scene.h"
+#include "Magpie/thread_pool.h"
 #include "Magpie/vec.h"
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "mat.h"
+#include "thread_pool.h"
+#include "vec.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace Magpie {
+    struct Sphere;
+    struct Triangle;
+
+    struct AABB {
+        Vec3 min;
+        Vec3 max;
+    };
+
+    // Nodes are stored in a flat array with the root first. The children of an
+    // interior node are always adjacent and stored after their parent, so only
+    // the index of the left one is kept.
+    struct BVHNode {
+        AABB bounds;
+        int leftFirst; // left child for interior nodes, first primitive index for leaves
+        int count;     // number of primitives in a leaf, 0 for interior nodes
+    };
+
+    class BVH {
+        public:
+            static const int MaxDepth = 64;
+            static const int MaxLeafSize = 4;
+            static const int BinCount = 16;
+            // builds with binned surface area heuristic splits, in parallel when a pool is given
+            void Build(const std::vector<AABB>& primitiveBounds, ThreadPool* pool = nullptr);
+            // recomputes node bounds bottom-up for moved primitives, keeping the topology
+            void Refit(const std::vector<AABB>& primitiveBounds, ThreadPool* pool = nullptr);
+            // Adopts a tree built earlier, for instance one read from a file. Returns
+            // false and keeps the current tree if the nodes do not form a tree over
+            // primitiveCount primitives that traversal can walk.
+            bool Load(std::vector<BVHNode> nodes, std::vector<int> primitiveIndices, int primitiveCount);
+            // surface area heuristic cost of the tree
+            float Cost();
+            // current cost relative to the cost right after the last build, grows as refits degrade the tree
+            float GetCostRatio();
+            const std::vector<BVHNode>& GetNodes();
+            const std::vector<int>& GetPrimitiveIndices();
+        private:
+            struct BuildState;
+            void Subdivide(int nodeIndex, int depth, BuildState& state);
+            std::vector<BVHNode> nodes;
+            std::vector<int> primitiveIndices;
+            float buildCost = 0.0f;
+    };
+
+    // A node of a 4-wide BVH. Child boxes are quantized to 8 bits per plane on a
+    // power-of-two grid anchored at the node's min corner, so one 64 byte node
+    // stands in for the three binary nodes it was collapsed from.
+    struct WideBVHNode {
+        float origin[3];
+        int8_t exponent[3];  // grid spacing along each axis is 2^exponent
+        uint8_t childCount;
+        uint8_t qmin[3][4];  // [axis][child]
+        uint8_t qmax[3][4];
+        int32_t child[4];    // node for interior children, first primitive for leaves, -1 for empty slots
+        uint16_t count[4];   // number of primitives for leaf children, 0 for interior ones
+    };
+
+    class WideBVH {
+        public:
+            static const int Width = 4;
+            // collapses a built binary tree, keeping its primitive order
+            void Build(BVH& bvh);
+            // requantizes the child boxes after the binary tree was refit
+            void Refit(BVH& bvh);
+            const std::vector<WideBVHNode>& GetNodes();
+        private:
+            void Quantize(int nodeIndex, const std::vector<BVHNode>& binary);
+            std::vector<WideBVHNode> nodes;
+            // binary node of every child slot, used to requantize after a refit
+            std::vector<int> sources;
+    };
+
+    namespace Bounds {
+        AABB Empty();
+        AABB Of(const Sphere& sphere);
+        AABB Of(const Triangle& triangle);
+        AABB Union(const AABB& a, const AABB& b);
+        AABB Union(const AABB& a, const Vec3& p);
+        // bounds of the box after transforming all eight of its corners
+        AABB Transform(const AABB& box, const Mat4& transform);
+        Vec3 Centroid(const AABB& box);
+        float SurfaceArea(const AABB& box);
+    }
+}
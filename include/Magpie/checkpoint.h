@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Magpie {
+    // Progress of a render done in chunks of samples. The random sequence of a
+    // sample depends only on its pixel and index, so the index of the next sample
+    // is all the random state there is to keep.
+    struct RenderCheckpoint {
+        unsigned int width = 0;
+        unsigned int height = 0;
+        unsigned int firstSample = 0; // of the whole render
+        unsigned int samples = 0;     // of the whole render
+        unsigned int samplesDone = 0;
+        uint64_t fingerprint = 0;     // of the settings that the image depends on
+        std::vector<float> sum;       // RGBA per pixel, rows bottom up, over samplesDone samples
+    };
+
+    // Writes to a temporary file first, flushed to disk, and renames it over
+    // filename, so a process killed or a machine crashing halfway leaves the previous
+    // checkpoint intact. Both return false if the file could not be written or read.
+    bool SaveCheckpoint(const std::string& filename, const RenderCheckpoint& checkpoint);
+    bool LoadCheckpoint(const std::string& filename, RenderCheckpoint& checkpoint);
+}
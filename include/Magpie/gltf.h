@@ -0,0 +1,19 @@
+#pragma once
+
+#include "mat.h"
+#include "scene.h"
+
+#include <string>
+
+namespace Magpie {
+    // Reader for binary glTF 2.0 (.glb) files, the format most modeling tools export.
+    namespace GLTF {
+        // Adds the meshes, materials and node hierarchy of the default scene of a .glb
+        // file to scene. Every glTF mesh becomes one Mesh, placed by an instance for
+        // each node that uses it, with the node's world transform after transform.
+        // Buffers are read in place from the mapped file, or from mapped .bin files
+        // next to it. Throws std::runtime_error if the file cannot be read or uses
+        // what the importer does not support, leaving scene as it was.
+        void Import(const std::string& filename, Scene& scene, const Mat4& transform = Mat4(1.0f));
+    }
+}
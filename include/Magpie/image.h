@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+namespace Magpie {
+    // Writers for the float RGBA frames of PathTracer::GetPixels, whose first row is
+    // the bottom of the image. Each returns false if the file could not be written.
+    namespace Image {
+        // filmic curve fitted to the ACES reference transform, then sRGB encoded
+        unsigned char TonemapChannel(float x);
+        // 8-bit sRGB after exposure in stops and tonemapping
+        bool WritePNG(const std::string& filename, unsigned int width, unsigned int height, const float* pixels, float exposure = 0.0f);
+        // linear radiance as uncompressed 32-bit float RGB
+        bool WriteEXR(const std::string& filename, unsigned int width, unsigned int height, const float* pixels);
+        bool WritePFM(const std::string& filename, unsigned int width, unsigned int height, const float* pixels);
+        // true if Write knows the extension of filename, png, exr or pfm
+        bool IsSupported(const std::string& filename);
+        // picks the format from the extension of filename
+        bool Write(const std::string& filename, unsigned int width, unsigned int height, const float* pixels, float exposure = 0.0f);
+    }
+}
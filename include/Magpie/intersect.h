@@ -0,0 +1,59 @@
+#pragma once
+
+#include "scene.h"
+#include "vec.h"
+
+#include <vector>
+
+namespace Magpie {
+    enum class SIMDLevel {
+        Scalar,
+        SSE4,  // 4 primitives per test
+        AVX2,  // 8 primitives per test
+        AVX512 // 16 primitives per test
+    };
+
+    // Triangles in structure-of-arrays form so a packet of them can be tested at once.
+    struct TriangleSoA {
+        std::vector<float> ax, ay, az;
+        std::vector<float> e1x, e1y, e1z; // b - a
+        std::vector<float> e2x, e2y, e2z; // c - a
+    };
+
+    struct SphereSoA {
+        std::vector<float> cx, cy, cz;
+        std::vector<float> radius2;
+    };
+
+    namespace Intersect {
+        static const int MaxWidth = 16;
+        // Finds the closest primitive in [first, first + count) that the ray hits nearer
+        // than distance. Returns its index and shortens distance to the hit, or returns -1.
+        // Ties go to the lower index, so results match testing one primitive at a time.
+        typedef int (*TriangleKernel)(const TriangleSoA& triangles, int first, int count, const Vec3& origin, const Vec3& direction, float& distance);
+        typedef int (*SphereKernel)(const SphereSoA& spheres, int first, int count, const Vec3& origin, const Vec3& direction, float& distance);
+        struct Kernels {
+            SIMDLevel level;
+            TriangleKernel triangles;
+            SphereKernel spheres;
+        };
+        // The widest level both the CPU and the build support, up to the widest one whose
+        // packets do not exceed BVH::MaxLeafSize, sse4 for the current leaves. MAGPIE_SIMD
+        // (scalar, sse4, avx2 or avx512) replaces that cap when it is set.
+        SIMDLevel DetectLevel();
+        bool IsSupported(SIMDLevel level);
+        // kernels of the given level, or of the widest supported level below it
+        Kernels GetKernels(SIMDLevel level);
+        const char* LevelName(SIMDLevel level);
+
+        void Append(TriangleSoA& triangles, const Triangle& triangle);
+        void Append(SphereSoA& spheres, const Sphere& sphere);
+        // adds a slot that never reports a hit, to keep indices aligned with another array
+        void AppendMissing(TriangleSoA& triangles);
+        void AppendMissing(SphereSoA& spheres);
+        // adds trailing slots so a full packet can be loaded from any index, call once
+        // after the last Append
+        void Pad(TriangleSoA& triangles);
+        void Pad(SphereSoA& spheres);
+    }
+}
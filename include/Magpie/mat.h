@@ -1,18 +1,201 @@
 #pragma once
 
-#include <glm/mat4x4.hpp>
-
 #include "vec.h"
 
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
 namespace Magpie {
-    typedef glm::mat4 Mat4;
-    
+    // Column-major 4x4 matrix, indexed as m[column][row]. The layout matches float16
+    // in OpenCL, so it can be passed to kernels as is.
+    class alignas(16) Mat4 {
+        public:
+            Mat4() : Mat4(1.0f) {}
+            // a diagonal matrix, the identity for 1
+            explicit Mat4(float diagonal) : columns{Vec4(diagonal, 0.0f, 0.0f, 0.0f), Vec4(0.0f, diagonal, 0.0f, 0.0f),
+                                                    Vec4(0.0f, 0.0f, diagonal, 0.0f), Vec4(0.0f, 0.0f, 0.0f, diagonal)} {}
+            Mat4(Vec4 c0, Vec4 c1, Vec4 c2, Vec4 c3) : columns{c0, c1, c2, c3} {}
+            Vec4& operator[](int column) { return columns[column]; }
+            const Vec4& operator[](int column) const { return columns[column]; }
+        private:
+            Vec4 columns[4];
+    };
+
+    static_assert(sizeof(Mat4) == 64 && std::is_trivially_copyable<Mat4>::value, "Mat4 is passed to kernels as float16");
+
     namespace Matrix {
+        // right-handed, depth mapped to [-1, 1]
         Mat4 Perspective(float fov, float aspect, float near, float far);
         Mat4 LookAt(Vec3 eye, Vec3 center, Vec3 up);
-        Mat4 Inverse(Mat4 matrix);
-        float* ValuePtr(Mat4 matrix);
+        Mat4 Inverse(const Mat4& matrix);
+        Mat4 Translate(Vec3 offset);
+        Mat4 Rotate(float angle, Vec3 axis);
+        Mat4 Scale(Vec3 factors);
+        const float* ValuePtr(const Mat4& matrix);
+        // transform count points (w = 1) or directions (w = 0) at once
+        void TransformPoints(const Mat4& matrix, const Vec3* points, Vec3* result, std::size_t count);
+        void TransformDirections(const Mat4& matrix, const Vec3* directions, Vec3* result, std::size_t count);
+    }
+}
+
+inline Magpie::Vec4 operator*(const Magpie::Mat4& lhs, const Magpie::Vec4& rhs) {
+    // pairwise sums, in the order glm used before
+#ifdef MAGPIE_MATH_SSE
+    // rhs is often built from scalars just before, so its components are broadcast
+    // one by one rather than reloaded as a whole, which would stall store forwarding
+    __m128 mul0 = _mm_mul_ps(Magpie::Simd::Load(lhs[0]), _mm_set1_ps(rhs.x));
+    __m128 mul1 = _mm_mul_ps(Magpie::Simd::Load(lhs[1]), _mm_set1_ps(rhs.y));
+    __m128 mul2 = _mm_mul_ps(Magpie::Simd::Load(lhs[2]), _mm_set1_ps(rhs.z));
+    __m128 mul3 = _mm_mul_ps(Magpie::Simd::Load(lhs[3]), _mm_set1_ps(rhs.w));
+    return Magpie::Simd::Store(_mm_add_ps(_mm_add_ps(mul0, mul1), _mm_add_ps(mul2, mul3)));
+#else
+    return (lhs[0] * rhs.x + lhs[1] * rhs.y) + (lhs[2] * rhs.z + lhs[3] * rhs.w);
+#endif
+}
+
+inline Magpie::Mat4 operator*(const Magpie::Mat4& lhs, const Magpie::Mat4& rhs) {
+    Magpie::Mat4 result;
+    for (int c = 0; c < 4; c++) {
+        result[c] = lhs[0] * rhs[c].x + lhs[1] * rhs[c].y + lhs[2] * rhs[c].z + lhs[3] * rhs[c].w;
+    }
+    return result;
+}
+
+inline bool operator==(const Magpie::Mat4& lhs, const Magpie::Mat4& rhs) {
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            if (lhs[c][r] != rhs[c][r]) return false;
+        }
+    }
+    return true;
+}
+
+inline bool operator!=(const Magpie::Mat4& lhs, const Magpie::Mat4& rhs) {
+    return !(lhs == rhs);
+}
+
+inline Magpie::Mat4 Magpie::Matrix::Perspective(float fov, float aspect, float near, float far) {
+    float tanHalfFov = std::tan(fov / 2.0f);
+    Mat4 result(0.0f);
+    result[0][0] = 1.0f / (aspect * tanHalfFov);
+    result[1][1] = 1.0f / tanHalfFov;
+    result[2][2] = -(far + near) / (far - near);
+    result[2][3] = -1.0f;
+    result[3][2] = -(2.0f * far * near) / (far - near);
+    return result;
+}
+
+inline Magpie::Mat4 Magpie::Matrix::LookAt(Vec3 eye, Vec3 center, Vec3 up) {
+    Vec3 f = Vector::Normalize(center - eye);
+    Vec3 s = Vector::Normalize(Vector::Cross(f, up));
+    Vec3 u = Vector::Cross(s, f);
+    Mat4 result(1.0f);
+    result[0][0] = s.x;
+    result[1][0] = s.y;
+    result[2][0] = s.z;
+    result[0][1] = u.x;
+    result[1][1] = u.y;
+    result[2][1] = u.z;
+    result[0][2] = -f.x;
+    result[1][2] = -f.y;
+    result[2][2] = -f.z;
+    result[3][0] = -Vector::Dot(s, eye);
+    result[3][1] = -Vector::Dot(u, eye);
+    result[3][2] = Vector::Dot(f, eye);
+    return result;
+}
+
+// cofactors of the 2x2 minors, four columns at a time
+inline Magpie::Mat4 Magpie::Matrix::Inverse(const Mat4& m) {
+    float coef00 = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+    float coef02 = m[1][2] * m[3][3] - m[3][2] * m[1][3];
+    float coef03 = m[1][2] * m[2][3] - m[2][2] * m[1][3];
+    float coef04 = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+    float coef06 = m[1][1] * m[3][3] - m[3][1] * m[1][3];
+    float coef07 = m[1][1] * m[2][3] - m[2][1] * m[1][3];
+    float coef08 = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+    float coef10 = m[1][1] * m[3][2] - m[3][1] * m[1][2];
+    float coef11 = m[1][1] * m[2][2] - m[2][1] * m[1][2];
+    float coef12 = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+    float coef14 = m[1][0] * m[3][3] - m[3][0] * m[1][3];
+    float coef15 = m[1][0] * m[2][3] - m[2][0] * m[1][3];
+    float coef16 = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+    float coef18 = m[1][0] * m[3][2] - m[3][0] * m[1][2];
+    float coef19 = m[1][0] * m[2][2] - m[2][0] * m[1][2];
+    float coef20 = m[2][0] * m[3][1] - m[3][0] * m[2][1];
+    float coef22 = m[1][0] * m[3][1] - m[3][0] * m[1][1];
+    float coef23 = m[1][0] * m[2][1] - m[2][0] * m[1][1];
+
+    Vec4 fac0(coef00, coef00, coef02, coef03);
+    Vec4 fac1(coef04, coef04, coef06, coef07);
+    Vec4 fac2(coef08, coef08, coef10, coef11);
+    Vec4 fac3(coef12, coef12, coef14, coef15);
+    Vec4 fac4(coef16, coef16, coef18, coef19);
+    Vec4 fac5(coef20, coef20, coef22, coef23);
+
+    Vec4 vec0(m[1][0], m[0][0], m[0][0], m[0][0]);
+    Vec4 vec1(m[1][1], m[0][1], m[0][1], m[0][1]);
+    Vec4 vec2(m[1][2], m[0][2], m[0][2], m[0][2]);
+    Vec4 vec3(m[1][3], m[0][3], m[0][3], m[0][3]);
+
+    Vec4 signA(1.0f, -1.0f, 1.0f, -1.0f);
+    Vec4 signB(-1.0f, 1.0f, -1.0f, 1.0f);
+    Mat4 inverse((vec1 * fac0 - vec2 * fac1 + vec3 * fac2) * signA,
+                 (vec0 * fac0 - vec2 * fac3 + vec3 * fac4) * signB,
+                 (vec0 * fac1 - vec1 * fac3 + vec3 * fac5) * signA,
+                 (vec0 * fac2 - vec1 * fac4 + vec2 * fac5) * signB);
+
+    Vec4 row0(inverse[0][0], inverse[1][0], inverse[2][0], inverse[3][0]);
+    Vec4 dot0 = m[0] * row0;
+    float determinant = (dot0.x + dot0.y) + (dot0.z + dot0.w);
+    float oneOverDeterminant = 1.0f / determinant;
+    for (int c = 0; c < 4; c++) {
+        inverse[c] = inverse[c] * oneOverDeterminant;
     }
+    return inverse;
+}
+
+inline Magpie::Mat4 Magpie::Matrix::Translate(Vec3 offset) {
+    Mat4 result(1.0f);
+    result[3] = Vec4(offset.x, offset.y, offset.z, 1.0f);
+    return result;
+}
+
+inline Magpie::Mat4 Magpie::Matrix::Rotate(float angle, Vec3 axis) {
+    float c = std::cos(angle);
+    float s = std::sin(angle);
+    Vec3 a = Vector::Normalize(axis);
+    Vec3 t = (1.0f - c) * a;
+    Mat4 result(1.0f);
+    result[0] = Vec4(c + t.x * a.x, t.x * a.y + s * a.z, t.x * a.z - s * a.y, 0.0f);
+    result[1] = Vec4(t.y * a.x - s * a.z, c + t.y * a.y, t.y * a.z + s * a.x, 0.0f);
+    result[2] = Vec4(t.z * a.x + s * a.y, t.z * a.y - s * a.x, c + t.z * a.z, 0.0f);
+    return result;
 }
 
-Magpie::Vec4 operator*(Magpie::Mat4 lhs, Magpie::Vec4 rhs);
\ No newline at end of file
+inline Magpie::Mat4 Magpie::Matrix::Scale(Vec3 factors) {
+    Mat4 result(1.0f);
+    result[0][0] = factors.x;
+    result[1][1] = factors.y;
+    result[2][2] = factors.z;
+    return result;
+}
+
+inline const float* Magpie::Matrix::ValuePtr(const Mat4& matrix) {
+    return &matrix[0].x;
+}
+
+inline void Magpie::Matrix::TransformPoints(const Mat4& matrix, const Vec3* points, Vec3* result, std::size_t count) {
+    for (std::size_t i = 0; i < count; i++) {
+        Vec4 p = matrix * Vec4(points[i].x, points[i].y, points[i].z, 1.0f);
+        result[i] = Vec3(p.x, p.y, p.z);
+    }
+}
+
+inline void Magpie::Matrix::TransformDirections(const Mat4& matrix, const Vec3* directions, Vec3* result, std::size_t count) {
+    for (std::size_t i = 0; i < count; i++) {
+        Vec4 d = matrix * Vec4(directions[i].x, directions[i].y, directions[i].z, 0.0f);
+        result[i] = Vec3(d.x, d.y, d.z);
+    }
+}
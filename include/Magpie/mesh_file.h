@@ -0,0 +1,21 @@
+#pragma once
+
+#include "scene.h"
+
+#include <string>
+#include <vector>
+
+namespace Magpie {
+    // Readers for triangle meshes too large to list in a scene file. The file is
+    // memory mapped and parsed by all cores at once.
+    namespace MeshFile {
+        // true if Load knows the extension of filename, obj or ply
+        bool IsSupported(const std::string& filename);
+        // Appends the triangles of an OBJ file or a binary PLY file to triangles, all
+        // with the given material. Faces with more than three vertices are split into
+        // fans, everything but positions and faces is ignored. Throws
+        // std::runtime_error if the file cannot be read or is malformed, leaving
+        // triangles as it was.
+        void Load(const std::string& filename, int materialIndex, std::vector<Triangle>& triangles);
+    }
+}
@@ -1,36 +1,86 @@
 #pragma once
 
+#include "bvh.h"
 #include "mat.h"
 #include "scene.h"
 #include "angle.h"
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
 // forward declare OpenCL classes
 namespace cl {
     class Context;
-    class CommandQueue;
+    class Event;
     template<typename... Ts> class KernelFunctor;
     class Buffer;
 }
 
 namespace Magpie {
+    // Device buffer counters. A steady-state frame leaves allocations unchanged.
+    struct DeviceMemoryStats {
+        unsigned int allocations = 0;  // buffers created
+        unsigned int reuses = 0;       // uploads and resizes served by an existing buffer
+        std::size_t allocatedBytes = 0; // bytes currently held on the device
+    };
+
+    enum class PixelFormat {
+        Float, // linear RGBA radiance, 32-bit float per channel, for offline output
+        RGBA8  // exposed, tonemapped and sRGB encoded, 8 bits per channel, for display
+    };
+
     class PathTracer {
         public:
             virtual ~PathTracer() {};
             virtual void Initialize() {};
             virtual void SetSky(std::string filename) = 0;
+            virtual void SetSky(const Texture& texture) = 0;
+            // also fits the aspect ratio of the projection to the new dimensions
             virtual void SetDimensions(unsigned int width, unsigned int height);
             virtual void SetViewMatrix(Mat4 matrix);
+            // vertical field of view in degrees
+            void SetFieldOfView(float degrees);
             virtual void LoadScene(Scene scene) = 0;
+            // applies changes to a loaded scene, by default by loading it again
+            virtual void UpdateScene(const Scene& scene);
             virtual void Render() = 0;
+            // Submits a frame without waiting for it. EndFrame makes the most recent
+            // finished image available and may leave the frame just submitted running,
+            // so callers can display one frame while the next is computed. The pixels
+            // stay valid until the next call to BeginFrame.
+            virtual void BeginFrame();
+            virtual void EndFrame();
+            // selects which of GetPixels and GetPackedPixels is filled by later frames
+            virtual void SetPixelFormat(PixelFormat format);
+            // exposure in stops applied before tonemapping packed pixels
+            virtual void SetExposure(float stops);
+            // Renders the whole image with a fixed number of samples per pixel into
+            // GetPixels. Backends that support it work through the image in tiles, so
+            // device memory scales with the tile size rather than the image size.
+            virtual void RenderTiled(unsigned int samplesPerPixel);
+            virtual void SetTileSize(unsigned int size);
             virtual float* GetPixels();
+            virtual unsigned char* GetPackedPixels();
+            // Numbers the samples of later frames from first rather than zero, so that
+            // processes rendering the same image can each take a disjoint range of the
+            // random sequence and have their averages merged.
+            void SetSampleOffset(unsigned int first);
+            // samples per pixel averaged into the current image
+            unsigned int GetSampleCount();
         protected:
             unsigned int width = 800, height = 600;
             Mat4 view;
-            Mat4 projection = Matrix::Perspective(Radians(45.0f), (float)width / height, 0.1f, 100.0f);
-            float* pixels;
+            float fieldOfView = 45.0f;
+            Mat4 projection = Matrix::Perspective(Radians(fieldOfView), (float)width / height, 0.1f, 100.0f);
+            float* pixels = nullptr;
+            unsigned char* packedPixels = nullptr;
+            PixelFormat pixelFormat = PixelFormat::Float;
+            unsigned int tileSize = 256;
+            float exposure = 0.0f;
+            // reset whenever the view, the dimensions or the scene change
+            unsigned int sampleCount = 0;
+            unsigned int sampleOffset = 0;
     };
 
     class OpenCLPathTracer : public PathTracer {
@@ -38,17 +88,78 @@ namespace Magpie {
             ~OpenCLPathTracer();
             void Initialize();
             void SetSky(std::string filename);
+            void SetSky(const Texture& texture);
+            void LoadScene(Scene scene);
+            // refits the trees over what Scene::GetMovedSpheres and GetMovedInstances
+            // list when nothing else changed, and uploads only those
+            void UpdateScene(const Scene& scene);
+            void Render();
+            void BeginFrame();
+            void EndFrame();
+            // switches between the single raytrace kernel and the wavefront pipeline of
+            // separate generate, extend, shade and compact passes
+            void SetWavefront(bool enabled);
+            void RenderTiled(unsigned int samplesPerPixel);
+            // renders on every device of the default platform instead of only the
+            // default device, must be called before Initialize
+            void SetMultiDevice(bool enabled);
+            DeviceMemoryStats GetDeviceMemoryStats();
+        private:
+            static const int FramesInFlight = 2;
+            static const int MaxBounces = 8;
+            static const int TilesInFlight = 2; // per device
+            struct SceneData;
+            struct FrameSlot;
+            struct WavefrontKernels;
+            struct RenderDevice;
+            class DeviceMemory;
+            void SetLightingArgs(const Scene& scene);
+            bool SameTopology(const Scene& scene);
+            std::vector<AABB> InstanceBounds();
+            bool RefitOrRebuild(BVH& bvh, WideBVH& wideBVH, const std::vector<AABB>& bounds);
+            void AssembleSceneData();
+            void WriteInstances();
+            void UploadSceneData();
+            void WaitForOldestFrame();
+            void SetRegionArgs(int tileX, int tileY);
+            void BalanceRows();
+            cl::Event RenderWavefront(RenderDevice& device, cl::Buffer& deviceFrame, cl::Buffer& accumulation);
+            cl::Context* context = nullptr;
+            std::vector<RenderDevice*> devices;
+            bool multiDevice = false;
+            FrameSlot* frameSlots = nullptr;
+            int nextSlot = 0;
+            int pendingFrames = 0;
+            std::vector<float> tiledImage;
+            cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>* raytrace = nullptr;
+            cl::KernelFunctor<cl::Buffer, cl::Buffer, float>* tonemap = nullptr;
+            WavefrontKernels* wavefront = nullptr;
+            bool useWavefront = false;
+            ThreadPool* threadPool = nullptr;
+            SceneData* sceneData = nullptr;
+    };
+
+    // Renders on the host with the same algorithm as the OpenCL kernel, splitting
+    // the image into tiles that are shaded in parallel on a thread pool.
+    class CPUPathTracer : public PathTracer {
+        public:
+            ~CPUPathTracer();
+            void Initialize();
+            void SetSky(std::string filename);
+            void SetSky(const Texture& texture);
             void LoadScene(Scene scene);
             void Render();
+            // scheduler counters of the render and build threads, see ThreadPool
+            ThreadPoolStats GetThreadPoolStats();
         private:
+            static const int TileSize = 16;
+            struct SceneData;
+            std::vector<Vec4> sky;
+            int skyWidth = 0, skyHeight = 0;
+            std::vector<Vec4> accumulation;
             std::vector<float> frame;
-            cl::Context* context;
-            cl::CommandQueue* queue;
-            cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>* raytrace;
-            cl::Buffer* skyBuffer;
-            cl::Buffer* deviceFrame;
-            cl::Buffer* sphereBuffer;
-            cl::Buffer* triangleBuffer;
-            cl::Buffer* materialBuffer;
+            std::vector<unsigned char> packed;
+            ThreadPool* threadPool = nullptr;
+            SceneData* sceneData = nullptr;
     };
 }
\ No newline at end of file
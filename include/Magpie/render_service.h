@@ -0,0 +1,99 @@
+#pragma once
+
+#include "pathtracer.h"
+#include "vec.h"
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Magpie {
+    enum class Backend {
+        CPU,
+        OpenCL
+    };
+
+    // One offline render, as described on the MagpieRender command line.
+    struct RenderJob {
+        std::string scene;
+        // image file to write, or empty to return the pixels in the result instead
+        std::string output = "render.png";
+        Backend backend = Backend::CPU;
+        unsigned int width = 800;
+        unsigned int height = 600;
+        unsigned int samples = 64;
+        unsigned int firstSample = 0; // see PathTracer::SetSampleOffset
+        Vec3 camera = Vec3(0.0f, 0.0f, 0.0f);
+        Vec3 target = Vec3(0.0f, 0.0f, -1.0f);
+        Vec3 up = Vec3(0.0f, 1.0f, 0.0f);
+        float fieldOfView = 45.0f;
+        float exposure = 0.0f;
+        // With a checkpoint file the samples are rendered in chunks of
+        // checkpointInterval, and the sum so far is saved after each one. A resumed
+        // job continues from the file if it exists, and its image is bit for bit the
+        // one the job would have given without the interruption.
+        std::string checkpoint;
+        unsigned int checkpointInterval = 16;
+        bool resume = false;
+    };
+
+    // Fills job from MagpieRender arguments, a scene file and options such as
+    // "--spp 16". Returns false with a message in error if they are invalid.
+    bool ParseRenderJob(const std::vector<std::string>& arguments, RenderJob& job, std::string& error);
+    PathTracer* CreatePathTracer(Backend backend);
+
+    struct RenderResult {
+        bool ok = false;
+        std::string error;
+        bool cached = false;       // the scene was already loaded in a renderer
+        double queueSeconds = 0.0; // from Submit until the job started
+        double renderSeconds = 0.0;
+        std::vector<float> pixels; // RGBA rows bottom up, if the job had no output file
+    };
+
+    struct RenderServiceStats {
+        unsigned long long jobs = 0;
+        unsigned long long hits = 0;     // jobs on a scene that was already loaded
+        unsigned long long rejected = 0; // jobs turned away by a full queue
+        unsigned int queued = 0;
+        unsigned int cachedScenes = 0;
+    };
+
+    // Runs render jobs one at a time on its own thread, so a caller never waits for
+    // more than the jobs ahead of it in a queue of bounded length. Initialized
+    // renderers stay alive with their scene loaded in a least recently used cache
+    // keyed by backend and scene file, so repeated jobs on a scene skip program
+    // compilation, parsing, acceleration structure builds and uploads. A scene file
+    // that changed on disk is loaded again.
+    class RenderService {
+        public:
+            RenderService(unsigned int cacheSize = 4, unsigned int queueSize = 16);
+            // fails the jobs still queued and waits for the one running
+            ~RenderService();
+            // Queues a job whose result becomes ready once the image is written.
+            // Returns false without queueing if the queue is full.
+            bool Submit(const RenderJob& job, std::future<RenderResult>& result);
+            RenderServiceStats GetStats();
+        private:
+            struct Entry;
+            struct Pending;
+            void WorkerLoop();
+            RenderResult Run(const RenderJob& job);
+            Entry& Acquire(const RenderJob& job, bool& cached);
+            unsigned int cacheSize;
+            unsigned int queueSize;
+            // most recently used first, only touched by the worker
+            std::list<Entry*> cache;
+            std::deque<Pending*> queue;
+            std::mutex mutex;
+            std::condition_variable available;
+            bool stopping = false;
+            RenderServiceStats stats;
+            std::thread worker;
+    };
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "bvh.h"
 #include "light.h"
+#include "mat.h"
 #include "vec.h"
 #include "material.h"
 
@@ -21,21 +23,88 @@ namespace Magpie {
         int materialIndex;
     };
 
+    // triangles stored once and placed any number of times by instances
+    struct Mesh {
+        std::vector<Triangle> triangles;
+    };
+
+    struct Instance {
+        int meshIndex;
+        Mat4 transform; // object to world
+    };
+
+    // RGBA in [0, 1], rows bottom up, as the tracers sample it
+    struct Texture {
+        int width = 0;
+        int height = 0;
+        std::vector<Vec4> pixels;
+    };
+
+    // throws std::runtime_error if the image cannot be read
+    Texture LoadTexture(const std::string& filename);
+
+    class Scene;
+    // Reads a file written by SaveBinaryScene. Throws std::runtime_error if it is
+    // not one or is damaged.
+    Scene LoadBinaryScene(const std::string& filename);
+
     class Scene {
         public:
             std::string skyFilename;
+            // decoded ahead of time, used instead of skyFilename when not empty
+            Texture sky;
             bool ground;
             DirectionalLight directionalLight;
-            const std::vector<Sphere>& GetSpheres();
-            const std::vector<Triangle>& GetTriangles();
-            const std::vector<Material>& GetMaterials();
+            const std::vector<Sphere>& GetSpheres() const;
+            const std::vector<Triangle>& GetTriangles() const;
+            const std::vector<Material>& GetMaterials() const;
+            const std::vector<Mesh>& GetMeshes() const;
+            const std::vector<Instance>& GetInstances() const;
             void AddSphere(Vec3 center, float radius, int materialIndex);
             void AddTriangle(Vec3 a, Vec3 b, Vec3 c, int materialIndex);
             void AddMaterial(Material material);
+            // returns the index to place the mesh with in AddInstance
+            int AddMesh(Mesh mesh);
+            // reads an OBJ or PLY file straight into a new mesh, see MeshFile::Load
+            int AddMeshFromFile(const std::string& filename, int materialIndex);
+            void AddInstance(int meshIndex, Mat4 transform);
+            // Move objects of a loaded scene. The objects moved are recorded, so that
+            // PathTracer::UpdateScene only refits and uploads what changed. Call
+            // ClearMoved once every tracer has been updated.
+            void SetSphereCenter(int sphereIndex, Vec3 center);
+            void SetInstanceTransform(int instanceIndex, Mat4 transform);
+            const std::vector<int>& GetMovedSpheres() const;
+            const std::vector<int>& GetMovedInstances() const;
+            void ClearMoved();
+            // Builds the trees over the world primitives, spheres first and then the
+            // loose triangles, and over the triangles of every mesh. LoadScene of the
+            // tracers adopts them instead of building its own. Adding or moving
+            // primitives drops them.
+            void BuildBVHs(ThreadPool* pool = nullptr);
+            bool HasBVHs() const;
+            const BVH& GetWorldBVH() const;
+            const std::vector<BVH>& GetMeshBVHs() const;
         private:
+            friend Scene LoadBinaryScene(const std::string& filename);
+            void DropBVHs();
             std::vector<Sphere> spheres;
             std::vector<Triangle> triangles;
             std::vector<Material> materials;
+            std::vector<Mesh> meshes;
+            std::vector<Instance> instances;
+            // each index is listed once, the flags tell whether it already is
+            std::vector<int> movedSpheres;
+            std::vector<int> movedInstances;
+            std::vector<bool> sphereMoved;
+            std::vector<bool> instanceMoved;
+            bool hasBVHs = false;
+            BVH worldBVH;
+            std::vector<BVH> meshBVHs;
     };
+    // a YAML scene, a binary one or a .glb file, told apart by the first bytes of the file
     Scene LoadSceneFromFile(std::string file);
+    // Writes every array in the layout the tracers use, along with the trees and the
+    // decoded sky, which are built and loaded first if the scene lacks them. Returns
+    // false if the file could not be written.
+    bool SaveBinaryScene(const std::string& filename, Scene scene);
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Magpie {
+    // Scheduler counters, either for one thread or summed over the pool.
+    struct ThreadPoolStats {
+        unsigned long long tasks = 0;  // tasks run
+        unsigned long long steals = 0; // tasks taken from the deque of another thread
+        double idleSeconds = 0.0;      // time spent looking for or sleeping until work
+    };
+
+    // A fixed set of worker threads for fork-join style task parallelism.
+    // Every worker owns a deque of tasks. It pushes and pops at the back of its own
+    // deque and, once that is empty, steals from the front of a randomly chosen
+    // other one, where the oldest and in a recursive split the largest tasks are.
+    // Threads outside the pool share one more deque. The thread that waits on a
+    // TaskGroup runs pending tasks itself, so a pool created with a thread count of 1
+    // has no workers and runs everything inline.
+    class ThreadPool {
+        public:
+            ThreadPool(unsigned int threadCount = std::thread::hardware_concurrency());
+            ~ThreadPool();
+            unsigned int GetThreadCount();
+            // Calls body(chunkBegin, chunkEnd) over [begin, end) in chunks of at most
+            // grainSize. The range is split in halves recursively, so idle threads
+            // steal large pieces and split them further in their own deques.
+            void ParallelFor(int begin, int end, int grainSize, const std::function<void(int, int)>& body);
+            ThreadPoolStats GetStats();
+            // one entry per worker, followed by one for all threads outside the pool
+            std::vector<ThreadPoolStats> GetThreadStats();
+            void ResetStats();
+        private:
+            friend class TaskGroup;
+            struct WorkQueue;
+            void Submit(std::function<void()> task);
+            // runs pending tasks until pending drops to zero
+            void Wait(std::atomic<int>& pending);
+            bool FindTask(int self, std::function<void()>& task);
+            int CurrentQueue();
+            void WorkerLoop(int index);
+            std::vector<std::thread> workers;
+            // one per worker, the last is shared by threads outside the pool
+            std::vector<WorkQueue*> queues;
+            std::atomic<int> queued;
+            std::atomic<int> sleeping;
+            std::mutex mutex;
+            std::condition_variable available;
+            bool stopping = false;
+    };
+
+    class TaskGroup {
+        public:
+            TaskGroup(ThreadPool& pool);
+            ~TaskGroup();
+            void Run(std::function<void()> task);
+            void Wait();
+        private:
+            ThreadPool& pool;
+            std::atomic<int> pending;
+    };
+}
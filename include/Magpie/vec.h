@@ -1,47 +1,166 @@
 #pragma once
 
+#include <cmath>
+#include <type_traits>
+
+// Vec4 arithmetic and matrix transforms use SSE where it is available, unless
+// MAGPIE_SCALAR_MATH is defined. Both paths do the same IEEE operations in the same
+// order, so they give identical results.
+#if !defined(MAGPIE_SCALAR_MATH) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define MAGPIE_MATH_SSE 1
+#include <xmmintrin.h>
+#endif
+
 namespace Magpie {
-    class Vec3 {
+    // Padded to 16 bytes, like float3 in OpenCL, so arrays of it stay aligned.
+    class alignas(16) Vec3 {
         public:
-            Vec3();
-            Vec3(float x, float y, float z);
-            Vec3(const Vec3& other);
+            Vec3() = default;
+            constexpr Vec3(float x, float y, float z) : x(x), y(y), z(z) {}
             float x;
             float y;
             float z;
-            Vec3& operator+=(const Vec3& rhs);
-            Vec3& operator-=(const Vec3& rhs);
+            Vec3& operator+=(const Vec3& rhs) {
+                x += rhs.x;
+                y += rhs.y;
+                z += rhs.z;
+                return *this;
+            }
+            Vec3& operator-=(const Vec3& rhs) {
+                x -= rhs.x;
+                y -= rhs.y;
+                z -= rhs.z;
+                return *this;
+            }
     };
 
-    class Vec4 {
+    class alignas(16) Vec4 {
         public:
-            Vec4();
-            Vec4(float x, float y, float z, float w);
-            Vec4(const Vec4& other);
+            Vec4() = default;
+            constexpr Vec4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
             float x;
             float y;
             float z;
             float w;
+            float& operator[](int i) { return (&x)[i]; }
+            const float& operator[](int i) const { return (&x)[i]; }
             Vec4& operator+=(const Vec4& rhs);
             Vec4& operator-=(const Vec4& rhs);
     };
 
+    static_assert(sizeof(Vec3) == 16 && std::is_trivially_copyable<Vec3>::value, "Vec3 must be a padded plain value");
+    static_assert(sizeof(Vec4) == 16 && std::is_trivially_copyable<Vec4>::value, "Vec4 must be a plain value");
+
+#ifdef MAGPIE_MATH_SSE
+    namespace Simd {
+        inline __m128 Load(const Vec4& v) { return _mm_load_ps(&v.x); }
+        inline Vec4 Store(__m128 v) {
+            Vec4 result;
+            _mm_store_ps(&result.x, v);
+            return result;
+        }
+    }
+#endif
+
     namespace Vector {
-        float Magnitude(Vec3 v);
-        float Magnitude(Vec4 v);
+        constexpr float Dot(Vec3 a, Vec3 b) {
+            return a.x*b.x + a.y*b.y + a.z*b.z;
+        }
+        constexpr Vec3 Cross(Vec3 a, Vec3 b) {
+            return Vec3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+        }
+        inline float Magnitude(Vec3 v) {
+            return std::sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+        }
+        inline float Magnitude(Vec4 v) {
+            return std::sqrt(v.x*v.x + v.y*v.y + v.z*v.z + v.w*v.w);
+        }
         Vec3 Normalize(Vec3 v);
         Vec4 Normalize(Vec4 v);
-        Vec3 Cross(Vec3 a, Vec3 b);
     }
 }
 
-Magpie::Vec3 operator+(Magpie::Vec3 lhs, const Magpie::Vec3& rhs);
-Magpie::Vec4 operator+(Magpie::Vec4 lhs, const Magpie::Vec4& rhs);
-Magpie::Vec3 operator-(Magpie::Vec3 lhs, const Magpie::Vec3& rhs);
-Magpie::Vec4 operator-(Magpie::Vec4 lhs, const Magpie::Vec4& rhs);
-Magpie::Vec3 operator*(Magpie::Vec3 lhs, float rhs);
-Magpie::Vec4 operator*(Magpie::Vec4 lhs, float rhs);
-Magpie::Vec3 operator*(float lhs, Magpie::Vec3 rhs);
-Magpie::Vec4 operator*(float lhs, Magpie::Vec4 rhs);
-Magpie::Vec3 operator/(Magpie::Vec3 lhs, float rhs);
-Magpie::Vec4 operator/(Magpie::Vec4 lhs, float rhs);
\ No newline at end of file
+constexpr Magpie::Vec3 operator+(Magpie::Vec3 lhs, const Magpie::Vec3& rhs) {
+    return Magpie::Vec3(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z);
+}
+
+constexpr Magpie::Vec3 operator-(Magpie::Vec3 lhs, const Magpie::Vec3& rhs) {
+    return Magpie::Vec3(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z);
+}
+
+constexpr Magpie::Vec3 operator*(Magpie::Vec3 lhs, float rhs) {
+    return Magpie::Vec3(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs);
+}
+
+constexpr Magpie::Vec3 operator*(float lhs, Magpie::Vec3 rhs) {
+    return Magpie::Vec3(lhs * rhs.x, lhs * rhs.y, lhs * rhs.z);
+}
+
+constexpr Magpie::Vec3 operator/(Magpie::Vec3 lhs, float rhs) {
+    return Magpie::Vec3(lhs.x / rhs, lhs.y / rhs, lhs.z / rhs);
+}
+
+inline Magpie::Vec4 operator+(Magpie::Vec4 lhs, const Magpie::Vec4& rhs) {
+#ifdef MAGPIE_MATH_SSE
+    return Magpie::Simd::Store(_mm_add_ps(Magpie::Simd::Load(lhs), Magpie::Simd::Load(rhs)));
+#else
+    return Magpie::Vec4(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z, lhs.w + rhs.w);
+#endif
+}
+
+inline Magpie::Vec4 operator-(Magpie::Vec4 lhs, const Magpie::Vec4& rhs) {
+#ifdef MAGPIE_MATH_SSE
+    return Magpie::Simd::Store(_mm_sub_ps(Magpie::Simd::Load(lhs), Magpie::Simd::Load(rhs)));
+#else
+    return Magpie::Vec4(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z, lhs.w - rhs.w);
+#endif
+}
+
+// component-wise
+inline Magpie::Vec4 operator*(Magpie::Vec4 lhs, const Magpie::Vec4& rhs) {
+#ifdef MAGPIE_MATH_SSE
+    return Magpie::Simd::Store(_mm_mul_ps(Magpie::Simd::Load(lhs), Magpie::Simd::Load(rhs)));
+#else
+    return Magpie::Vec4(lhs.x * rhs.x, lhs.y * rhs.y, lhs.z * rhs.z, lhs.w * rhs.w);
+#endif
+}
+
+inline Magpie::Vec4 operator*(Magpie::Vec4 lhs, float rhs) {
+#ifdef MAGPIE_MATH_SSE
+    return Magpie::Simd::Store(_mm_mul_ps(Magpie::Simd::Load(lhs), _mm_set1_ps(rhs)));
+#else
+    return Magpie::Vec4(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs, lhs.w * rhs);
+#endif
+}
+
+inline Magpie::Vec4 operator*(float lhs, Magpie::Vec4 rhs) {
+#ifdef MAGPIE_MATH_SSE
+    return Magpie::Simd::Store(_mm_mul_ps(_mm_set1_ps(lhs), Magpie::Simd::Load(rhs)));
+#else
+    return Magpie::Vec4(lhs * rhs.x, lhs * rhs.y, lhs * rhs.z, lhs * rhs.w);
+#endif
+}
+
+inline Magpie::Vec4 operator/(Magpie::Vec4 lhs, float rhs) {
+#ifdef MAGPIE_MATH_SSE
+    return Magpie::Simd::Store(_mm_div_ps(Magpie::Simd::Load(lhs), _mm_set1_ps(rhs)));
+#else
+    return Magpie::Vec4(lhs.x / rhs, lhs.y / rhs, lhs.z / rhs, lhs.w / rhs);
+#endif
+}
+
+inline Magpie::Vec4& Magpie::Vec4::operator+=(const Magpie::Vec4& rhs) {
+    return *this = *this + rhs;
+}
+
+inline Magpie::Vec4& Magpie::Vec4::operator-=(const Magpie::Vec4& rhs) {
+    return *this = *this - rhs;
+}
+
+inline Magpie::Vec3 Magpie::Vector::Normalize(Magpie::Vec3 v) {
+    return v / Magnitude(v);
+}
+
+inline Magpie::Vec4 Magpie::Vector::Normalize(Magpie::Vec4 v) {
+    return v / Magnitude(v);
+}
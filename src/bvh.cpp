@@ -0,0 +1,521 @@
+#include <Magpie/bvh.h>
+#include <Magpie/scene.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace Magpie;
+
+static float Axis(const Vec3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// nodes with at least this many primitives are binned and partitioned in parallel
+static const int ParallelThreshold = 1 << 14;
+// smaller subtrees are not worth handing to another thread
+static const int TaskThreshold = 1 << 10;
+static const float TraversalCost = 1.0f;
+
+struct BVH::BuildState {
+    BuildState(const std::vector<AABB>& bounds) : bounds(bounds), centroids(bounds.size()) {}
+    const std::vector<AABB>& bounds;
+    std::vector<Vec3> centroids;
+    std::vector<int> scratch;
+    ThreadPool* pool;
+    std::atomic<int> nodeCount;
+};
+
+struct Bin {
+    AABB bounds;
+    int count;
+};
+
+struct NodeInfo {
+    AABB bounds;
+    AABB centroidBounds;
+};
+
+static NodeInfo MergeInfo(const NodeInfo& a, const NodeInfo& b) {
+    NodeInfo info;
+    info.bounds = Bounds::Union(a.bounds, b.bounds);
+    info.centroidBounds = Bounds::Union(a.centroidBounds, b.centroidBounds);
+    return info;
+}
+
+static int BinIndex(float centroid, float min, float scale, int binCount) {
+    int bin = (int)((centroid - min) * scale);
+    return std::min(binCount - 1, std::max(0, bin));
+}
+
+void BVH::Build(const std::vector<AABB>& primitiveBounds, ThreadPool* pool) {
+    int count = primitiveBounds.size();
+    BuildState state(primitiveBounds);
+    state.pool = pool && pool->GetThreadCount() > 1 ? pool : nullptr;
+    state.nodeCount = 1;
+    primitiveIndices.resize(count);
+    auto prepare = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            primitiveIndices[i] = i;
+            state.centroids[i] = Bounds::Centroid(primitiveBounds[i]);
+        }
+    };
+    if (state.pool) {
+        state.scratch.resize(count);
+        state.pool->ParallelFor(0, count, ParallelThreshold, prepare);
+    } else {
+        prepare(0, count);
+    }
+
+    // a binary tree with at least one primitive per leaf has at most 2n-1 nodes
+    nodes.resize(std::max(1, 2 * count));
+    nodes[0].leftFirst = 0;
+    nodes[0].count = count;
+    Subdivide(0, 0, state);
+    nodes.resize(state.nodeCount);
+    buildCost = Cost();
+}
+
+void BVH::Refit(const std::vector<AABB>& primitiveBounds, ThreadPool* pool) {
+    if (primitiveBounds.empty()) {
+        return;
+    }
+    // leaves are independent, interior nodes are then visited from the back
+    // of the array because children are always stored after their parent
+    auto refitLeaves = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            BVHNode& node = nodes[i];
+            if (node.count == 0) continue;
+            node.bounds = Bounds::Empty();
+            for (int p = node.leftFirst; p < node.leftFirst + node.count; p++) {
+                node.bounds = Bounds::Union(node.bounds, primitiveBounds[primitiveIndices[p]]);
+            }
+        }
+    };
+    if (pool && pool->GetThreadCount() > 1 && nodes.size() >= TaskThreshold) {
+        pool->ParallelFor(0, nodes.size(), TaskThreshold, refitLeaves);
+    } else {
+        refitLeaves(0, nodes.size());
+    }
+    for (int i = nodes.size() - 1; i >= 0; i--) {
+        BVHNode& node = nodes[i];
+        if (node.count > 0) continue;
+        node.bounds = Bounds::Union(nodes[node.leftFirst].bounds, nodes[node.leftFirst + 1].bounds);
+    }
+}
+
+bool BVH::Load(std::vector<BVHNode> nodes, std::vector<int> primitiveIndices, int primitiveCount) {
+    if (nodes.empty() || primitiveIndices.size() != primitiveCount) return false;
+    for (std::size_t i = 0; i < primitiveIndices.size(); i++) {
+        if (primitiveIndices[i] < 0 || primitiveIndices[i] >= primitiveCount) return false;
+    }
+    // an empty tree is a lone root without primitives
+    if (primitiveCount == 0) {
+        if (nodes.size() != 1 || nodes[0].count != 0) return false;
+    } else {
+        // children come after their parent, so depths are final when a node is reached
+        std::vector<int> depths(nodes.size(), 0);
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            const BVHNode& node = nodes[i];
+            if (depths[i] > MaxDepth || node.count < 0) return false;
+            if (node.count > 0) {
+                if (node.leftFirst < 0 || node.leftFirst > primitiveCount - node.count) return false;
+                continue;
+            }
+            if (node.leftFirst <= (int)i || node.leftFirst >= (int)nodes.size() - 1) return false;
+            depths[node.leftFirst] = std::max(depths[node.leftFirst], depths[i] + 1);
+            depths[node.leftFirst + 1] = std::max(depths[node.leftFirst + 1], depths[i] + 1);
+        }
+    }
+    this->nodes.swap(nodes);
+    this->primitiveIndices.swap(primitiveIndices);
+    buildCost = Cost();
+    return true;
+}
+
+float BVH::Cost() {
+    float rootArea = Bounds::SurfaceArea(nodes[0].bounds);
+    if (rootArea <= 0.0f) {
+        return 0.0f;
+    }
+    float cost = 0.0f;
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+        float area = Bounds::SurfaceArea(nodes[i].bounds);
+        cost += area * (nodes[i].count > 0 ? nodes[i].count : TraversalCost);
+    }
+    return cost / rootArea;
+}
+
+float BVH::GetCostRatio() {
+    return buildCost > 0.0f ? Cost() / buildCost : 1.0f;
+}
+
+void BVH::Subdivide(int nodeIndex, int depth, BuildState& state) {
+    int first = nodes[nodeIndex].leftFirst;
+    int count = nodes[nodeIndex].count;
+    bool parallel = state.pool && count >= ParallelThreshold;
+
+    NodeInfo info;
+    info.bounds = Bounds::Empty();
+    info.centroidBounds = Bounds::Empty();
+    // serial nodes are the vast majority, so keep their scratch space off the heap
+    int chunks = parallel ? (count + ParallelThreshold - 1) / ParallelThreshold : 1;
+    std::vector<NodeInfo> heapInfo(parallel ? chunks : 0, info);
+    NodeInfo* chunkInfo = parallel ? heapInfo.data() : &info;
+    auto gather = [&](int begin, int end) {
+        NodeInfo& local = chunkInfo[(begin - first) / ParallelThreshold];
+        for (int i = begin; i < end; i++) {
+            local.bounds = Bounds::Union(local.bounds, state.bounds[primitiveIndices[i]]);
+            local.centroidBounds = Bounds::Union(local.centroidBounds, state.centroids[primitiveIndices[i]]);
+        }
+    };
+    if (parallel) {
+        state.pool->ParallelFor(first, first + count, ParallelThreshold, gather);
+    } else {
+        gather(first, first + count);
+    }
+    for (int i = 0; parallel && i < chunks; i++) {
+        info = MergeInfo(info, chunkInfo[i]);
+    }
+    nodes[nodeIndex].bounds = info.bounds;
+    if (count <= 1 || depth >= MaxDepth - 1) {
+        return;
+    }
+
+    // bin the centroids along every axis with a non-zero extent
+    Vec3 extent = info.centroidBounds.max - info.centroidBounds.min;
+    Bin empty;
+    empty.bounds = Bounds::Empty();
+    empty.count = 0;
+    // small nodes do not need the full bin resolution
+    int binCount = count < BinCount ? count : BinCount;
+    Bin localBins[3 * BinCount];
+    std::vector<Bin> heapBins(parallel ? chunks * 3 * BinCount : 0, empty);
+    Bin* chunkBins = parallel ? heapBins.data() : localBins;
+    for (int axis = 0; axis < 3; axis++) {
+        std::fill(localBins + axis * BinCount, localBins + axis * BinCount + binCount, empty);
+    }
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = Axis(extent, axis) > 0.0f ? binCount / Axis(extent, axis) : 0.0f;
+    }
+    auto bin = [&](int begin, int end) {
+        Bin* bins = &chunkBins[((begin - first) / ParallelThreshold) * 3 * BinCount];
+        for (int i = begin; i < end; i++) {
+            int p = primitiveIndices[i];
+            const AABB& bounds = state.bounds[p];
+            const Vec3& centroid = state.centroids[p];
+            for (int axis = 0; axis < 3; axis++) {
+                if (scale[axis] == 0.0f) continue;
+                Bin& b = bins[axis * BinCount + BinIndex(Axis(centroid, axis), Axis(info.centroidBounds.min, axis), scale[axis], binCount)];
+                b.bounds = Bounds::Union(b.bounds, bounds);
+                b.count++;
+            }
+        }
+    };
+    if (parallel) {
+        state.pool->ParallelFor(first, first + count, ParallelThreshold, bin);
+    } else {
+        bin(first, first + count);
+    }
+
+    // sweep the bins from both sides to evaluate every candidate split plane
+    float parentArea = Bounds::SurfaceArea(info.bounds);
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    int bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.0f) continue;
+        Bin bins[BinCount];
+        for (int b = 0; b < binCount; b++) {
+            bins[b] = empty;
+            for (int c = 0; c < chunks; c++) {
+                const Bin& other = chunkBins[(c * 3 + axis) * BinCount + b];
+                bins[b].bounds = Bounds::Union(bins[b].bounds, other.bounds);
+                bins[b].count += other.count;
+            }
+        }
+        float leftCost[BinCount - 1];
+        AABB leftBounds = Bounds::Empty();
+        int leftCount = 0;
+        for (int b = 0; b < binCount - 1; b++) {
+            leftBounds = Bounds::Union(leftBounds, bins[b].bounds);
+            leftCount += bins[b].count;
+            leftCost[b] = leftCount * Bounds::SurfaceArea(leftBounds);
+        }
+        AABB rightBounds = Bounds::Empty();
+        int rightCount = 0;
+        for (int b = binCount - 1; b > 0; b--) {
+            rightBounds = Bounds::Union(rightBounds, bins[b].bounds);
+            rightCount += bins[b].count;
+            if (rightCount == 0 || rightCount == count) continue;
+            float cost = leftCost[b - 1] + rightCount * Bounds::SurfaceArea(rightBounds);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    int leftCount;
+    if (bestAxis == -1) {
+        // every centroid coincides, so halve the range to keep leaves small
+        if (count <= MaxLeafSize) return;
+        leftCount = count / 2;
+    } else {
+        float splitCost = TraversalCost + bestCost / std::max(parentArea, std::numeric_limits<float>::min());
+        if (count <= MaxLeafSize && splitCost >= count) {
+            return;
+        }
+        float min = Axis(info.centroidBounds.min, bestAxis);
+        auto isLeft = [&](int p) {
+            return BinIndex(Axis(state.centroids[p], bestAxis), min, scale[bestAxis], binCount) < bestSplit;
+        };
+        int* begin = primitiveIndices.data() + first;
+        if (parallel) {
+            // count each chunk's left side, then scatter both sides through the scratch array
+            std::vector<int> chunkLeft(chunks);
+            state.pool->ParallelFor(first, first + count, ParallelThreshold, [&](int b, int e) {
+                int n = 0;
+                for (int i = b; i < e; i++) n += isLeft(primitiveIndices[i]);
+                chunkLeft[(b - first) / ParallelThreshold] = n;
+            });
+            std::vector<int> leftOffset(chunks), rightOffset(chunks);
+            int totalLeft = 0;
+            for (int c = 0; c < chunks; c++) {
+                leftOffset[c] = totalLeft;
+                totalLeft += chunkLeft[c];
+            }
+            for (int c = 0; c < chunks; c++) {
+                rightOffset[c] = totalLeft + c * ParallelThreshold - leftOffset[c];
+            }
+            state.pool->ParallelFor(first, first + count, ParallelThreshold, [&](int b, int e) {
+                int c = (b - first) / ParallelThreshold;
+                int l = first + leftOffset[c], r = first + rightOffset[c];
+                for (int i = b; i < e; i++) {
+                    int p = primitiveIndices[i];
+                    state.scratch[isLeft(p) ? l++ : r++] = p;
+                }
+            });
+            state.pool->ParallelFor(first, first + count, ParallelThreshold, [&](int b, int e) {
+                std::copy(state.scratch.begin() + b, state.scratch.begin() + e, primitiveIndices.begin() + b);
+            });
+            leftCount = totalLeft;
+        } else {
+            leftCount = std::partition(begin, begin + count, isLeft) - begin;
+        }
+    }
+
+    int leftIndex = state.nodeCount.fetch_add(2);
+    nodes[leftIndex].leftFirst = first;
+    nodes[leftIndex].count = leftCount;
+    nodes[leftIndex + 1].leftFirst = first + leftCount;
+    nodes[leftIndex + 1].count = count - leftCount;
+    nodes[nodeIndex].leftFirst = leftIndex;
+    nodes[nodeIndex].count = 0;
+
+    if (state.pool && std::min(leftCount, count - leftCount) >= TaskThreshold) {
+        TaskGroup group(*state.pool);
+        group.Run([this, leftIndex, depth, &state]() {
+            Subdivide(leftIndex, depth + 1, state);
+        });
+        Subdivide(leftIndex + 1, depth + 1, state);
+        group.Wait();
+    } else {
+        Subdivide(leftIndex, depth + 1, state);
+        Subdivide(leftIndex + 1, depth + 1, state);
+    }
+}
+
+const std::vector<BVHNode>& BVH::GetNodes() {
+    return nodes;
+}
+
+const std::vector<int>& BVH::GetPrimitiveIndices() {
+    return primitiveIndices;
+}
+
+// WideBVH
+void WideBVH::Build(BVH& bvh) {
+    const std::vector<BVHNode>& binary = bvh.GetNodes();
+    nodes.clear();
+    sources.clear();
+    nodes.push_back(WideBVHNode());
+    bool empty = binary[0].count == 0 && binary[0].leftFirst == 0;
+    std::vector<int> opened(1, empty ? -1 : 0);
+
+    // nodes are created breadth-first, so children always follow their parent
+    for (int w = 0; w < nodes.size(); w++) {
+        int slots[Width];
+        int slotCount = 0;
+        int source = opened[w];
+        if (source >= 0 && binary[source].count > 0) {
+            slots[slotCount++] = source;
+        } else if (source >= 0) {
+            slots[slotCount++] = binary[source].leftFirst;
+            slots[slotCount++] = binary[source].leftFirst + 1;
+            // keep opening the interior child with the largest surface area
+            while (slotCount < Width) {
+                int largest = -1;
+                float largestArea = -1.0f;
+                for (int i = 0; i < slotCount; i++) {
+                    float area = Bounds::SurfaceArea(binary[slots[i]].bounds);
+                    if (binary[slots[i]].count == 0 && area > largestArea) {
+                        largest = i;
+                        largestArea = area;
+                    }
+                }
+                if (largest == -1) break;
+                int opening = slots[largest];
+                slots[largest] = binary[opening].leftFirst;
+                slots[slotCount++] = binary[opening].leftFirst + 1;
+            }
+        }
+
+        // indexed rather than referenced, since appending children may reallocate
+        nodes[w].childCount = slotCount;
+        for (int i = 0; i < Width; i++) {
+            sources.push_back(i < slotCount ? slots[i] : -1);
+            nodes[w].child[i] = -1;
+            nodes[w].count[i] = 0;
+            if (i >= slotCount) continue;
+            const BVHNode& child = binary[slots[i]];
+            if (child.count > 0) {
+                nodes[w].child[i] = child.leftFirst;
+                nodes[w].count[i] = child.count;
+            } else {
+                nodes[w].child[i] = nodes.size();
+                nodes.push_back(WideBVHNode());
+                opened.push_back(slots[i]);
+            }
+        }
+    }
+    for (int w = 0; w < nodes.size(); w++) {
+        Quantize(w, binary);
+    }
+}
+
+void WideBVH::Refit(BVH& bvh) {
+    const std::vector<BVHNode>& binary = bvh.GetNodes();
+    for (int w = 0; w < nodes.size(); w++) {
+        Quantize(w, binary);
+    }
+}
+
+void WideBVH::Quantize(int nodeIndex, const std::vector<BVHNode>& binary) {
+    WideBVHNode& node = nodes[nodeIndex];
+    const int* slots = &sources[nodeIndex * Width];
+    AABB bounds = Bounds::Empty();
+    for (int i = 0; i < node.childCount; i++) {
+        bounds = Bounds::Union(bounds, binary[slots[i]].bounds);
+    }
+    if (node.childCount == 0) {
+        bounds.min = Vec3(0.0f, 0.0f, 0.0f);
+        bounds.max = Vec3(0.0f, 0.0f, 0.0f);
+    }
+
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = Axis(bounds.min, axis);
+        float extent = Axis(bounds.max, axis) - lo;
+        // smallest power of two grid spacing whose 255 steps cover the extent
+        int exponent = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+        exponent = std::max(-126, exponent);
+        while (std::ldexp(255.0f, exponent) < extent) exponent++;
+        node.origin[axis] = lo;
+        node.exponent[axis] = exponent;
+        scale[axis] = std::ldexp(1.0f, exponent);
+    }
+
+    for (int i = 0; i < Width; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            if (i >= node.childCount) {
+                // an inverted box that no ray can enter
+                node.qmin[axis][i] = 255;
+                node.qmax[axis][i] = 0;
+                continue;
+            }
+            const AABB& child = binary[slots[i]].bounds;
+            float lo = node.origin[axis];
+            float s = scale[axis];
+            // round outwards so the decoded box always contains the child
+            int qmin = std::max(0, std::min(255, (int)std::floor((Axis(child.min, axis) - lo) / s)));
+            int qmax = std::max(0, std::min(255, (int)std::ceil((Axis(child.max, axis) - lo) / s)));
+            while (qmin > 0 && lo + qmin * s > Axis(child.min, axis)) qmin--;
+            while (qmax < 255 && lo + qmax * s < Axis(child.max, axis)) qmax++;
+            node.qmin[axis][i] = qmin;
+            node.qmax[axis][i] = qmax;
+        }
+    }
+}
+
+const std::vector<WideBVHNode>& WideBVH::GetNodes() {
+    return nodes;
+}
+
+// Bounds
+AABB Bounds::Empty() {
+    float inf = std::numeric_limits<float>::infinity();
+    AABB box;
+    box.min = Vec3(inf, inf, inf);
+    box.max = Vec3(-inf, -inf, -inf);
+    return box;
+}
+
+AABB Bounds::Of(const Sphere& sphere) {
+    Vec3 r(sphere.radius, sphere.radius, sphere.radius);
+    AABB box;
+    box.min = sphere.center - r;
+    box.max = sphere.center + r;
+    return box;
+}
+
+AABB Bounds::Of(const Triangle& triangle) {
+    AABB box = Bounds::Empty();
+    box = Bounds::Union(box, triangle.a);
+    box = Bounds::Union(box, triangle.b);
+    box = Bounds::Union(box, triangle.c);
+    return box;
+}
+
+AABB Bounds::Union(const AABB& a, const AABB& b) {
+    AABB box;
+    box.min = Vec3(std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z));
+    box.max = Vec3(std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z));
+    return box;
+}
+
+AABB Bounds::Union(const AABB& a, const Vec3& p) {
+    AABB box;
+    box.min = Vec3(std::min(a.min.x, p.x), std::min(a.min.y, p.y), std::min(a.min.z, p.z));
+    box.max = Vec3(std::max(a.max.x, p.x), std::max(a.max.y, p.y), std::max(a.max.z, p.z));
+    return box;
+}
+
+AABB Bounds::Transform(const AABB& box, const Mat4& transform) {
+    Vec3 corners[8];
+    for (int corner = 0; corner < 8; corner++) {
+        corners[corner] = Vec3(corner & 1 ? box.max.x : box.min.x,
+                               corner & 2 ? box.max.y : box.min.y,
+                               corner & 4 ? box.max.z : box.min.z);
+    }
+    Matrix::TransformPoints(transform, corners, corners, 8);
+    AABB result = Bounds::Empty();
+    for (int corner = 0; corner < 8; corner++) {
+        result = Bounds::Union(result, corners[corner]);
+    }
+    return result;
+}
+
+Vec3 Bounds::Centroid(const AABB& box) {
+    return 0.5f * (box.min + box.max);
+}
+
+float Bounds::SurfaceArea(const AABB& box) {
+    Vec3 e = box.max - box.min;
+    if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f) {
+        return 0.0f;
+    }
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
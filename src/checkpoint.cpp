@@ -0,0 +1,114 @@
+#include <Magpie/checkpoint.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace Magpie;
+
+// "MGPCKPT" and the format version, then the fields in order as little endian words
+static const char Magic[8] = {'M', 'G', 'P', 'C', 'K', 'P', 'T', '1'};
+
+static void PutU32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back((char)((value >> (8 * i)) & 0xff));
+    }
+}
+
+static uint32_t GetU32(const unsigned char* in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+// Makes a rename in the directory of filename durable. Windows has no equivalent
+// and commits renames with the directory entry anyway.
+static void SyncDirectory(const std::string& filename) {
+#ifndef _WIN32
+    std::size_t slash = filename.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+    int handle = open(directory.c_str(), O_RDONLY);
+    if (handle < 0) return;
+    fsync(handle);
+    close(handle);
+#endif
+}
+
+bool Magpie::SaveCheckpoint(const std::string& filename, const RenderCheckpoint& checkpoint) {
+    std::string data(Magic, Magic + 8);
+    PutU32(data, checkpoint.width);
+    PutU32(data, checkpoint.height);
+    PutU32(data, checkpoint.firstSample);
+    PutU32(data, checkpoint.samples);
+    PutU32(data, checkpoint.samplesDone);
+    PutU32(data, checkpoint.fingerprint & 0xffffffffu);
+    PutU32(data, checkpoint.fingerprint >> 32);
+    data.reserve(data.size() + checkpoint.sum.size() * 4);
+    for (std::size_t i = 0; i < checkpoint.sum.size(); i++) {
+        uint32_t bits;
+        std::memcpy(&bits, &checkpoint.sum[i], sizeof(bits));
+        PutU32(data, bits);
+    }
+
+    // one temporary per process, so two renders saving the same checkpoint never
+    // write into the same file
+#ifdef _WIN32
+    std::string temporary = filename + "." + std::to_string(_getpid()) + ".tmp";
+#else
+    std::string temporary = filename + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) return false;
+    // the data has to reach the disk before the rename does, or a crash can leave
+    // an empty file under the checkpoint's name
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size() && std::fflush(file) == 0;
+#ifdef _WIN32
+    written = written && _commit(_fileno(file)) == 0;
+#else
+    written = written && fsync(fileno(file)) == 0;
+#endif
+    written = std::fclose(file) == 0 && written;
+    if (!written) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        // Windows does not rename over an existing file
+        std::remove(filename.c_str());
+        if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    SyncDirectory(filename);
+    return true;
+}
+
+bool Magpie::LoadCheckpoint(const std::string& filename, RenderCheckpoint& checkpoint) {
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const std::size_t headerSize = 8 + 7 * 4;
+    if (data.size() < headerSize || std::memcmp(data.data(), Magic, 8) != 0) return false;
+    const unsigned char* fields = data.data() + 8;
+    checkpoint.width = GetU32(fields);
+    checkpoint.height = GetU32(fields + 4);
+    checkpoint.firstSample = GetU32(fields + 8);
+    checkpoint.samples = GetU32(fields + 12);
+    checkpoint.samplesDone = GetU32(fields + 16);
+    checkpoint.fingerprint = GetU32(fields + 20) | ((uint64_t)GetU32(fields + 24) << 32);
+    std::size_t count = (std::size_t)checkpoint.width * checkpoint.height * 4;
+    if (data.size() != headerSize + count * 4 || checkpoint.samplesDone > checkpoint.samples) return false;
+    checkpoint.sum.resize(count);
+    for (std::size_t i = 0; i < count; i++) {
+        uint32_t bits = GetU32(&data[headerSize + 4 * i]);
+        std::memcpy(&checkpoint.sum[i], &bits, sizeof(bits));
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#include <Magpie.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+
+// Converts a YAML scene into the binary format, with its trees built and its sky
+// decoded ahead of time, so that loading it costs little more than reading the file.
+// LoadSceneFromFile, and so every tool that takes a scene, reads either format.
+
+static void PrintUsage() {
+    std::cerr << "usage: MagpieConvert <scene.yaml> <scene.mgs>\n";
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 3) {
+        PrintUsage();
+        return argc == 2 && std::string(argv[1]) == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Magpie::Scene scene;
+    try {
+        scene = Magpie::LoadSceneFromFile(argv[1]);
+        // decoded here rather than by SaveBinaryScene to report why it failed
+        if (scene.sky.pixels.empty() && !scene.skyFilename.empty()) {
+            scene.sky = Magpie::LoadTexture(scene.skyFilename);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "failed to load " << argv[1] << ": " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    if (!Magpie::SaveBinaryScene(argv[2], scene)) {
+        std::cerr << "failed to write " << argv[2] << "\n";
+        return EXIT_FAILURE;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << argv[2] << ": " << scene.GetSpheres().size() << " spheres, " << scene.GetTriangles().size()
+              << " triangles, " << scene.GetMeshes().size() << " meshes in " << elapsed.count() << " s" << std::endl;
+    return EXIT_SUCCESS;
+}
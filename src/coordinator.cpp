@@ -0,0 +1,322 @@
+#include <Magpie.h>
+#include "net.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Renders one image on several MagpieServer workers. The samples per pixel are split
+// into chunks, each rendered over the whole image by one worker with its own range of
+// the random sequence, and the partial images are merged weighted by their sample
+// counts. That gives the image a single process would have rendered, up to rounding.
+// A chunk goes back into the queue when its worker fails or times out, and once the
+// queue is empty idle workers take a second copy of chunks still running, so a slow
+// worker cannot hold up the end of the frame.
+
+// consecutive failures before a worker is given up on
+static const int MaxFailures = 3;
+
+static void PrintUsage() {
+    std::cerr << "usage: MagpieCoordinator <scene.yaml> --workers <address,...> [options]\n"
+                 "  --workers <list>     comma separated worker addresses, unix:<path> or <host>:<port>\n"
+                 "  --chunk <samples>    samples per pixel in one job (8)\n"
+                 "  --timeout <seconds>  time a job may take before it is reissued (300)\n"
+                 "  and the options of MagpieRender, which workers receive as they are\n";
+}
+
+struct Chunk {
+    unsigned int first;
+    unsigned int count;
+    int running = 0; // workers rendering it right now
+    bool done = false;
+    std::chrono::steady_clock::time_point started;
+};
+
+struct Coordinator {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<Chunk> chunks;
+    std::deque<int> ready;
+    unsigned int remaining = 0;
+    int liveWorkers = 0;
+    unsigned int reissued = 0;
+    std::vector<float> sum; // partial images weighted by their sample counts
+    std::vector<int> sockets; // per worker, -1 while not connected
+    std::string lastError;
+
+    // the next chunk for a worker, or -1 once every chunk is done
+    int Next() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (remaining > 0) {
+            int chunk = -1;
+            if (!ready.empty()) {
+                chunk = ready.front();
+                ready.pop_front();
+            } else {
+                // the longest running chunk that no other worker duplicates yet
+                for (std::size_t i = 0; i < chunks.size(); i++) {
+                    if (chunks[i].done || chunks[i].running != 1) continue;
+                    if (chunk < 0 || chunks[i].started < chunks[chunk].started) chunk = i;
+                }
+                if (chunk >= 0) reissued++;
+            }
+            if (chunk >= 0) {
+                if (chunks[chunk].running == 0) chunks[chunk].started = std::chrono::steady_clock::now();
+                chunks[chunk].running++;
+                return chunk;
+            }
+            changed.wait(lock);
+        }
+        return -1;
+    }
+
+    void Complete(int chunk, const std::vector<float>& pixels) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Chunk& c = chunks[chunk];
+        c.running--;
+        // the copy that finishes second is dropped
+        if (!c.done) {
+            c.done = true;
+            remaining--;
+            for (std::size_t i = 0; i < sum.size(); i++) {
+                sum[i] += pixels[i] * c.count;
+            }
+        }
+        changed.notify_all();
+    }
+
+    // returns false if another worker finished the chunk already
+    bool Fail(int chunk, const std::string& error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Chunk& c = chunks[chunk];
+        c.running--;
+        if (c.done) return false;
+        if (c.running == 0) {
+            ready.push_front(chunk);
+            reissued++;
+        }
+        if (!error.empty()) lastError = error;
+        changed.notify_all();
+        return true;
+    }
+
+    void Retire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        liveWorkers--;
+        changed.notify_all();
+    }
+
+    void SetSocket(int worker, int socket) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (socket < 0 && sockets[worker] >= 0) close(sockets[worker]);
+        sockets[worker] = socket;
+    }
+};
+
+enum class Outcome {
+    Done,
+    Busy,
+    Failed
+};
+
+static Outcome RenderChunk(int socket, std::string& buffer, const std::string& request, const Chunk& chunk,
+                           unsigned int width, unsigned int height, int timeoutMilliseconds,
+                           std::vector<float>& pixels, std::string& error) {
+    std::ostringstream line;
+    line << "partial " << request << " --first-sample " << chunk.first << " --spp " << chunk.count << "\n";
+    std::string reply;
+    if (!Magpie::Net::SendAll(socket, line.str()) || !Magpie::Net::ReadLine(socket, buffer, reply, timeoutMilliseconds)) {
+        error = "no reply";
+        return Outcome::Failed;
+    }
+    if (reply == "busy") {
+        return Outcome::Busy;
+    }
+    unsigned int replyWidth, replyHeight, replySamples;
+    std::istringstream fields(reply);
+    std::string status;
+    fields >> status >> replyWidth >> replyHeight >> replySamples;
+    if (status != "ok" || !fields || replyWidth != width || replyHeight != height || replySamples != chunk.count) {
+        error = reply;
+        return Outcome::Failed;
+    }
+    std::size_t count = (std::size_t)width * height * 4;
+    std::string data;
+    if (!Magpie::Net::ReadExact(socket, buffer, data, count * 4, timeoutMilliseconds)) {
+        error = "incomplete image";
+        return Outcome::Failed;
+    }
+    pixels.resize(count);
+    Magpie::Net::ReadFloats(data, pixels.data(), count);
+    return Outcome::Done;
+}
+
+static void RunWorker(Coordinator& coordinator, int worker, const std::string& address, const std::string& request,
+                      unsigned int width, unsigned int height, int timeoutMilliseconds) {
+    int failures = 0;
+    int socket = -1;
+    std::string buffer;
+    std::vector<float> pixels;
+    while (true) {
+        int chunk = coordinator.Next();
+        if (chunk < 0) break;
+        if (socket < 0) {
+            socket = Magpie::Net::Connect(address);
+            buffer.clear();
+            coordinator.SetSocket(worker, socket);
+        }
+        // Connect has said why it failed already
+        bool connected = socket >= 0;
+        std::string error = "failed to connect";
+        Outcome outcome = Outcome::Failed;
+        if (connected) {
+            outcome = RenderChunk(socket, buffer, request, coordinator.chunks[chunk], width, height, timeoutMilliseconds, pixels, error);
+        }
+        if (outcome == Outcome::Done) {
+            failures = 0;
+            coordinator.Complete(chunk, pixels);
+            continue;
+        }
+        if (outcome == Outcome::Busy) {
+            // the worker is serving other clients, which is no fault of its own
+            coordinator.Fail(chunk, "");
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            continue;
+        }
+        // a reply that timed out may still arrive, so the connection is not reused
+        coordinator.SetSocket(worker, -1);
+        socket = -1;
+        if (!coordinator.Fail(chunk, address + ": " + error)) continue;
+        if (connected) std::cerr << address << ": " << error << "\n";
+        if (++failures >= MaxFailures) {
+            std::cerr << address << ": giving up after " << failures << " failures\n";
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500 * failures));
+    }
+    coordinator.SetSocket(worker, -1);
+    coordinator.Retire();
+}
+
+int main(int argc, char ** argv) {
+    std::vector<std::string> workers;
+    unsigned int chunkSize = 8;
+    int timeoutSeconds = 300;
+    // options for the workers, without the ones each chunk sets itself
+    std::vector<std::string> renderArguments;
+    std::string request;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help") {
+            PrintUsage();
+            return EXIT_SUCCESS;
+        }
+        bool coordinatorOption = arg == "--workers" || arg == "--chunk" || arg == "--timeout";
+        if (coordinatorOption && i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << "\n";
+            return EXIT_FAILURE;
+        }
+        if (arg == "--workers") {
+            std::istringstream list(argv[++i]);
+            std::string address;
+            while (std::getline(list, address, ',')) {
+                if (!address.empty()) workers.push_back(address);
+            }
+        } else if (arg == "--chunk") {
+            chunkSize = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--timeout") {
+            timeoutSeconds = std::max(1, std::atoi(argv[++i]));
+        } else {
+            renderArguments.push_back(arg);
+            bool perChunk = arg == "-o" || arg == "--output" || arg == "--spp" || arg == "--first-sample";
+            if (arg[0] == '-' && i + 1 < argc) {
+                renderArguments.push_back(argv[++i]);
+                if (!perChunk) request += " " + arg + " " + argv[i];
+            } else if (!perChunk) {
+                request += " " + arg;
+            }
+        }
+    }
+
+    Magpie::RenderJob job;
+    std::string error;
+    if (!Magpie::ParseRenderJob(renderArguments, job, error)) {
+        std::cerr << error << "\n";
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+    if (!job.checkpoint.empty()) {
+        // the merged chunks are the checkpoints here, a rerun starts over
+        std::cerr << "checkpoints are not supported by the coordinator.\n";
+        return EXIT_FAILURE;
+    }
+    if (workers.empty()) {
+        std::cerr << "no workers specified.\n";
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+    // a worker hanging up must not take the coordinator with it
+    signal(SIGPIPE, SIG_IGN);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Coordinator coordinator;
+    for (unsigned int first = 0; first < job.samples; first += chunkSize) {
+        Chunk chunk;
+        chunk.first = job.firstSample + first;
+        chunk.count = std::min(chunkSize, job.samples - first);
+        coordinator.ready.push_back(coordinator.chunks.size());
+        coordinator.chunks.push_back(chunk);
+    }
+    coordinator.remaining = coordinator.chunks.size();
+    coordinator.liveWorkers = workers.size();
+    coordinator.sum.assign((std::size_t)job.width * job.height * 4, 0.0f);
+    coordinator.sockets.assign(workers.size(), -1);
+
+    std::vector<std::thread> threads;
+    for (std::size_t w = 0; w < workers.size(); w++) {
+        threads.push_back(std::thread(RunWorker, std::ref(coordinator), (int)w, workers[w], request.substr(1),
+                                      job.width, job.height, timeoutSeconds * 1000));
+    }
+    {
+        std::unique_lock<std::mutex> lock(coordinator.mutex);
+        coordinator.changed.wait(lock, [&coordinator]() { return coordinator.remaining == 0 || coordinator.liveWorkers == 0; });
+        // workers still rendering a duplicate stop waiting for it
+        for (std::size_t w = 0; w < workers.size(); w++) {
+            if (coordinator.sockets[w] >= 0) shutdown(coordinator.sockets[w], SHUT_RDWR);
+        }
+    }
+    for (std::size_t w = 0; w < threads.size(); w++) {
+        threads[w].join();
+    }
+    if (coordinator.remaining > 0) {
+        std::cerr << "every worker failed, the last with " << coordinator.lastError << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<float>& pixels = coordinator.sum;
+    for (std::size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] /= job.samples;
+    }
+    if (!Magpie::Image::Write(job.output, job.width, job.height, pixels.data(), job.exposure)) {
+        std::cerr << "failed to write " << job.output << "\n";
+        return EXIT_FAILURE;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << job.output << ": " << job.width << "x" << job.height << ", " << job.samples << " spp in "
+              << coordinator.chunks.size() << " chunks on " << workers.size() << " workers, "
+              << coordinator.reissued << " reissued, " << elapsed.count() << " s" << std::endl;
+    return EXIT_SUCCESS;
+}
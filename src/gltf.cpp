@@ -0,0 +1,411 @@
+#include <yaml-cpp/yaml.h>
+
+#include <Magpie/gltf.h>
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using namespace Magpie;
+
+// The JSON chunk is small next to the binary one and is parsed with yaml-cpp, JSON
+// being a subset of YAML. Vertex data is never copied into intermediate arrays:
+// accessors are resolved to a pointer and a stride into the mapped buffers, and
+// triangles are assembled straight from them into the storage of their mesh.
+
+static const uint32_t Magic = 0x46546c67; // "glTF"
+static const uint32_t JSONChunk = 0x4e4f534a;
+static const uint32_t BinaryChunk = 0x004e4942;
+
+enum ComponentType {
+    UnsignedByte = 5121,
+    UnsignedShort = 5123,
+    UnsignedInt = 5125,
+    Float = 5126
+};
+
+enum PrimitiveMode {
+    Triangles = 4,
+    TriangleStrip = 5,
+    TriangleFan = 6
+};
+
+// glTF is little endian, whatever the host
+static inline uint32_t ReadU32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline float ReadF32(const unsigned char* p) {
+    uint32_t bits = ReadU32(p);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+namespace {
+    struct Buffer {
+        const unsigned char* data;
+        std::size_t size;
+    };
+
+    // where the elements of an accessor are in a mapped buffer
+    struct AccessorView {
+        const unsigned char* data;
+        std::size_t count;
+        std::size_t stride;
+        int componentType;
+        int components;
+    };
+
+    class Importer {
+        public:
+            Importer(const std::string& filename) : filename(filename) {}
+            ~Importer();
+            void Open();
+            void ReadMaterials(Scene& scene);
+            void ReadNodes(const Mat4& transform);
+            void AddTo(Scene& scene);
+        private:
+            [[noreturn]] void Fail(const std::string& message);
+            AccessorView Accessor(int index);
+            uint32_t Index(const AccessorView& indices, std::size_t i);
+            int Mesh(int index);
+            void Visit(int node, const Mat4& parent, int depth);
+            std::string filename;
+            MappedFile file;
+            std::vector<MappedFile*> externalFiles;
+            YAML::Node json;
+            std::vector<Buffer> buffers;
+            int firstMaterial = 0;
+            int defaultMaterial = -1;
+            // collected apart from the scene until everything was read
+            std::vector<Material> materials;
+            std::vector<Magpie::Mesh> meshes;
+            std::vector<Instance> instances;
+            std::vector<int> meshIndices; // of every glTF mesh in meshes, -1 until used
+    };
+}
+
+Importer::~Importer() {
+    for (std::size_t i = 0; i < externalFiles.size(); i++) {
+        delete externalFiles[i];
+    }
+}
+
+void Importer::Fail(const std::string& message) {
+    throw std::runtime_error(filename + ": " + message);
+}
+
+void Importer::Open() {
+    if (!file.Open(filename)) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+    const unsigned char* data = (const unsigned char*)file.data;
+    if (file.size < 20 || ReadU32(data) != Magic) Fail("not a binary glTF file");
+    if (ReadU32(data + 4) != 2) Fail("only glTF 2.0 is supported");
+    std::size_t length = std::min<std::size_t>(ReadU32(data + 8), file.size);
+
+    // the JSON chunk comes first, the binary one may follow
+    const unsigned char* binary = nullptr;
+    std::size_t binarySize = 0;
+    for (std::size_t offset = 12; offset + 8 <= length; ) {
+        std::size_t size = ReadU32(data + offset);
+        uint32_t type = ReadU32(data + offset + 4);
+        if (size > length - offset - 8) Fail("chunk runs past the end of the file");
+        const unsigned char* chunk = data + offset + 8;
+        if (offset == 12 && type != JSONChunk) Fail("the first chunk is not JSON");
+        if (type == JSONChunk && offset == 12) {
+            json = YAML::Load(std::string((const char*)chunk, size));
+        } else if (type == BinaryChunk && binary == nullptr) {
+            binary = chunk;
+            binarySize = size;
+        }
+        // chunks are padded to four bytes
+        offset += 8 + (size + 3) / 4 * 4;
+    }
+    if (!json.IsMap()) Fail("no JSON chunk");
+    if (json["extensionsRequired"] && json["extensionsRequired"].size() > 0) {
+        Fail("requires extension " + json["extensionsRequired"][0].as<std::string>());
+    }
+
+    // the buffer without a uri is the binary chunk, others are files next to this one
+    YAML::Node bufferData = json["buffers"];
+    for (std::size_t i = 0; i < bufferData.size(); i++) {
+        Buffer buffer;
+        std::size_t byteLength = bufferData[i]["byteLength"].as<std::size_t>();
+        if (!bufferData[i]["uri"]) {
+            if (binary == nullptr || binarySize < byteLength) Fail("buffer " + std::to_string(i) + " is missing");
+            buffer.data = binary;
+        } else {
+            std::string uri = bufferData[i]["uri"].as<std::string>();
+            if (uri.compare(0, 5, "data:") == 0) Fail("embedded data uris are not supported");
+            std::size_t slash = filename.find_last_of("/\\");
+            std::string path = slash == std::string::npos ? uri : filename.substr(0, slash + 1) + uri;
+            MappedFile* external = new MappedFile();
+            externalFiles.push_back(external);
+            if (!external->Open(path) || external->size < byteLength) Fail("failed to read buffer " + path);
+            buffer.data = (const unsigned char*)external->data;
+        }
+        buffer.size = byteLength;
+        buffers.push_back(buffer);
+    }
+}
+
+AccessorView Importer::Accessor(int index) {
+    YAML::Node accessor = json["accessors"][index];
+    std::string name = "accessor " + std::to_string(index);
+    if (!accessor.IsMap()) Fail(name + " does not exist");
+    if (accessor["sparse"]) Fail(name + " is sparse, which is not supported");
+    if (!accessor["bufferView"]) Fail(name + " has no buffer view");
+
+    AccessorView view;
+    view.count = accessor["count"].as<std::size_t>();
+    view.componentType = accessor["componentType"].as<int>();
+    std::string type = accessor["type"].as<std::string>();
+    view.components = type == "SCALAR" ? 1 : type == "VEC2" ? 2 : type == "VEC3" ? 3 : type == "VEC4" ? 4 : 0;
+    bool known = view.componentType == UnsignedByte || view.componentType == UnsignedShort ||
+                 view.componentType == UnsignedInt || view.componentType == Float;
+    if (!known || view.components == 0) Fail(name + " has an unsupported type");
+    std::size_t componentSize = view.componentType == UnsignedByte ? 1 : view.componentType == UnsignedShort ? 2 : 4;
+    std::size_t elementSize = view.components * componentSize;
+
+    YAML::Node bufferView = json["bufferViews"][accessor["bufferView"].as<int>()];
+    if (!bufferView.IsMap()) Fail(name + " has no buffer view");
+    std::size_t buffer = bufferView["buffer"].as<std::size_t>();
+    std::size_t viewOffset = bufferView["byteOffset"] ? bufferView["byteOffset"].as<std::size_t>() : 0;
+    std::size_t viewLength = bufferView["byteLength"].as<std::size_t>();
+    std::size_t offset = accessor["byteOffset"] ? accessor["byteOffset"].as<std::size_t>() : 0;
+    view.stride = bufferView["byteStride"] ? bufferView["byteStride"].as<std::size_t>() : elementSize;
+    if (view.stride < elementSize) Fail(name + " has elements that overlap");
+    if (buffer >= buffers.size() || viewOffset > buffers[buffer].size || viewLength > buffers[buffer].size - viewOffset) {
+        Fail(name + " lies outside its buffer");
+    }
+    // the last element only needs its own bytes, not a full stride
+    if (view.count > 0 && (offset > viewLength || viewLength - offset < elementSize ||
+                           (viewLength - offset - elementSize) / view.stride < view.count - 1)) {
+        Fail(name + " lies outside its buffer view");
+    }
+    view.data = buffers[buffer].data + viewOffset + offset;
+    return view;
+}
+
+uint32_t Importer::Index(const AccessorView& indices, std::size_t i) {
+    const unsigned char* p = indices.data + i * indices.stride;
+    switch (indices.componentType) {
+        case UnsignedByte: return p[0];
+        case UnsignedShort: return p[0] | (p[1] << 8);
+        default: return ReadU32(p);
+    }
+}
+
+// Metallic surfaces reflect their base color, others reflect 4% and scatter the
+// rest. The tracers only know mirror reflection, so rough surfaces reflect less
+// and scatter what a rough metal would have reflected, in its base color.
+static Material ConvertMaterial(Vec3 baseColor, float metallic, float roughness) {
+    Material material;
+    float reflection = 1.0f - roughness;
+    float scattered = 1.0f - metallic * reflection;
+    material.specular = Vec3((0.04f + (baseColor.x - 0.04f) * metallic) * reflection,
+                             (0.04f + (baseColor.y - 0.04f) * metallic) * reflection,
+                             (0.04f + (baseColor.z - 0.04f) * metallic) * reflection);
+    material.albedo = Vec3(baseColor.x * scattered, baseColor.y * scattered, baseColor.z * scattered);
+    return material;
+}
+
+void Importer::ReadMaterials(Scene& scene) {
+    firstMaterial = scene.GetMaterials().size();
+    YAML::Node materialData = json["materials"];
+    for (std::size_t i = 0; i < materialData.size(); i++) {
+        YAML::Node pbr = materialData[i]["pbrMetallicRoughness"];
+        Vec3 baseColor(1.0f, 1.0f, 1.0f);
+        float metallic = 1.0f, roughness = 1.0f;
+        if (pbr && pbr["baseColorFactor"]) {
+            YAML::Node factor = pbr["baseColorFactor"];
+            baseColor = Vec3(factor[0].as<float>(), factor[1].as<float>(), factor[2].as<float>());
+        }
+        if (pbr && pbr["metallicFactor"]) metallic = pbr["metallicFactor"].as<float>();
+        if (pbr && pbr["roughnessFactor"]) roughness = pbr["roughnessFactor"].as<float>();
+        materials.push_back(ConvertMaterial(baseColor, metallic, roughness));
+    }
+}
+
+int Importer::Mesh(int index) {
+    if (index < 0 || index >= json["meshes"].size()) Fail("mesh " + std::to_string(index) + " does not exist");
+    YAML::Node primitives = json["meshes"][index]["primitives"];
+    if (!primitives.IsSequence()) Fail("mesh " + std::to_string(index) + " has no primitives");
+    if (meshIndices.empty()) meshIndices.assign(json["meshes"].size(), -1);
+    if (meshIndices[index] >= 0) return meshIndices[index];
+
+    Magpie::Mesh mesh;
+    for (std::size_t p = 0; p < primitives.size(); p++) {
+        YAML::Node primitive = primitives[p];
+        int mode = primitive["mode"] ? primitive["mode"].as<int>() : Triangles;
+        // points and lines have no surface to hit
+        if (mode != Triangles && mode != TriangleStrip && mode != TriangleFan) continue;
+        if (!primitive["attributes"]["POSITION"]) continue;
+        AccessorView positions = Accessor(primitive["attributes"]["POSITION"].as<int>());
+        if (positions.componentType != Float || positions.components != 3) Fail("positions that are not float triples");
+        AccessorView indices = AccessorView();
+        bool indexed = (bool)primitive["indices"];
+        if (indexed) {
+            indices = Accessor(primitive["indices"].as<int>());
+            bool valid = indices.components == 1 && (indices.componentType == UnsignedByte ||
+                         indices.componentType == UnsignedShort || indices.componentType == UnsignedInt);
+            if (!valid) Fail("indices that are not unsigned integers");
+        }
+        int material;
+        if (primitive["material"]) {
+            material = primitive["material"].as<int>();
+            if (material < 0 || material >= json["materials"].size()) Fail("material " + std::to_string(material) + " does not exist");
+            material += firstMaterial;
+        } else {
+            // the glTF default material, white and fully rough
+            if (defaultMaterial < 0) {
+                materials.push_back(ConvertMaterial(Vec3(1.0f, 1.0f, 1.0f), 1.0f, 1.0f));
+                defaultMaterial = firstMaterial + materials.size() - 1;
+            }
+            material = defaultMaterial;
+        }
+
+        std::size_t vertexCount = indexed ? indices.count : positions.count;
+        std::size_t triangleCount = mode == Triangles ? vertexCount / 3 : (vertexCount >= 3 ? vertexCount - 2 : 0);
+        std::size_t first = mesh.triangles.size();
+        mesh.triangles.resize(first + triangleCount);
+        for (std::size_t t = 0; t < triangleCount; t++) {
+            // corners in the order of the vertex stream, strips alternate their winding
+            std::size_t corners[3];
+            if (mode == Triangles) {
+                corners[0] = 3 * t;
+                corners[1] = 3 * t + 1;
+                corners[2] = 3 * t + 2;
+            } else if (mode == TriangleStrip) {
+                corners[0] = t + (t % 2);
+                corners[1] = t + 1 - (t % 2);
+                corners[2] = t + 2;
+            } else {
+                corners[0] = 0;
+                corners[1] = t + 1;
+                corners[2] = t + 2;
+            }
+            Vec3 vertices[3];
+            for (int k = 0; k < 3; k++) {
+                std::size_t vertex = indexed ? Index(indices, corners[k]) : corners[k];
+                if (vertex >= positions.count) Fail("vertex index out of range");
+                const unsigned char* position = positions.data + vertex * positions.stride;
+                vertices[k] = Vec3(ReadF32(position), ReadF32(position + 4), ReadF32(position + 8));
+            }
+            Triangle& triangle = mesh.triangles[first + t];
+            triangle.a = vertices[0];
+            triangle.b = vertices[1];
+            triangle.c = vertices[2];
+            triangle.materialIndex = material;
+        }
+    }
+    meshes.push_back(std::move(mesh));
+    meshIndices[index] = meshes.size() - 1;
+    return meshIndices[index];
+}
+
+// either a matrix or translation, rotation and scale, all optional
+static Mat4 NodeTransform(const YAML::Node& node) {
+    if (node["matrix"]) {
+        YAML::Node m = node["matrix"];
+        // column major, like Mat4
+        return Mat4(Vec4(m[0].as<float>(), m[1].as<float>(), m[2].as<float>(), m[3].as<float>()),
+                    Vec4(m[4].as<float>(), m[5].as<float>(), m[6].as<float>(), m[7].as<float>()),
+                    Vec4(m[8].as<float>(), m[9].as<float>(), m[10].as<float>(), m[11].as<float>()),
+                    Vec4(m[12].as<float>(), m[13].as<float>(), m[14].as<float>(), m[15].as<float>()));
+    }
+    Mat4 transform(1.0f);
+    if (node["translation"]) {
+        YAML::Node t = node["translation"];
+        transform = transform * Matrix::Translate(Vec3(t[0].as<float>(), t[1].as<float>(), t[2].as<float>()));
+    }
+    if (node["rotation"]) {
+        // unit quaternion x, y, z, w
+        YAML::Node q = node["rotation"];
+        float x = q[0].as<float>(), y = q[1].as<float>(), z = q[2].as<float>(), w = q[3].as<float>();
+        Mat4 rotation(Vec4(1.0f - 2.0f*(y*y + z*z), 2.0f*(x*y + w*z), 2.0f*(x*z - w*y), 0.0f),
+                      Vec4(2.0f*(x*y - w*z), 1.0f - 2.0f*(x*x + z*z), 2.0f*(y*z + w*x), 0.0f),
+                      Vec4(2.0f*(x*z + w*y), 2.0f*(y*z - w*x), 1.0f - 2.0f*(x*x + y*y), 0.0f),
+                      Vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        transform = transform * rotation;
+    }
+    if (node["scale"]) {
+        YAML::Node s = node["scale"];
+        transform = transform * Matrix::Scale(Vec3(s[0].as<float>(), s[1].as<float>(), s[2].as<float>()));
+    }
+    return transform;
+}
+
+void Importer::Visit(int index, const Mat4& parent, int depth) {
+    YAML::Node node = json["nodes"][index];
+    if (!node.IsMap()) Fail("node " + std::to_string(index) + " does not exist");
+    // deeper than there are nodes means a node is its own ancestor
+    if (depth > json["nodes"].size()) Fail("the node hierarchy has a cycle");
+    Mat4 transform = parent * NodeTransform(node);
+    if (node["mesh"]) {
+        Instance instance;
+        instance.meshIndex = Mesh(node["mesh"].as<int>());
+        instance.transform = transform;
+        instances.push_back(instance);
+    }
+    YAML::Node children = node["children"];
+    for (std::size_t i = 0; i < children.size(); i++) {
+        Visit(children[i].as<int>(), transform, depth + 1);
+    }
+}
+
+void Importer::ReadNodes(const Mat4& transform) {
+    YAML::Node sceneData = json["scenes"];
+    if (sceneData.size() > 0) {
+        int scene = json["scene"] ? json["scene"].as<int>() : 0;
+        YAML::Node roots = sceneData[scene]["nodes"];
+        for (std::size_t i = 0; i < roots.size(); i++) {
+            Visit(roots[i].as<int>(), transform, 0);
+        }
+        return;
+    }
+    // without scenes every node that is no other node's child is a root
+    YAML::Node nodes = json["nodes"];
+    std::vector<bool> child(nodes.size(), false);
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+        YAML::Node children = nodes[i]["children"];
+        for (std::size_t c = 0; c < children.size(); c++) {
+            std::size_t index = children[c].as<std::size_t>();
+            if (index < child.size()) child[index] = true;
+        }
+    }
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+        if (!child[i]) Visit(i, transform, 0);
+    }
+}
+
+void Importer::AddTo(Scene& scene) {
+    for (std::size_t i = 0; i < materials.size(); i++) {
+        scene.AddMaterial(materials[i]);
+    }
+    int firstMesh = scene.GetMeshes().size();
+    for (std::size_t i = 0; i < meshes.size(); i++) {
+        scene.AddMesh(std::move(meshes[i]));
+    }
+    for (std::size_t i = 0; i < instances.size(); i++) {
+        scene.AddInstance(firstMesh + instances[i].meshIndex, instances[i].transform);
+    }
+}
+
+void GLTF::Import(const std::string& filename, Scene& scene, const Mat4& transform) {
+    Importer importer(filename);
+    try {
+        importer.Open();
+        importer.ReadMaterials(scene);
+        importer.ReadNodes(transform);
+    } catch (const YAML::Exception& e) {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    importer.AddTo(scene);
+}
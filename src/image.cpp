@@ -0,0 +1,258 @@
+#include <Magpie/image.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+using namespace Magpie;
+
+// All formats are written byte by byte, so the files are the same on any host.
+
+static void PutU16LE(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(value & 0xff);
+    out.push_back((value >> 8) & 0xff);
+}
+
+static void PutU32LE(std::vector<unsigned char>& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void PutU64LE(std::vector<unsigned char>& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void PutU32BE(std::vector<unsigned char>& out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        out.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void PutFloatLE(std::vector<unsigned char>& out, float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    PutU32LE(out, bits);
+}
+
+static void PutString(std::vector<unsigned char>& out, const char* value) {
+    out.insert(out.end(), value, value + std::strlen(value) + 1);
+}
+
+static bool WriteFile(const std::string& filename, const std::vector<unsigned char>& data) {
+    std::ofstream file(filename, std::ios::binary);
+    file.write((const char*)data.data(), data.size());
+    return file.good();
+}
+
+unsigned char Image::TonemapChannel(float x) {
+    x = std::min(std::max((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f), 1.0f);
+    x = x <= 0.0031308f ? x * 12.92f : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+    return (unsigned char)std::min(std::max(std::nearbyint(x * 255.0f), 0.0f), 255.0f);
+}
+
+// PNG
+
+struct CrcTable {
+    uint32_t entries[256];
+    CrcTable() {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[n] = c;
+        }
+    }
+};
+
+static uint32_t Crc32(const unsigned char* data, std::size_t size) {
+    static const CrcTable table;
+    uint32_t c = 0xffffffffu;
+    for (std::size_t i = 0; i < size; i++) {
+        c = table.entries[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffffu;
+}
+
+static uint32_t Adler32(const unsigned char* data, std::size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        // the largest run before b can overflow 32 bits
+        std::size_t run = std::min<std::size_t>(size, 5552);
+        for (std::size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += run;
+        size -= run;
+    }
+    return (b << 16) | a;
+}
+
+static void PutChunk(std::vector<unsigned char>& png, const char* type, const std::vector<unsigned char>& data) {
+    PutU32BE(png, data.size());
+    std::size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    PutU32BE(png, Crc32(&png[start], png.size() - start));
+}
+
+// A zlib stream of stored deflate blocks. Rendered images barely compress without
+// real filtering, and skipping it keeps writing far cheaper than rendering.
+static std::vector<unsigned char> StoredZlib(const std::vector<unsigned char>& raw) {
+    std::vector<unsigned char> out;
+    out.reserve(raw.size() + raw.size() / 65535 * 5 + 11);
+    out.push_back(0x78);
+    out.push_back(0x01);
+    std::size_t offset = 0;
+    do {
+        std::size_t length = std::min<std::size_t>(raw.size() - offset, 65535);
+        out.push_back(offset + length == raw.size() ? 1 : 0);
+        PutU16LE(out, length);
+        PutU16LE(out, ~length & 0xffff);
+        out.insert(out.end(), raw.begin() + offset, raw.begin() + offset + length);
+        offset += length;
+    } while (offset < raw.size());
+    PutU32BE(out, Adler32(raw.data(), raw.size()));
+    return out;
+}
+
+bool Image::WritePNG(const std::string& filename, unsigned int width, unsigned int height, const float* pixels, float exposure) {
+    float scale = std::exp2(exposure);
+    std::size_t rowSize = 1 + width * 3;
+    std::vector<unsigned char> raw(rowSize * height);
+    for (unsigned int y = 0; y < height; y++) {
+        unsigned char* row = &raw[y * rowSize];
+        const float* source = pixels + (std::size_t)(height - 1 - y) * width * 4;
+        row[0] = 0; // no filter
+        for (unsigned int x = 0; x < width; x++) {
+            row[1 + 3*x] = TonemapChannel(source[4*x] * scale);
+            row[1 + 3*x + 1] = TonemapChannel(source[4*x + 1] * scale);
+            row[1 + 3*x + 2] = TonemapChannel(source[4*x + 2] * scale);
+        }
+    }
+
+    std::vector<unsigned char> png;
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    png.insert(png.end(), signature, signature + 8);
+    std::vector<unsigned char> header;
+    PutU32BE(header, width);
+    PutU32BE(header, height);
+    header.push_back(8); // bits per channel
+    header.push_back(2); // RGB
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // not interlaced
+    PutChunk(png, "IHDR", header);
+    PutChunk(png, "IDAT", StoredZlib(raw));
+    PutChunk(png, "IEND", std::vector<unsigned char>());
+    return WriteFile(filename, png);
+}
+
+// OpenEXR
+
+static void PutAttribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value) {
+    PutString(out, name);
+    PutString(out, type);
+    PutU32LE(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+bool Image::WriteEXR(const std::string& filename, unsigned int width, unsigned int height, const float* pixels) {
+    std::vector<unsigned char> exr;
+    PutU32LE(exr, 20000630); // magic number
+    PutU32LE(exr, 2);        // version, single part scanline file
+
+    // channels are stored in alphabetical order
+    const char* channelNames[3] = {"B", "G", "R"};
+    const int channelOffsets[3] = {2, 1, 0};
+    std::vector<unsigned char> channels;
+    for (int c = 0; c < 3; c++) {
+        PutString(channels, channelNames[c]);
+        PutU32LE(channels, 2); // 32-bit float
+        PutU32LE(channels, 0); // pLinear and reserved
+        PutU32LE(channels, 1); // x sampling
+        PutU32LE(channels, 1); // y sampling
+    }
+    channels.push_back(0);
+    PutAttribute(exr, "channels", "chlist", channels);
+    PutAttribute(exr, "compression", "compression", std::vector<unsigned char>(1, 0));
+    std::vector<unsigned char> window;
+    PutU32LE(window, 0);
+    PutU32LE(window, 0);
+    PutU32LE(window, width - 1);
+    PutU32LE(window, height - 1);
+    PutAttribute(exr, "dataWindow", "box2i", window);
+    PutAttribute(exr, "displayWindow", "box2i", window);
+    PutAttribute(exr, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0));
+    std::vector<unsigned char> one;
+    PutFloatLE(one, 1.0f);
+    PutAttribute(exr, "pixelAspectRatio", "float", one);
+    PutAttribute(exr, "screenWindowCenter", "v2f", std::vector<unsigned char>(8, 0));
+    PutAttribute(exr, "screenWindowWidth", "float", one);
+    exr.push_back(0);
+
+    // one scanline per chunk, each listed by its offset in the file
+    uint64_t lineSize = 8 + (uint64_t)width * 3 * sizeof(float);
+    uint64_t firstLine = exr.size() + (uint64_t)height * 8;
+    for (unsigned int y = 0; y < height; y++) {
+        PutU64LE(exr, firstLine + y * lineSize);
+    }
+    exr.reserve(firstLine + height * lineSize);
+    for (unsigned int y = 0; y < height; y++) {
+        const float* source = pixels + (std::size_t)(height - 1 - y) * width * 4;
+        PutU32LE(exr, y);
+        PutU32LE(exr, lineSize - 8);
+        for (int c = 0; c < 3; c++) {
+            for (unsigned int x = 0; x < width; x++) {
+                PutFloatLE(exr, source[4*x + channelOffsets[c]]);
+            }
+        }
+    }
+    return WriteFile(filename, exr);
+}
+
+// PFM stores rows bottom to top like the frame, a negative scale marks little endian
+bool Image::WritePFM(const std::string& filename, unsigned int width, unsigned int height, const float* pixels) {
+    std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    std::vector<unsigned char> pfm(header.begin(), header.end());
+    pfm.reserve(header.size() + (std::size_t)width * height * 3 * sizeof(float));
+    for (std::size_t i = 0; i < (std::size_t)width * height; i++) {
+        PutFloatLE(pfm, pixels[4*i]);
+        PutFloatLE(pfm, pixels[4*i + 1]);
+        PutFloatLE(pfm, pixels[4*i + 2]);
+    }
+    return WriteFile(filename, pfm);
+}
+
+static std::string Extension(const std::string& filename) {
+    std::size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) return "";
+    std::string extension = filename.substr(dot + 1);
+    for (std::size_t i = 0; i < extension.size(); i++) {
+        extension[i] = std::tolower((unsigned char)extension[i]);
+    }
+    return extension;
+}
+
+bool Image::IsSupported(const std::string& filename) {
+    std::string extension = Extension(filename);
+    return extension == "png" || extension == "exr" || extension == "pfm";
+}
+
+bool Image::Write(const std::string& filename, unsigned int width, unsigned int height, const float* pixels, float exposure) {
+    std::string extension = Extension(filename);
+    if (extension == "png") return WritePNG(filename, width, height, pixels, exposure);
+    if (extension == "exr") return WriteEXR(filename, width, height, pixels);
+    if (extension == "pfm") return WritePFM(filename, width, height, pixels);
+    return false;
+}
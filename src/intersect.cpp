@@ -0,0 +1,197 @@
+#include "intersect_wide.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+using namespace Magpie;
+
+// one primitive at a time, the reference the packet versions have to agree with
+static int IntersectTrianglesScalar(const TriangleSoA& tri, int first, int count, const Vec3& origin, const Vec3& direction, float& distance) {
+    int best = -1;
+    for (int i = first; i < first + count; i++) {
+        Vec3 edge1(tri.e1x[i], tri.e1y[i], tri.e1z[i]);
+        Vec3 edge2(tri.e2x[i], tri.e2y[i], tri.e2z[i]);
+        Vec3 pvec = Vector::Cross(direction, edge2);
+        float invDet = 1.0f / Vector::Dot(edge1, pvec);
+        Vec3 tvec = origin - Vec3(tri.ax[i], tri.ay[i], tri.az[i]);
+        float u = Vector::Dot(tvec, pvec) * invDet;
+        if (u < 0.0f || u > 1.0f)
+            continue;
+        Vec3 qvec = Vector::Cross(tvec, edge1);
+        float v = Vector::Dot(direction, qvec) * invDet;
+        if (v < 0.0f || u + v > 1.0f)
+            continue;
+        float t = Vector::Dot(edge2, qvec) * invDet;
+        if (t > 0 && t < distance) {
+            distance = t;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int IntersectSpheresScalar(const SphereSoA& sph, int first, int count, const Vec3& origin, const Vec3& direction, float& distance) {
+    int best = -1;
+    for (int i = first; i < first + count; i++) {
+        Vec3 d = origin - Vec3(sph.cx[i], sph.cy[i], sph.cz[i]);
+        float p1 = -Vector::Dot(direction, d);
+        float p2sqr = p1 * p1 - Vector::Dot(d, d) + sph.radius2[i];
+        if (p2sqr < 0)
+            continue;
+        float p2 = std::sqrt(p2sqr);
+        float t = p1 - p2 > 0 ? p1 - p2 : p1 + p2;
+        if (t > 0 && t < distance) {
+            distance = t;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static const Intersect::Kernels ScalarKernels = {SIMDLevel::Scalar, IntersectTrianglesScalar, IntersectSpheresScalar};
+
+static bool CPUSupports(SIMDLevel level) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    switch (level) {
+        case SIMDLevel::Scalar: return true;
+        case SIMDLevel::SSE4: return __builtin_cpu_supports("sse4.1");
+        case SIMDLevel::AVX2: return __builtin_cpu_supports("avx2");
+        case SIMDLevel::AVX512: return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 1);
+    bool sse4 = (info[2] & (1 << 19)) != 0;
+    // the OS has to save the wider registers as well
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    __cpuidex(info, 7, 0);
+    switch (level) {
+        case SIMDLevel::Scalar: return true;
+        case SIMDLevel::SSE4: return sse4;
+        case SIMDLevel::AVX2: return (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+        case SIMDLevel::AVX512: return (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+    }
+    return false;
+#else
+    return level == SIMDLevel::Scalar;
+#endif
+}
+
+static const Intersect::Kernels& BuiltKernels(SIMDLevel level) {
+    switch (level) {
+        case SIMDLevel::SSE4: return Intersect::SSE4Kernels;
+        case SIMDLevel::AVX2: return Intersect::AVX2Kernels;
+        case SIMDLevel::AVX512: return Intersect::AVX512Kernels;
+        default: return ScalarKernels;
+    }
+}
+
+bool Intersect::IsSupported(SIMDLevel level) {
+    return BuiltKernels(level).triangles != nullptr && CPUSupports(level);
+}
+
+// primitives tested at once
+static int LevelWidth(SIMDLevel level) {
+    switch (level) {
+        case SIMDLevel::SSE4: return 4;
+        case SIMDLevel::AVX2: return 8;
+        case SIMDLevel::AVX512: return 16;
+        default: return 1;
+    }
+}
+
+SIMDLevel Intersect::DetectLevel() {
+    // Leaves never hold more primitives than one packet of this level tests, wider
+    // packets would mostly test masked off lanes, see bench/intersect.cpp
+    SIMDLevel cap = SIMDLevel::Scalar;
+    for (int l = (int)SIMDLevel::Scalar; l <= (int)SIMDLevel::AVX512; l++) {
+        if (LevelWidth((SIMDLevel)l) <= BVH::MaxLeafSize) cap = (SIMDLevel)l;
+    }
+    const char* requested = std::getenv("MAGPIE_SIMD");
+    if (requested) {
+        for (int l = (int)SIMDLevel::Scalar; l <= (int)SIMDLevel::AVX512; l++) {
+            if (std::strcmp(requested, LevelName((SIMDLevel)l)) == 0) cap = (SIMDLevel)l;
+        }
+    }
+    for (int l = (int)cap; l > (int)SIMDLevel::Scalar; l--) {
+        if (IsSupported((SIMDLevel)l)) return (SIMDLevel)l;
+    }
+    return SIMDLevel::Scalar;
+}
+
+Intersect::Kernels Intersect::GetKernels(SIMDLevel level) {
+    for (int l = (int)level; l > (int)SIMDLevel::Scalar; l--) {
+        if (IsSupported((SIMDLevel)l)) return BuiltKernels((SIMDLevel)l);
+    }
+    return ScalarKernels;
+}
+
+const char* Intersect::LevelName(SIMDLevel level) {
+    switch (level) {
+        case SIMDLevel::SSE4: return "sse4";
+        case SIMDLevel::AVX2: return "avx2";
+        case SIMDLevel::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+void Intersect::Append(TriangleSoA& triangles, const Triangle& triangle) {
+    Vec3 edge1 = triangle.b - triangle.a;
+    Vec3 edge2 = triangle.c - triangle.a;
+    triangles.ax.push_back(triangle.a.x);
+    triangles.ay.push_back(triangle.a.y);
+    triangles.az.push_back(triangle.a.z);
+    triangles.e1x.push_back(edge1.x);
+    triangles.e1y.push_back(edge1.y);
+    triangles.e1z.push_back(edge1.z);
+    triangles.e2x.push_back(edge2.x);
+    triangles.e2y.push_back(edge2.y);
+    triangles.e2z.push_back(edge2.z);
+}
+
+void Intersect::Append(SphereSoA& spheres, const Sphere& sphere) {
+    spheres.cx.push_back(sphere.center.x);
+    spheres.cy.push_back(sphere.center.y);
+    spheres.cz.push_back(sphere.center.z);
+    spheres.radius2.push_back(sphere.radius * sphere.radius);
+}
+
+// every comparison with NaN fails, so NaN slots are never accepted
+void Intersect::AppendMissing(TriangleSoA& triangles) {
+    float nan = std::numeric_limits<float>::quiet_NaN();
+    Triangle missing;
+    missing.a = Vec3(nan, nan, nan);
+    missing.b = missing.a;
+    missing.c = missing.a;
+    Append(triangles, missing);
+}
+
+void Intersect::AppendMissing(SphereSoA& spheres) {
+    float nan = std::numeric_limits<float>::quiet_NaN();
+    Sphere missing;
+    missing.center = Vec3(nan, nan, nan);
+    missing.radius = nan;
+    Append(spheres, missing);
+}
+
+void Intersect::Pad(TriangleSoA& triangles) {
+    for (int i = 0; i < MaxWidth - 1; i++) {
+        AppendMissing(triangles);
+    }
+}
+
+void Intersect::Pad(SphereSoA& spheres) {
+    for (int i = 0; i < MaxWidth - 1; i++) {
+        AppendMissing(spheres);
+    }
+}
@@ -0,0 +1,33 @@
+#include "intersect_wide.h"
+
+using namespace Magpie;
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace {
+    struct AVX2 {
+        typedef __m256 Float;
+        typedef __m256 Mask;
+        static const int Width = 8;
+        static Float Load(const float* p) { return _mm256_loadu_ps(p); }
+        static void Store(float* p, Float a) { _mm256_storeu_ps(p, a); }
+        static Float Set(float a) { return _mm256_set1_ps(a); }
+        static Float Add(Float a, Float b) { return _mm256_add_ps(a, b); }
+        static Float Sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+        static Float Mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+        static Float Div(Float a, Float b) { return _mm256_div_ps(a, b); }
+        static Float Sqrt(Float a) { return _mm256_sqrt_ps(a); }
+        static Mask Lt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static Mask Gt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+        static Mask Or(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+        static Mask AndNot(Mask a, Mask b) { return _mm256_andnot_ps(b, a); } // a and not b
+        static Float Select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b, a, m); }
+        static int Bits(Mask m) { return _mm256_movemask_ps(m); }
+    };
+}
+
+const Intersect::Kernels Intersect::AVX2Kernels = {SIMDLevel::AVX2, IntersectTrianglesWide<AVX2>, IntersectSpheresWide<AVX2>};
+#else
+const Intersect::Kernels Intersect::AVX2Kernels = {SIMDLevel::AVX2, nullptr, nullptr};
+#endif
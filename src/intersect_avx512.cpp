@@ -0,0 +1,33 @@
+#include "intersect_wide.h"
+
+using namespace Magpie;
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+
+namespace {
+    struct AVX512 {
+        typedef __m512 Float;
+        typedef __mmask16 Mask;
+        static const int Width = 16;
+        static Float Load(const float* p) { return _mm512_loadu_ps(p); }
+        static void Store(float* p, Float a) { _mm512_storeu_ps(p, a); }
+        static Float Set(float a) { return _mm512_set1_ps(a); }
+        static Float Add(Float a, Float b) { return _mm512_add_ps(a, b); }
+        static Float Sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+        static Float Mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+        static Float Div(Float a, Float b) { return _mm512_div_ps(a, b); }
+        static Float Sqrt(Float a) { return _mm512_sqrt_ps(a); }
+        static Mask Lt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+        static Mask Gt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+        static Mask Or(Mask a, Mask b) { return a | b; }
+        static Mask AndNot(Mask a, Mask b) { return a & ~b; }
+        static Float Select(Mask m, Float a, Float b) { return _mm512_mask_blend_ps(m, b, a); }
+        static int Bits(Mask m) { return m; }
+    };
+}
+
+const Intersect::Kernels Intersect::AVX512Kernels = {SIMDLevel::AVX512, IntersectTrianglesWide<AVX512>, IntersectSpheresWide<AVX512>};
+#else
+const Intersect::Kernels Intersect::AVX512Kernels = {SIMDLevel::AVX512, nullptr, nullptr};
+#endif
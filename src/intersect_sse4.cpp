@@ -0,0 +1,33 @@
+#include "intersect_wide.h"
+
+using namespace Magpie;
+
+#if defined(__SSE4_1__) || defined(__AVX__) || (defined(_MSC_VER) && defined(_M_X64))
+#include <smmintrin.h>
+
+namespace {
+    struct SSE4 {
+        typedef __m128 Float;
+        typedef __m128 Mask;
+        static const int Width = 4;
+        static Float Load(const float* p) { return _mm_loadu_ps(p); }
+        static void Store(float* p, Float a) { _mm_storeu_ps(p, a); }
+        static Float Set(float a) { return _mm_set1_ps(a); }
+        static Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+        static Float Sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+        static Float Mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+        static Float Div(Float a, Float b) { return _mm_div_ps(a, b); }
+        static Float Sqrt(Float a) { return _mm_sqrt_ps(a); }
+        static Mask Lt(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+        static Mask Gt(Float a, Float b) { return _mm_cmpgt_ps(a, b); }
+        static Mask Or(Mask a, Mask b) { return _mm_or_ps(a, b); }
+        static Mask AndNot(Mask a, Mask b) { return _mm_andnot_ps(b, a); } // a and not b
+        static Float Select(Mask m, Float a, Float b) { return _mm_blendv_ps(b, a, m); }
+        static int Bits(Mask m) { return _mm_movemask_ps(m); }
+    };
+}
+
+const Intersect::Kernels Intersect::SSE4Kernels = {SIMDLevel::SSE4, IntersectTrianglesWide<SSE4>, IntersectSpheresWide<SSE4>};
+#else
+const Intersect::Kernels Intersect::SSE4Kernels = {SIMDLevel::SSE4, nullptr, nullptr};
+#endif
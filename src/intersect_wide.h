@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Magpie/intersect.h>
+
+// Packet versions of the intersection tests, written once against a small set of
+// vector operations. Each intersect_<isa>.cpp is compiled for its instruction set
+// and instantiates them with its own operations. The arithmetic is done in the same
+// order as the scalar tests, so every level finds exactly the same hits.
+
+namespace Magpie {
+    namespace Intersect {
+        // null when the build did not target the instruction set
+        extern const Kernels SSE4Kernels;
+        extern const Kernels AVX2Kernels;
+        extern const Kernels AVX512Kernels;
+    }
+}
+
+namespace {
+    // picks the nearest accepted lane, in index order so ties keep the first primitive
+    inline int ClosestLane(int accepted, const float* t, int base, int lanes, float& distance, int best) {
+        for (int l = 0; l < lanes; l++) {
+            if ((accepted >> l) & 1 && t[l] < distance) {
+                distance = t[l];
+                best = base + l;
+            }
+        }
+        return best;
+    }
+
+    template<typename Ops>
+    int IntersectTrianglesWide(const Magpie::TriangleSoA& tri, int first, int count, const Magpie::Vec3& origin, const Magpie::Vec3& direction, float& distance) {
+        typedef typename Ops::Float Float;
+        typedef typename Ops::Mask Mask;
+        Float ox = Ops::Set(origin.x), oy = Ops::Set(origin.y), oz = Ops::Set(origin.z);
+        Float dx = Ops::Set(direction.x), dy = Ops::Set(direction.y), dz = Ops::Set(direction.z);
+        Float zero = Ops::Set(0.0f), one = Ops::Set(1.0f);
+        float t[Ops::Width];
+        int best = -1;
+        for (int base = first; base < first + count; base += Ops::Width) {
+            Float e1x = Ops::Load(&tri.e1x[base]), e1y = Ops::Load(&tri.e1y[base]), e1z = Ops::Load(&tri.e1z[base]);
+            Float e2x = Ops::Load(&tri.e2x[base]), e2y = Ops::Load(&tri.e2y[base]), e2z = Ops::Load(&tri.e2z[base]);
+            // pvec = cross(direction, edge2)
+            Float px = Ops::Sub(Ops::Mul(dy, e2z), Ops::Mul(dz, e2y));
+            Float py = Ops::Sub(Ops::Mul(dz, e2x), Ops::Mul(dx, e2z));
+            Float pz = Ops::Sub(Ops::Mul(dx, e2y), Ops::Mul(dy, e2x));
+            Float det = Ops::Add(Ops::Add(Ops::Mul(e1x, px), Ops::Mul(e1y, py)), Ops::Mul(e1z, pz));
+            Float invDet = Ops::Div(one, det);
+            Float tx = Ops::Sub(ox, Ops::Load(&tri.ax[base]));
+            Float ty = Ops::Sub(oy, Ops::Load(&tri.ay[base]));
+            Float tz = Ops::Sub(oz, Ops::Load(&tri.az[base]));
+            Float u = Ops::Mul(Ops::Add(Ops::Add(Ops::Mul(tx, px), Ops::Mul(ty, py)), Ops::Mul(tz, pz)), invDet);
+            // qvec = cross(tvec, edge1)
+            Float qx = Ops::Sub(Ops::Mul(ty, e1z), Ops::Mul(tz, e1y));
+            Float qy = Ops::Sub(Ops::Mul(tz, e1x), Ops::Mul(tx, e1z));
+            Float qz = Ops::Sub(Ops::Mul(tx, e1y), Ops::Mul(ty, e1x));
+            Float v = Ops::Mul(Ops::Add(Ops::Add(Ops::Mul(dx, qx), Ops::Mul(dy, qy)), Ops::Mul(dz, qz)), invDet);
+            Float distances = Ops::Mul(Ops::Add(Ops::Add(Ops::Mul(e2x, qx), Ops::Mul(e2y, qy)), Ops::Mul(e2z, qz)), invDet);
+            Mask rejected = Ops::Or(Ops::Or(Ops::Lt(u, zero), Ops::Gt(u, one)),
+                                    Ops::Or(Ops::Lt(v, zero), Ops::Gt(Ops::Add(u, v), one)));
+            Mask accepted = Ops::AndNot(Ops::Gt(distances, zero), rejected);
+            Ops::Store(t, distances);
+            int lanes = first + count - base < Ops::Width ? first + count - base : Ops::Width;
+            best = ClosestLane(Ops::Bits(accepted), t, base, lanes, distance, best);
+        }
+        return best;
+    }
+
+    template<typename Ops>
+    int IntersectSpheresWide(const Magpie::SphereSoA& sph, int first, int count, const Magpie::Vec3& origin, const Magpie::Vec3& direction, float& distance) {
+        typedef typename Ops::Float Float;
+        typedef typename Ops::Mask Mask;
+        Float ox = Ops::Set(origin.x), oy = Ops::Set(origin.y), oz = Ops::Set(origin.z);
+        Float dx = Ops::Set(direction.x), dy = Ops::Set(direction.y), dz = Ops::Set(direction.z);
+        Float zero = Ops::Set(0.0f);
+        float t[Ops::Width];
+        int best = -1;
+        for (int base = first; base < first + count; base += Ops::Width) {
+            Float ddx = Ops::Sub(ox, Ops::Load(&sph.cx[base]));
+            Float ddy = Ops::Sub(oy, Ops::Load(&sph.cy[base]));
+            Float ddz = Ops::Sub(oz, Ops::Load(&sph.cz[base]));
+            Float p1 = Ops::Sub(zero, Ops::Add(Ops::Add(Ops::Mul(dx, ddx), Ops::Mul(dy, ddy)), Ops::Mul(dz, ddz)));
+            Float dd = Ops::Add(Ops::Add(Ops::Mul(ddx, ddx), Ops::Mul(ddy, ddy)), Ops::Mul(ddz, ddz));
+            Float p2sqr = Ops::Add(Ops::Sub(Ops::Mul(p1, p1), dd), Ops::Load(&sph.radius2[base]));
+            Float p2 = Ops::Sqrt(p2sqr);
+            Float near = Ops::Sub(p1, p2);
+            Float distances = Ops::Select(Ops::Gt(near, zero), near, Ops::Add(p1, p2));
+            Mask accepted = Ops::AndNot(Ops::Gt(distances, zero), Ops::Lt(p2sqr, zero));
+            Ops::Store(t, distances);
+            int lanes = first + count - base < Ops::Width ? first + count - base : Ops::Width;
+            best = ClosestLane(Ops::Bits(accepted), t, base, lanes, distance, best);
+        }
+        return best;
+    }
+}
@@ -38,6 +38,7 @@ int main(int argc, char ** argv) {
 
     display->Initialize();
     renderer->Initialize();
+    renderer->SetPixelFormat(Magpie::PixelFormat::RGBA8);
 
     if (!argv[1]) {
         std::cerr << "no scene file specified.\n";
@@ -51,8 +52,10 @@ int main(int argc, char ** argv) {
         input->HandleInput(deltaTime);
         renderer->SetViewMatrix(Magpie::Matrix::LookAt(camera->pos, camera->pos + camera->front, camera->up));
         display->SwitchToColorTexture();
-        renderer->Render();
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 800, 600, 0, GL_RGBA, GL_FLOAT, renderer->GetPixels());
+        // the next frame renders while the previous one is uploaded and shown
+        renderer->BeginFrame();
+        renderer->EndFrame();
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 800, 600, 0, GL_RGBA, GL_UNSIGNED_BYTE, renderer->GetPackedPixels());
         display->Render();
         currentTime = (float)SDL_GetTicks()/1000;
         deltaTime = currentTime - lastFrame;
@@ -0,0 +1,55 @@
+#include "mapped_file.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Magpie;
+
+#ifdef _WIN32
+bool MappedFile::Open(const std::string& filename) {
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER length;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length)) return false;
+    size = length.QuadPart;
+    // empty files cannot be mapped
+    if (size == 0) return true;
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) return false;
+    data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    return data != nullptr;
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) UnmapViewOfFile(data);
+    if (mapping != nullptr) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+#else
+bool MappedFile::Open(const std::string& filename) {
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    bool ok = fstat(file, &info) == 0;
+    size = ok ? info.st_size : 0;
+    // empty files cannot be mapped
+    if (ok && size > 0) {
+        void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        ok = view != MAP_FAILED;
+        if (ok) {
+            // readers go through all of it right away
+            madvise(view, size, MADV_WILLNEED);
+            data = (const char*)view;
+        }
+    }
+    close(file);
+    return ok;
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) munmap((void*)data, size);
+}
+#endif
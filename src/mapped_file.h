@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+namespace Magpie {
+    // Read only view of a whole file, shared by the mesh and scene readers.
+    class MappedFile {
+        public:
+            MappedFile() = default;
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+            ~MappedFile();
+            // returns false if the file could not be opened or mapped
+            bool Open(const std::string& filename);
+            // nullptr for an empty file
+            const char* data = nullptr;
+            std::size_t size = 0;
+        private:
+#ifdef _WIN32
+            HANDLE file = INVALID_HANDLE_VALUE;
+            HANDLE mapping = nullptr;
+#endif
+    };
+}
@@ -0,0 +1,578 @@
+#include <Magpie/mesh_file.h>
+#include <Magpie/thread_pool.h>
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+using namespace Magpie;
+
+// Both formats are read in two passes over chunks of the file that run in parallel.
+// The first counts the triangles of every chunk and reads its vertices, the second
+// writes the triangles of each chunk straight into their final place, which prefix
+// sums over the counts of the first pass give.
+
+// text chunks smaller than this are not worth a task of their own
+static const std::size_t MinChunkBytes = 1 << 20;
+static const std::size_t FacesPerChunk = 1 << 16;
+
+static std::string Extension(const std::string& filename) {
+    std::size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) return "";
+    std::string extension = filename.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+bool MeshFile::IsSupported(const std::string& filename) {
+    std::string extension = Extension(filename);
+    return extension == "obj" || extension == "ply";
+}
+
+// OBJ
+
+static inline bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// spaces within a line
+static inline bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* SkipSpaces(const char* p, const char* end) {
+    while (p < end && IsSpace(*p)) p++;
+    return p;
+}
+
+static inline const char* NextLine(const char* p, const char* end) {
+    const char* newline = (const char*)std::memchr(p, '\n', end - p);
+    return newline != nullptr ? newline + 1 : end;
+}
+
+static const double PowersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// A decimal number as strtof reads it, without its locale lookups. Up to 15
+// significant digits and exponents within 22 give the exact double, which is then
+// rounded to float, longer numbers may be off in the last bit.
+static bool ParseFloat(const char*& p, const char* end, float& value) {
+    const char* s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        s++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; s < end && IsDigit(*s); s++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa != 0) digits++;
+        } else {
+            exponent++;
+        }
+        any = true;
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && IsDigit(*s); s++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa != 0) digits++;
+                exponent--;
+            }
+            any = true;
+        }
+    }
+    if (!any) return false;
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        bool negativeExponent = false;
+        if (e < end && (*e == '-' || *e == '+')) {
+            negativeExponent = *e == '-';
+            e++;
+        }
+        if (e < end && IsDigit(*e)) {
+            int written = 0;
+            for (; e < end && IsDigit(*e); e++) {
+                if (written < 10000) written = written * 10 + (*e - '0');
+            }
+            exponent += negativeExponent ? -written : written;
+            s = e;
+        }
+    }
+    double result = (double)mantissa;
+    if (exponent < 0) {
+        result = exponent >= -22 ? result / PowersOfTen[-exponent] : result * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = exponent <= 22 ? result * PowersOfTen[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = (float)(negative ? -result : result);
+    p = s;
+    return true;
+}
+
+// One corner of a face, v, v/vt, v//vn or v/vt/vn, as a zero based vertex index.
+// Negative indices count back from the last of the defined vertices.
+static bool ParseIndex(const char*& p, const char* end, std::size_t defined, std::size_t vertexCount, std::size_t& index) {
+    bool negative = p < end && *p == '-';
+    if (negative) p++;
+    long long value = 0;
+    bool any = false;
+    for (; p < end && IsDigit(*p); p++) {
+        if (value < (1ll << 40)) value = value * 10 + (*p - '0');
+        any = true;
+    }
+    while (p < end && !IsSpace(*p) && *p != '\n') p++;
+    if (!any || value == 0) return false;
+    long long resolved = negative ? (long long)defined - value : value - 1;
+    if (resolved < 0 || resolved >= (long long)vertexCount) return false;
+    index = resolved;
+    return true;
+}
+
+namespace {
+    struct ObjChunk {
+        const char* begin;
+        const char* end;
+        std::vector<Vec3> vertices;
+        std::size_t triangleCount = 0;
+        std::size_t firstVertex = 0;
+        std::size_t firstTriangle = 0;
+        const char* error = nullptr; // the line that could not be read
+    };
+}
+
+static inline bool IsStatement(const char* p, const char* end, char name) {
+    return end - p >= 2 && p[0] == name && IsSpace(p[1]);
+}
+
+static void CountObjChunk(ObjChunk& chunk) {
+    for (const char* line = chunk.begin; line < chunk.end; ) {
+        const char* next = NextLine(line, chunk.end);
+        const char* p = SkipSpaces(line, next);
+        if (IsStatement(p, next, 'v')) {
+            Vec3 v;
+            p += 2;
+            bool valid = ParseFloat(p = SkipSpaces(p, next), next, v.x) &&
+                         ParseFloat(p = SkipSpaces(p, next), next, v.y) &&
+                         ParseFloat(p = SkipSpaces(p, next), next, v.z);
+            if (!valid) {
+                chunk.error = line;
+                return;
+            }
+            chunk.vertices.push_back(v);
+        } else if (IsStatement(p, next, 'f')) {
+            int corners = 0;
+            for (p += 2; (p = SkipSpaces(p, next)) < next && *p != '\n' && *p != '#'; corners++) {
+                while (p < next && !IsSpace(*p) && *p != '\n') p++;
+            }
+            if (corners < 3) {
+                chunk.error = line;
+                return;
+            }
+            chunk.triangleCount += corners - 2;
+        }
+        line = next;
+    }
+}
+
+static void ReadObjFaces(ObjChunk& chunk, const std::vector<Vec3>& vertices, int materialIndex, Triangle* triangles) {
+    Triangle* out = triangles + chunk.firstTriangle;
+    std::size_t defined = chunk.firstVertex;
+    for (const char* line = chunk.begin; line < chunk.end; ) {
+        const char* next = NextLine(line, chunk.end);
+        const char* p = SkipSpaces(line, next);
+        if (IsStatement(p, next, 'v')) {
+            defined++;
+        } else if (IsStatement(p, next, 'f')) {
+            // a fan around the first corner
+            std::size_t first, previous, current;
+            bool valid = ParseIndex(p = SkipSpaces(p + 2, next), next, defined, vertices.size(), first) &&
+                         ParseIndex(p = SkipSpaces(p, next), next, defined, vertices.size(), previous);
+            while (valid && (p = SkipSpaces(p, next)) < next && *p != '\n' && *p != '#') {
+                valid = ParseIndex(p, next, defined, vertices.size(), current);
+                if (valid) {
+                    out->a = vertices[first];
+                    out->b = vertices[previous];
+                    out->c = vertices[current];
+                    out->materialIndex = materialIndex;
+                    out++;
+                    previous = current;
+                }
+            }
+            if (!valid) {
+                chunk.error = line;
+                return;
+            }
+        }
+        line = next;
+    }
+}
+
+static void LoadObj(const MappedFile& file, const std::string& filename, int materialIndex, std::vector<Triangle>& triangles) {
+    ThreadPool pool;
+    const char* data = file.data;
+    const char* end = data + file.size;
+    std::size_t chunkCount = std::max<std::size_t>(1, std::min<std::size_t>(file.size / MinChunkBytes, pool.GetThreadCount() * 8));
+    std::vector<ObjChunk> chunks(chunkCount);
+    for (std::size_t i = 0; i < chunkCount; i++) {
+        // chunks start on a line
+        chunks[i].begin = i == 0 ? data : chunks[i - 1].end;
+        chunks[i].end = i + 1 == chunkCount ? end : std::max(chunks[i].begin, NextLine(data + file.size / chunkCount * (i + 1), end));
+    }
+
+    pool.ParallelFor(0, chunkCount, 1, [&](int begin, int chunkEnd) {
+        for (int i = begin; i < chunkEnd; i++) {
+            CountObjChunk(chunks[i]);
+        }
+    });
+    std::size_t vertexCount = 0, triangleCount = 0;
+    for (std::size_t i = 0; i < chunkCount; i++) {
+        if (chunks[i].error != nullptr) {
+            throw std::runtime_error(filename + ":" + std::to_string(std::count(data, chunks[i].error, '\n') + 1) + ": malformed line");
+        }
+        chunks[i].firstVertex = vertexCount;
+        chunks[i].firstTriangle = triangleCount;
+        vertexCount += chunks[i].vertices.size();
+        triangleCount += chunks[i].triangleCount;
+    }
+
+    std::vector<Vec3> vertices(vertexCount);
+    pool.ParallelFor(0, chunkCount, 1, [&](int begin, int chunkEnd) {
+        for (int i = begin; i < chunkEnd; i++) {
+            std::copy(chunks[i].vertices.begin(), chunks[i].vertices.end(), vertices.begin() + chunks[i].firstVertex);
+            std::vector<Vec3>().swap(chunks[i].vertices);
+        }
+    });
+
+    std::size_t base = triangles.size();
+    triangles.resize(base + triangleCount);
+    pool.ParallelFor(0, chunkCount, 1, [&](int begin, int chunkEnd) {
+        for (int i = begin; i < chunkEnd; i++) {
+            ReadObjFaces(chunks[i], vertices, materialIndex, triangles.data() + base);
+        }
+    });
+    for (std::size_t i = 0; i < chunkCount; i++) {
+        if (chunks[i].error != nullptr) {
+            triangles.resize(base);
+            throw std::runtime_error(filename + ":" + std::to_string(std::count(data, chunks[i].error, '\n') + 1) + ": invalid vertex index");
+        }
+    }
+}
+
+// PLY
+
+namespace {
+    enum class PlyType {
+        Int8,
+        UInt8,
+        Int16,
+        UInt16,
+        Int32,
+        UInt32,
+        Float32,
+        Float64
+    };
+
+    struct PlyProperty {
+        std::string name;
+        PlyType type;
+        bool list = false;
+        PlyType countType; // of lists
+    };
+
+    struct PlyElement {
+        std::string name;
+        std::size_t count = 0;
+        std::vector<PlyProperty> properties;
+        const unsigned char* data = nullptr;
+    };
+
+    struct PlyFaceChunk {
+        const unsigned char* begin;
+        std::size_t faceCount;
+        std::size_t firstTriangle;
+        bool invalid = false;
+    };
+}
+
+static bool ParsePlyType(const std::string& name, PlyType& type) {
+    static const char* names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+                                     {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+    for (int i = 0; i < 8; i++) {
+        if (name == names[i][0] || name == names[i][1]) {
+            type = (PlyType)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline std::size_t PlySize(PlyType type) {
+    static const std::size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[(int)type];
+}
+
+// assembled byte by byte, so it works on hosts of either byte order
+static inline double ReadPly(const unsigned char* p, PlyType type, bool bigEndian) {
+    std::size_t size = PlySize(type);
+    uint64_t bits = 0;
+    for (std::size_t i = 0; i < size; i++) {
+        bits |= (uint64_t)p[bigEndian ? size - 1 - i : i] << (8 * i);
+    }
+    switch (type) {
+        case PlyType::Int8: return (int8_t)bits;
+        case PlyType::UInt8: return (uint8_t)bits;
+        case PlyType::Int16: return (int16_t)bits;
+        case PlyType::UInt16: return (uint16_t)bits;
+        case PlyType::Int32: return (int32_t)bits;
+        case PlyType::UInt32: return (uint32_t)bits;
+        case PlyType::Float32: {
+            uint32_t word = (uint32_t)bits;
+            float value;
+            std::memcpy(&value, &word, sizeof(value));
+            return value;
+        }
+        default: {
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+    }
+}
+
+// bytes in the value of property at p, or 0 if it runs past end
+static inline std::size_t PlyPropertySize(const PlyProperty& property, const unsigned char* p, const unsigned char* end, bool bigEndian) {
+    if (!property.list) {
+        return (std::size_t)(end - p) < PlySize(property.type) ? 0 : PlySize(property.type);
+    }
+    std::size_t countSize = PlySize(property.countType);
+    if ((std::size_t)(end - p) < countSize) return 0;
+    double count = ReadPly(p, property.countType, bigEndian);
+    if (count < 0 || count * PlySize(property.type) > (end - p) - countSize) return 0;
+    return countSize + (std::size_t)count * PlySize(property.type);
+}
+
+// bytes in the record of element at p, or 0 if it runs past end
+static std::size_t PlyRecordSize(const PlyElement& element, const unsigned char* p, const unsigned char* end, bool bigEndian) {
+    const unsigned char* start = p;
+    for (std::size_t i = 0; i < element.properties.size(); i++) {
+        std::size_t size = PlyPropertySize(element.properties[i], p, end, bigEndian);
+        if (size == 0) return 0;
+        p += size;
+    }
+    return p - start;
+}
+
+static void ParsePlyHeader(const MappedFile& file, const std::string& filename, std::vector<PlyElement>& elements,
+                           bool& bigEndian, const unsigned char*& body) {
+    const char* end = file.data + file.size;
+    const char* line = file.data;
+    bool format = false;
+    for (int number = 1; line < end; number++) {
+        const char* next = NextLine(line, end);
+        std::vector<std::string> words;
+        for (const char* p = SkipSpaces(line, next); p < next && *p != '\n'; p = SkipSpaces(p, next)) {
+            const char* word = p;
+            while (p < next && !IsSpace(*p) && *p != '\n') p++;
+            words.push_back(std::string(word, p));
+        }
+        std::string malformed = filename + ":" + std::to_string(number) + ": malformed header line";
+        if (number == 1) {
+            if (words.size() != 1 || words[0] != "ply") throw std::runtime_error(filename + " is not a PLY file");
+        } else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+            // nothing to read
+        } else if (words[0] == "format") {
+            if (words.size() != 3) throw std::runtime_error(malformed);
+            if (words[1] != "binary_little_endian" && words[1] != "binary_big_endian") {
+                throw std::runtime_error(filename + ": only binary PLY files are supported, not " + words[1]);
+            }
+            bigEndian = words[1] == "binary_big_endian";
+            format = true;
+        } else if (words[0] == "element") {
+            if (words.size() != 3) throw std::runtime_error(malformed);
+            PlyElement element;
+            element.name = words[1];
+            element.count = std::strtoull(words[2].c_str(), nullptr, 10);
+            elements.push_back(element);
+        } else if (words[0] == "property") {
+            PlyProperty property;
+            bool valid = !elements.empty();
+            if (words.size() == 5 && words[1] == "list") {
+                property.list = true;
+                valid = valid && ParsePlyType(words[2], property.countType) && ParsePlyType(words[3], property.type);
+            } else {
+                valid = valid && words.size() == 3 && ParsePlyType(words[1], property.type);
+            }
+            if (!valid) throw std::runtime_error(malformed);
+            property.name = words.back();
+            elements.back().properties.push_back(property);
+        } else if (words[0] == "end_header") {
+            if (!format) throw std::runtime_error(filename + ": no format in the header");
+            body = (const unsigned char*)next;
+            return;
+        } else {
+            throw std::runtime_error(malformed);
+        }
+        line = next;
+    }
+    throw std::runtime_error(filename + ": no end_header");
+}
+
+static void LoadPly(const MappedFile& file, const std::string& filename, int materialIndex, std::vector<Triangle>& triangles) {
+    std::vector<PlyElement> elements;
+    bool bigEndian = false;
+    const unsigned char* p = nullptr;
+    ParsePlyHeader(file, filename, elements, bigEndian, p);
+    const unsigned char* end = (const unsigned char*)file.data + file.size;
+    std::string truncated = filename + ": file ends early";
+
+    // Find where each element starts. Faces are walked once here, since a record's
+    // size depends on its vertex count, and the offsets of every FacesPerChunk
+    // faces are kept for the parallel pass.
+    const PlyElement* vertexElement = nullptr;
+    std::size_t vertexStride = 0;
+    int xyz[3] = {-1, -1, -1};
+    std::vector<std::size_t> xyzOffsets(3);
+    const PlyElement* faceElement = nullptr;
+    int indexProperty = -1;
+    std::vector<PlyFaceChunk> faceChunks;
+    std::size_t triangleCount = 0;
+    for (std::size_t e = 0; e < elements.size(); e++) {
+        PlyElement& element = elements[e];
+        element.data = p;
+        if (element.name == "vertex") {
+            for (std::size_t i = 0; i < element.properties.size(); i++) {
+                const PlyProperty& property = element.properties[i];
+                if (property.list) throw std::runtime_error(filename + ": vertices with list properties are not supported");
+                for (int axis = 0; axis < 3; axis++) {
+                    if (property.name == std::string(1, "xyz"[axis])) {
+                        xyz[axis] = i;
+                        xyzOffsets[axis] = vertexStride;
+                    }
+                }
+                vertexStride += PlySize(property.type);
+            }
+            if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0) throw std::runtime_error(filename + ": vertices without x, y and z");
+            if (vertexStride == 0 || (std::size_t)(end - p) / vertexStride < element.count) throw std::runtime_error(truncated);
+            vertexElement = &element;
+            p += element.count * vertexStride;
+        } else if (element.name == "face") {
+            for (std::size_t i = 0; i < element.properties.size(); i++) {
+                const PlyProperty& property = element.properties[i];
+                if (property.list && (property.name == "vertex_indices" || property.name == "vertex_index")) indexProperty = i;
+            }
+            if (indexProperty < 0) throw std::runtime_error(filename + ": faces without vertex_indices");
+            faceElement = &element;
+            for (std::size_t face = 0; face < element.count; face++) {
+                if (face % FacesPerChunk == 0) {
+                    PlyFaceChunk chunk;
+                    chunk.begin = p;
+                    chunk.faceCount = std::min(FacesPerChunk, element.count - face);
+                    chunk.firstTriangle = triangleCount;
+                    faceChunks.push_back(chunk);
+                }
+                // the vertex count of the face, found by skipping the properties before it
+                const unsigned char* corners = p;
+                for (int i = 0; i < indexProperty; i++) {
+                    corners += PlyPropertySize(element.properties[i], corners, end, bigEndian);
+                }
+                std::size_t size = PlyRecordSize(element, p, end, bigEndian);
+                if (size == 0) throw std::runtime_error(truncated);
+                double count = ReadPly(corners, element.properties[indexProperty].countType, bigEndian);
+                if (count < 3) throw std::runtime_error(filename + ": face " + std::to_string(face) + " has fewer than three vertices");
+                triangleCount += (std::size_t)count - 2;
+                p += size;
+            }
+        } else {
+            for (std::size_t i = 0; i < element.count; i++) {
+                std::size_t size = PlyRecordSize(element, p, end, bigEndian);
+                if (size == 0) throw std::runtime_error(truncated);
+                p += size;
+            }
+        }
+    }
+    if (vertexElement == nullptr) throw std::runtime_error(filename + ": no vertex element");
+    if (faceElement == nullptr) return;
+
+    ThreadPool pool;
+    std::vector<Vec3> vertices(vertexElement->count);
+    PlyType types[3];
+    for (int axis = 0; axis < 3; axis++) {
+        types[axis] = vertexElement->properties[xyz[axis]].type;
+    }
+    pool.ParallelFor(0, vertices.size(), 1 << 16, [&](int begin, int vertexEnd) {
+        for (int i = begin; i < vertexEnd; i++) {
+            const unsigned char* record = vertexElement->data + (std::size_t)i * vertexStride;
+            vertices[i] = Vec3(ReadPly(record + xyzOffsets[0], types[0], bigEndian),
+                               ReadPly(record + xyzOffsets[1], types[1], bigEndian),
+                               ReadPly(record + xyzOffsets[2], types[2], bigEndian));
+        }
+    });
+
+    std::size_t base = triangles.size();
+    triangles.resize(base + triangleCount);
+    const PlyProperty& indices = faceElement->properties[indexProperty];
+    std::size_t indexSize = PlySize(indices.type);
+    pool.ParallelFor(0, faceChunks.size(), 1, [&](int begin, int chunkEnd) {
+        for (int c = begin; c < chunkEnd; c++) {
+            PlyFaceChunk& chunk = faceChunks[c];
+            const unsigned char* record = chunk.begin;
+            Triangle* out = triangles.data() + base + chunk.firstTriangle;
+            for (std::size_t face = 0; face < chunk.faceCount && !chunk.invalid; face++) {
+                // record sizes were checked by the first pass
+                const unsigned char* corners = record;
+                for (int i = 0; i < indexProperty; i++) {
+                    corners += PlyPropertySize(faceElement->properties[i], corners, end, bigEndian);
+                }
+                std::size_t count = (std::size_t)ReadPly(corners, indices.countType, bigEndian);
+                corners += PlySize(indices.countType);
+                double first = ReadPly(corners, indices.type, bigEndian);
+                double previous = ReadPly(corners + indexSize, indices.type, bigEndian);
+                for (std::size_t k = 2; k < count; k++) {
+                    double current = ReadPly(corners + k * indexSize, indices.type, bigEndian);
+                    if (std::min(first, std::min(previous, current)) < 0 ||
+                        std::max(first, std::max(previous, current)) >= vertices.size()) {
+                        chunk.invalid = true;
+                        break;
+                    }
+                    out->a = vertices[(std::size_t)first];
+                    out->b = vertices[(std::size_t)previous];
+                    out->c = vertices[(std::size_t)current];
+                    out->materialIndex = materialIndex;
+                    out++;
+                    previous = current;
+                }
+                record += PlyRecordSize(*faceElement, record, end, bigEndian);
+            }
+        }
+    });
+    for (std::size_t c = 0; c < faceChunks.size(); c++) {
+        if (faceChunks[c].invalid) {
+            triangles.resize(base);
+            throw std::runtime_error(filename + ": invalid vertex index");
+        }
+    }
+}
+
+void MeshFile::Load(const std::string& filename, int materialIndex, std::vector<Triangle>& triangles) {
+    std::string extension = Extension(filename);
+    if (extension != "obj" && extension != "ply") {
+        throw std::runtime_error("unsupported mesh format " + filename);
+    }
+    MappedFile file;
+    if (!file.Open(filename)) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+    if (extension == "obj") {
+        LoadObj(file, filename, materialIndex, triangles);
+    } else {
+        LoadPly(file, filename, materialIndex, triangles);
+    }
+}
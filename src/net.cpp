@@ -0,0 +1,211 @@
+#include "net.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+using namespace Magpie;
+
+static bool IsUnix(const std::string& address) {
+    return address.compare(0, 5, "unix:") == 0;
+}
+
+static bool UnixAddress(const std::string& address, sockaddr_un& result) {
+    std::string path = address.substr(5);
+    std::memset(&result, 0, sizeof(result));
+    result.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(result.sun_path)) {
+        std::cerr << "invalid socket path: " << path << "\n";
+        return false;
+    }
+    std::strcpy(result.sun_path, path.c_str());
+    return true;
+}
+
+// Resolves host:port. An empty host means IPv4 loopback, also when listening, so
+// that serving other machines takes naming an interface or 0.0.0.0 explicitly.
+static addrinfo* TCPAddress(const std::string& address) {
+    std::size_t colon = address.find_last_of(':');
+    if (colon == std::string::npos) {
+        std::cerr << "expected unix:<path> or <host>:<port>, got " << address << "\n";
+        return nullptr;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int error = getaddrinfo(host.empty() ? "127.0.0.1" : host.c_str(), port.c_str(), &hints, &result);
+    if (error != 0) {
+        std::cerr << "failed to resolve " << address << ": " << gai_strerror(error) << "\n";
+        return nullptr;
+    }
+    return result;
+}
+
+int Net::Listen(const std::string& address) {
+    int server;
+    if (IsUnix(address)) {
+        sockaddr_un local;
+        if (!UnixAddress(address, local)) return -1;
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0) {
+            std::cerr << "failed to create socket: " << std::strerror(errno) << "\n";
+            return -1;
+        }
+        // a socket file nobody answers on is left over from a server that died
+        if (connect(server, (sockaddr*)&local, sizeof(local)) == 0) {
+            std::cerr << "another server is listening on " << address << "\n";
+            close(server);
+            return -1;
+        }
+        Unlink(address);
+        if (bind(server, (sockaddr*)&local, sizeof(local)) != 0) {
+            std::cerr << "failed to bind " << address << ": " << std::strerror(errno) << "\n";
+            close(server);
+            return -1;
+        }
+    } else {
+        addrinfo* resolved = TCPAddress(address);
+        if (!resolved) return -1;
+        server = socket(resolved->ai_family, resolved->ai_socktype, resolved->ai_protocol);
+        int reuse = 1;
+        if (server < 0 || setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+            bind(server, resolved->ai_addr, resolved->ai_addrlen) != 0) {
+            std::cerr << "failed to bind " << address << ": " << std::strerror(errno) << "\n";
+            if (server >= 0) close(server);
+            freeaddrinfo(resolved);
+            return -1;
+        }
+        freeaddrinfo(resolved);
+    }
+    if (listen(server, 64) != 0) {
+        std::cerr << "failed to listen on " << address << ": " << std::strerror(errno) << "\n";
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
+int Net::Connect(const std::string& address) {
+    if (IsUnix(address)) {
+        sockaddr_un remote;
+        if (!UnixAddress(address, remote)) return -1;
+        int client = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (client >= 0 && connect(client, (sockaddr*)&remote, sizeof(remote)) == 0) {
+            return client;
+        }
+        std::cerr << "failed to connect to " << address << ": " << std::strerror(errno) << "\n";
+        if (client >= 0) close(client);
+        return -1;
+    }
+    addrinfo* resolved = TCPAddress(address);
+    if (!resolved) return -1;
+    int client = -1;
+    for (addrinfo* candidate = resolved; candidate; candidate = candidate->ai_next) {
+        client = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (client < 0) continue;
+        if (connect(client, candidate->ai_addr, candidate->ai_addrlen) == 0) break;
+        close(client);
+        client = -1;
+    }
+    freeaddrinfo(resolved);
+    if (client < 0) {
+        std::cerr << "failed to connect to " << address << ": " << std::strerror(errno) << "\n";
+        return -1;
+    }
+    // requests are single small lines, they should not wait for more to batch with
+    int noDelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return client;
+}
+
+void Net::Unlink(const std::string& address) {
+    if (IsUnix(address)) {
+        unlink(address.substr(5).c_str());
+    }
+}
+
+bool Net::SendAll(int socket, const std::string& data) {
+    std::size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(socket, data.data() + sent, data.size() - sent, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// appends whatever arrives next to buffer
+static bool Receive(int socket, std::string& buffer, int timeoutMilliseconds) {
+    while (true) {
+        if (timeoutMilliseconds >= 0) {
+            pollfd readable = {socket, POLLIN, 0};
+            int ready = poll(&readable, 1, timeoutMilliseconds);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return false;
+        }
+        char chunk[65536];
+        ssize_t n = recv(socket, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+        return true;
+    }
+}
+
+bool Net::ReadLine(int socket, std::string& buffer, std::string& line, int timeoutMilliseconds) {
+    std::size_t newline;
+    while ((newline = buffer.find('\n')) == std::string::npos) {
+        // a line is a short request or reply, anything longer is not one
+        if (buffer.size() > 65536) return false;
+        if (!Receive(socket, buffer, timeoutMilliseconds)) return false;
+    }
+    line = buffer.substr(0, newline);
+    buffer.erase(0, newline + 1);
+    if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+    return true;
+}
+
+bool Net::ReadExact(int socket, std::string& buffer, std::string& data, std::size_t size, int timeoutMilliseconds) {
+    while (buffer.size() < size) {
+        if (!Receive(socket, buffer, timeoutMilliseconds)) return false;
+    }
+    data = buffer.substr(0, size);
+    buffer.erase(0, size);
+    return true;
+}
+
+void Net::AppendFloats(std::string& out, const float* values, std::size_t count) {
+    std::size_t start = out.size();
+    out.resize(start + count * 4);
+    for (std::size_t i = 0; i < count; i++) {
+        uint32_t bits;
+        std::memcpy(&bits, &values[i], sizeof(bits));
+        for (int b = 0; b < 4; b++) {
+            out[start + 4*i + b] = (char)((bits >> (8 * b)) & 0xff);
+        }
+    }
+}
+
+void Net::ReadFloats(const std::string& in, float* values, std::size_t count) {
+    for (std::size_t i = 0; i < count; i++) {
+        uint32_t bits = 0;
+        for (int b = 0; b < 4; b++) {
+            bits |= (uint32_t)(unsigned char)in[4*i + b] << (8 * b);
+        }
+        std::memcpy(&values[i], &bits, sizeof(bits));
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace Magpie {
+    // Blocking socket helpers shared by the server and the coordinator. Addresses are
+    // either "unix:<path>" for a Unix domain socket or "<host>:<port>" for TCP.
+    namespace Net {
+        // both return -1 and print why on failure
+        int Listen(const std::string& address);
+        int Connect(const std::string& address);
+        // removes the socket file of a Unix domain address
+        void Unlink(const std::string& address);
+        bool SendAll(int socket, const std::string& data);
+        // Read a line without its line break, or an exact number of bytes. Bytes read
+        // past it stay in buffer for the next call. They fail once nothing arrived for
+        // timeoutMilliseconds, a negative timeout waits forever.
+        bool ReadLine(int socket, std::string& buffer, std::string& line, int timeoutMilliseconds = -1);
+        bool ReadExact(int socket, std::string& buffer, std::string& data, std::size_t size, int timeoutMilliseconds = -1);
+        // little endian, whatever the host
+        void AppendFloats(std::string& out, const float* values, std::size_t count);
+        void ReadFloats(const std::string& in, float* values, std::size_t count);
+    }
+}
@@ -0,0 +1,478 @@
+#include <Magpie/pathtracer.h>
+#include <Magpie/bvh.h>
+#include <Magpie/image.h>
+#include <Magpie/intersect.h>
+#include <Magpie/thread_pool.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+using namespace Magpie;
+
+// Mirrors the OpenCL kernel step for step so both backends produce the same image,
+// up to the precision of the device's math functions.
+
+static const int MaxBounces = 8;
+static const float Infinity = std::numeric_limits<float>::infinity();
+// M_PI is not standard, MSVC only defines it with _USE_MATH_DEFINES
+static constexpr float Pi = 3.14159265358979f;
+
+struct Ray {
+    Vec3 origin;
+    Vec3 direction;
+    Vec3 energy;
+};
+
+struct RayHit {
+    Vec3 position;
+    float distance;
+    Vec3 normal;
+    Vec3 specular;
+    Vec3 albedo;
+};
+
+struct PlacedInstance {
+    float worldToObject[3][4]; // the rows that matter of the affine inverse
+    int mesh;
+};
+
+struct MeshData {
+    std::vector<Triangle> triangles;
+    BVH bvh;
+    WideBVH wideBVH;
+    TriangleSoA leafTriangles; // in leaf order
+};
+
+// everything Trace reads, kept apart from SceneData so the free functions can name it
+struct TraceScene {
+    bool ground;
+    Vec4 directionalLight;
+    std::vector<Sphere> spheres;
+    std::vector<Triangle> triangles;
+    std::vector<Material> materials;
+    BVH worldBVH;
+    WideBVH worldWideBVH;
+    // Primitives of the world tree in leaf order. A slot holds either a sphere or a
+    // triangle, the other array has a slot there that never hits.
+    SphereSoA leafSpheres;
+    TriangleSoA leafTriangles;
+    std::vector<MeshData> meshes;
+    std::vector<PlacedInstance> instances; // in instance tree leaf order
+    BVH instanceBVH;
+    WideBVH instanceWideBVH;
+    Intersect::Kernels kernels;
+};
+
+struct CPUPathTracer::SceneData : TraceScene {};
+
+static Vec3 Multiply(const Vec3& a, const Vec3& b) {
+    return Vec3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+static float Axis(const Vec3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static void IntersectGroundPlane(const Ray& ray, RayHit& hit, const std::vector<Material>& materials) {
+    float t = -ray.origin.y / ray.direction.y;
+    if (t > 0 && t < hit.distance) {
+        hit.distance = t;
+        hit.position = ray.origin + t * ray.direction;
+        hit.normal = Vec3(0.0f, 1.0f, 0.0f);
+        hit.specular = materials[0].specular;
+        hit.albedo = materials[0].albedo;
+    }
+}
+
+static void SetSphereHit(const Ray& ray, RayHit& hit, float t, const Sphere& sphere, const std::vector<Material>& materials) {
+    hit.distance = t;
+    hit.position = ray.origin + t * ray.direction;
+    hit.normal = Vector::Normalize(hit.position - sphere.center);
+    hit.specular = materials[sphere.materialIndex].specular;
+    hit.albedo = materials[sphere.materialIndex].albedo;
+}
+
+static void SetTriangleHit(const Ray& ray, RayHit& hit, float t, const Triangle& triangle, const std::vector<Material>& materials) {
+    hit.distance = t;
+    hit.position = ray.origin + t * ray.direction;
+    hit.normal = Vector::Normalize(Vector::Cross(triangle.b - triangle.a, triangle.c - triangle.a));
+    hit.specular = materials[triangle.materialIndex].specular;
+    hit.albedo = materials[triangle.materialIndex].albedo;
+}
+
+// returns the distance at which the ray enters the box, or infinity on a miss
+static float IntersectAABB(const Ray& ray, const Vec3& invDirection, const float boxMin[3], const float boxMax[3], float maxDistance) {
+    float tNear[3], tFar[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float t1 = (boxMin[axis] - Axis(ray.origin, axis)) * Axis(invDirection, axis);
+        float t2 = (boxMax[axis] - Axis(ray.origin, axis)) * Axis(invDirection, axis);
+        tNear[axis] = std::fmin(t1, t2);
+        tFar[axis] = std::fmax(t1, t2);
+    }
+    float enter = std::fmax(std::fmax(tNear[0], tNear[1]), tNear[2]);
+    float exit = std::fmin(std::fmin(tFar[0], tFar[1]), tFar[2]);
+    if (exit < std::fmax(enter, 0.0f) || enter >= maxDistance)
+        return Infinity;
+    return enter;
+}
+
+// Tests the ray against the quantized child boxes of a wide node. Leaf children that
+// are hit are returned through leafFirst and leafCount, interior ones are pushed so
+// that the nearest of them is visited next.
+static int VisitWideNode(const Ray& ray, const Vec3& invDirection, const WideBVHNode& node, float maxDistance, int* stack, int& stackSize, int* leafFirst, int* leafCount) {
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = std::ldexp(1.0f, node.exponent[axis]);
+    }
+    int numLeaves = 0;
+    int innerNodes[WideBVH::Width];
+    float innerDistances[WideBVH::Width];
+    int numInner = 0;
+    for (int i = 0; i < node.childCount; i++) {
+        float boxMin[3], boxMax[3];
+        for (int axis = 0; axis < 3; axis++) {
+            boxMin[axis] = node.origin[axis] + node.qmin[axis][i] * scale[axis];
+            boxMax[axis] = node.origin[axis] + node.qmax[axis][i] * scale[axis];
+        }
+        float t = IntersectAABB(ray, invDirection, boxMin, boxMax, maxDistance);
+        if (t == Infinity)
+            continue;
+        if (node.count[i] > 0) {
+            leafFirst[numLeaves] = node.child[i];
+            leafCount[numLeaves++] = node.count[i];
+        } else {
+            // keep interior hits sorted farthest first
+            int j = numInner++;
+            while (j > 0 && innerDistances[j - 1] < t) {
+                innerDistances[j] = innerDistances[j - 1];
+                innerNodes[j] = innerNodes[j - 1];
+                j--;
+            }
+            innerDistances[j] = t;
+            innerNodes[j] = node.child[i];
+        }
+    }
+    for (int i = 0; i < numInner; i++) {
+        stack[stackSize++] = innerNodes[i];
+    }
+    return numLeaves;
+}
+
+// Walks a wide tree and calls visit with the first position and the count of every
+// hit leaf, in the order of the tree's primitive indices.
+template<typename Visit>
+static void Traverse(const Ray& ray, RayHit& hit, WideBVH& wideBVH, Visit visit) {
+    const std::vector<WideBVHNode>& nodes = wideBVH.GetNodes();
+    Vec3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    int stack[(WideBVH::Width - 1) * BVH::MaxDepth + 1];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    int leafFirst[WideBVH::Width];
+    int leafCount[WideBVH::Width];
+    while (stackSize > 0) {
+        int nodeIndex = stack[--stackSize];
+        int numLeaves = VisitWideNode(ray, invDirection, nodes[nodeIndex], hit.distance, stack, stackSize, leafFirst, leafCount);
+        for (int l = 0; l < numLeaves; l++) {
+            visit(leafFirst[l], leafCount[l]);
+        }
+    }
+}
+
+// Intersects the instanced mesh in object space. Hit distances carry over unchanged
+// because the direction is transformed without renormalizing it.
+static void IntersectInstance(const Ray& ray, RayHit& hit, const PlacedInstance& instance, MeshData& mesh, TraceScene& scene) {
+    const float (*m)[4] = instance.worldToObject;
+    Ray local;
+    local.origin = Vec3(m[0][0] * ray.origin.x + m[0][1] * ray.origin.y + m[0][2] * ray.origin.z + m[0][3],
+                        m[1][0] * ray.origin.x + m[1][1] * ray.origin.y + m[1][2] * ray.origin.z + m[1][3],
+                        m[2][0] * ray.origin.x + m[2][1] * ray.origin.y + m[2][2] * ray.origin.z + m[2][3]);
+    local.direction = Vec3(m[0][0] * ray.direction.x + m[0][1] * ray.direction.y + m[0][2] * ray.direction.z,
+                           m[1][0] * ray.direction.x + m[1][1] * ray.direction.y + m[1][2] * ray.direction.z,
+                           m[2][0] * ray.direction.x + m[2][1] * ray.direction.y + m[2][2] * ray.direction.z);
+    local.energy = ray.energy;
+
+    const std::vector<int>& primitives = mesh.bvh.GetPrimitiveIndices();
+    float distance = hit.distance;
+    Traverse(local, hit, mesh.wideBVH, [&](int first, int count) {
+        float t = hit.distance;
+        int leaf = scene.kernels.triangles(mesh.leafTriangles, first, count, local.origin, local.direction, t);
+        if (leaf >= 0) SetTriangleHit(local, hit, t, mesh.triangles[primitives[leaf]], scene.materials);
+    });
+    if (hit.distance < distance) {
+        // normals transform by the inverse transpose
+        Vec3 n = hit.normal;
+        hit.position = ray.origin + hit.distance * ray.direction;
+        hit.normal = Vector::Normalize(Vec3(n.x * m[0][0] + n.y * m[1][0] + n.z * m[2][0],
+                                            n.x * m[0][1] + n.y * m[1][1] + n.z * m[2][1],
+                                            n.x * m[0][2] + n.y * m[1][2] + n.z * m[2][2]));
+    }
+}
+
+static RayHit Trace(const Ray& ray, TraceScene& scene) {
+    RayHit hit;
+    hit.position = Vec3(0.0f, 0.0f, 0.0f);
+    hit.distance = Infinity;
+    hit.normal = Vec3(0.0f, 0.0f, 0.0f);
+    if (scene.ground) IntersectGroundPlane(ray, hit, scene.materials);
+    int numSpheres = scene.spheres.size();
+    if (numSpheres + scene.triangles.size() > 0) {
+        const std::vector<int>& primitives = scene.worldBVH.GetPrimitiveIndices();
+        Traverse(ray, hit, scene.worldWideBVH, [&](int first, int count) {
+            // a triangle only replaces the nearest sphere when it is strictly closer,
+            // exact ties between the two kinds are resolved in favour of the sphere
+            float t = hit.distance;
+            int sphere = numSpheres > 0 ? scene.kernels.spheres(scene.leafSpheres, first, count, ray.origin, ray.direction, t) : -1;
+            int triangle = !scene.triangles.empty() ? scene.kernels.triangles(scene.leafTriangles, first, count, ray.origin, ray.direction, t) : -1;
+            if (triangle >= 0) SetTriangleHit(ray, hit, t, scene.triangles[primitives[triangle] - numSpheres], scene.materials);
+            else if (sphere >= 0) SetSphereHit(ray, hit, t, scene.spheres[primitives[sphere]], scene.materials);
+        });
+    }
+    if (!scene.instances.empty()) {
+        // instances are stored in leaf order so top-level leaves index them directly
+        Traverse(ray, hit, scene.instanceWideBVH, [&](int first, int count) {
+            for (int i = first; i < first + count; i++) {
+                IntersectInstance(ray, hit, scene.instances[i], scene.meshes[scene.instances[i].mesh], scene);
+            }
+        });
+    }
+    return hit;
+}
+
+static Vec3 Reflect(const Vec3& i, const Vec3& n) {
+    return i - 2 * n * Vector::Dot(i, n);
+}
+
+static Vec4 Shade(const std::vector<Vec4>& sky, int skyWidth, int skyHeight, const Vec4& directionalLight, Ray& r, const RayHit& hit) {
+    if (hit.distance < Infinity) {
+        r.origin = hit.position + hit.normal * 0.001f;
+        r.direction = Reflect(r.direction, hit.normal);
+        r.energy = Multiply(r.energy, hit.specular);
+        Vec3 lightDirection(directionalLight.x, directionalLight.y, directionalLight.z);
+        float diffuse = std::min(std::max(Vector::Dot(hit.normal, lightDirection) * -1, 0.0f), 1.0f) * directionalLight.w;
+        return Vec4(diffuse * hit.albedo.x, diffuse * hit.albedo.y, diffuse * hit.albedo.z, 1.0f);
+    }
+    r.energy = Vec3(0.0f, 0.0f, 0.0f);
+    if (sky.empty()) return Vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    float x = 0.5f * std::atan2(r.direction.x, r.direction.z) / Pi;
+    float y = std::acos(-r.direction.y) / Pi;
+    int row = (int)(y*skyHeight);
+    int col = (int)(x*skyWidth);
+    // indexed linearly and kept in bounds, the same way as in the kernel
+    int index = std::min(std::max(row*skyWidth + col, 0), (int)sky.size() - 1);
+    return sky[index];
+}
+
+static uint32_t Hash(uint32_t x) {
+    x = (x ^ 61u) ^ (x >> 16);
+    x *= 9u;
+    x = x ^ (x >> 4);
+    x *= 0x27d4eb2du;
+    x = x ^ (x >> 15);
+    return x;
+}
+
+// uniform in [0, 1)
+static float RandomFloat(uint32_t& state) {
+    state = Hash(state);
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+static Vec3 Transform(const Mat4& m, const Vec4& v) {
+    Vec4 result = m * v;
+    return Vec3(result.x, result.y, result.z);
+}
+
+CPUPathTracer::~CPUPathTracer() {
+    delete sceneData;
+    delete threadPool;
+}
+
+void CPUPathTracer::Initialize() {
+    threadPool = new ThreadPool();
+}
+
+ThreadPoolStats CPUPathTracer::GetThreadPoolStats() {
+    return threadPool->GetStats();
+}
+
+void CPUPathTracer::SetSky(std::string filename) {
+    SetSky(LoadTexture(filename));
+}
+
+void CPUPathTracer::SetSky(const Texture& texture) {
+    sky = texture.pixels;
+    skyWidth = texture.width;
+    skyHeight = texture.height;
+    sampleCount = 0;
+}
+
+void CPUPathTracer::LoadScene(Scene scene) {
+    if (!scene.sky.pixels.empty()) {
+        SetSky(scene.sky);
+    } else if (!scene.skyFilename.empty()) {
+        SetSky(scene.skyFilename);
+    } else {
+        // no sky is black rather than the one of the scene loaded before
+        SetSky(Texture());
+    }
+    sampleCount = 0;
+
+    delete sceneData;
+    sceneData = new SceneData();
+    SceneData& data = *sceneData;
+    data.ground = scene.ground;
+    data.directionalLight = Vec4(scene.directionalLight.direction.x,
+                                 scene.directionalLight.direction.y,
+                                 scene.directionalLight.direction.z,
+                                 scene.directionalLight.intensity);
+    data.spheres = scene.GetSpheres();
+    data.triangles = scene.GetTriangles();
+    data.materials = scene.GetMaterials();
+    data.kernels = Intersect::GetKernels(Intersect::DetectLevel());
+
+    // spheres come first in the primitive numbering, triangles follow
+    if (!scene.HasBVHs()) {
+        scene.BuildBVHs(threadPool);
+    }
+    data.worldBVH = scene.GetWorldBVH();
+    data.worldWideBVH.Build(data.worldBVH);
+    const std::vector<int>& worldOrder = data.worldBVH.GetPrimitiveIndices();
+    for (int i = 0; i < worldOrder.size(); i++) {
+        int primitive = worldOrder[i];
+        if (primitive < data.spheres.size()) {
+            Intersect::Append(data.leafSpheres, data.spheres[primitive]);
+            Intersect::AppendMissing(data.leafTriangles);
+        } else {
+            Intersect::AppendMissing(data.leafSpheres);
+            Intersect::Append(data.leafTriangles, data.triangles[primitive - data.spheres.size()]);
+        }
+    }
+    Intersect::Pad(data.leafSpheres);
+    Intersect::Pad(data.leafTriangles);
+
+    const std::vector<Mesh>& meshes = scene.GetMeshes();
+    data.meshes.resize(meshes.size());
+    for (int m = 0; m < meshes.size(); m++) {
+        MeshData& mesh = data.meshes[m];
+        mesh.triangles = meshes[m].triangles;
+        mesh.bvh = scene.GetMeshBVHs()[m];
+        mesh.wideBVH.Build(mesh.bvh);
+        const std::vector<int>& meshOrder = mesh.bvh.GetPrimitiveIndices();
+        for (int i = 0; i < meshOrder.size(); i++) {
+            Intersect::Append(mesh.leafTriangles, mesh.triangles[meshOrder[i]]);
+        }
+        Intersect::Pad(mesh.leafTriangles);
+    }
+
+    // instances of empty meshes are dropped, the rest are stored in leaf order
+    const std::vector<Instance>& instances = scene.GetInstances();
+    std::vector<int> placed;
+    std::vector<AABB> bounds;
+    for (int i = 0; i < instances.size(); i++) {
+        MeshData& mesh = data.meshes[instances[i].meshIndex];
+        if (mesh.triangles.empty()) continue;
+        placed.push_back(i);
+        bounds.push_back(Bounds::Transform(mesh.bvh.GetNodes()[0].bounds, instances[i].transform));
+    }
+    data.instanceBVH.Build(bounds, threadPool);
+    data.instanceWideBVH.Build(data.instanceBVH);
+    const std::vector<int>& order = data.instanceBVH.GetPrimitiveIndices();
+    data.instances.resize(placed.size());
+    for (int i = 0; i < placed.size(); i++) {
+        const Instance& instance = instances[placed[order[i]]];
+        Mat4 worldToObject = Matrix::Inverse(instance.transform);
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 4; col++) {
+                data.instances[i].worldToObject[row][col] = worldToObject[col][row];
+            }
+        }
+        data.instances[i].mesh = instance.meshIndex;
+    }
+}
+
+void CPUPathTracer::Render() {
+    if (!sceneData) {
+        throw std::runtime_error("Render called before LoadScene");
+    }
+    std::size_t pixelCount = width*height;
+    if (accumulation.size() != pixelCount) {
+        accumulation.resize(pixelCount);
+        frame.resize(pixelCount*4);
+        sampleCount = 0;
+    }
+    Mat4 cameraToWorld = Matrix::Inverse(view);
+    Mat4 inverseProjection = Matrix::Inverse(projection);
+    Vec3 origin = Transform(cameraToWorld, Vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    int sampleIndex = sampleCount;
+    unsigned int sequenceIndex = sampleOffset + sampleCount;
+    SceneData& data = *sceneData;
+
+    int tilesX = (width + TileSize - 1) / TileSize;
+    int tilesY = (height + TileSize - 1) / TileSize;
+    threadPool->ParallelFor(0, tilesX * tilesY, 1, [&](int begin, int end) {
+        for (int tile = begin; tile < end; tile++) {
+            int x0 = (tile % tilesX) * TileSize;
+            int y0 = (tile / tilesX) * TileSize;
+            int x1 = std::min(x0 + TileSize, (int)width);
+            int y1 = std::min(y0 + TileSize, (int)height);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    int gid = y * width + x;
+                    // the first sample goes through the pixel corner, later ones are jittered
+                    float offsetX = 0.0f, offsetY = 0.0f;
+                    if (sequenceIndex > 0) {
+                        uint32_t state = Hash(gid * 9781u + sequenceIndex * 6271u);
+                        offsetX = RandomFloat(state);
+                        offsetY = RandomFloat(state);
+                    }
+                    float u = (((x + offsetX) / width) * 2.0f) - 1.0f;
+                    float v = (((y + offsetY) / height) * 2.0f) - 1.0f;
+                    Vec4 direction = inverseProjection * Vec4(u, v, 0.0f, 1.0f);
+                    Ray r;
+                    r.origin = origin;
+                    r.direction = Vector::Normalize(Transform(cameraToWorld, Vec4(direction.x, direction.y, direction.z, 0.0f)));
+                    r.energy = Vec3(1.0f, 1.0f, 1.0f);
+
+                    Vec4 color(0.0f, 0.0f, 0.0f, 0.0f);
+                    for (int i = 0; i < MaxBounces; i++) {
+                        RayHit hit = Trace(r, data);
+                        Vec3 energy = r.energy;
+                        Vec4 shaded = Shade(sky, skyWidth, skyHeight, data.directionalLight, r, hit);
+                        color += Vec4(energy.x * shaded.x, energy.y * shaded.y, energy.z * shaded.z, shaded.w);
+                        if (r.energy.x == 0.0f || r.energy.y == 0.0f || r.energy.z == 0.0f) {
+                            break;
+                        }
+                    }
+
+                    // running sum of every sample since the last reset, the frame holds its average
+                    Vec4 sum = sampleIndex > 0 ? accumulation[gid] + color : color;
+                    accumulation[gid] = sum;
+                    Vec4 average = sum / (float)(sampleIndex + 1);
+                    frame[4*gid] = average.x;
+                    frame[4*gid + 1] = average.y;
+                    frame[4*gid + 2] = average.z;
+                    frame[4*gid + 3] = average.w;
+                }
+            }
+        }
+    });
+    pixels = frame.data();
+
+    if (pixelFormat == PixelFormat::RGBA8) {
+        float scale = std::exp2(exposure);
+        packed.resize(pixelCount*4);
+        threadPool->ParallelFor(0, pixelCount, 1 << 14, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                packed[4*i] = Image::TonemapChannel(frame[4*i] * scale);
+                packed[4*i + 1] = Image::TonemapChannel(frame[4*i + 1] * scale);
+                packed[4*i + 2] = Image::TonemapChannel(frame[4*i + 2] * scale);
+                packed[4*i + 3] = 255;
+            }
+        });
+        packedPixels = packed.data();
+    }
+    sampleCount++;
+}
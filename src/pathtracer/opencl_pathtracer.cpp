@@ -2,9 +2,29 @@
 #define CL_HPP_TARGET_OPENCL_VERSION 120
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
 #include <opencl.hpp>
-#include <stb_image.h>
 
 #include <Magpie/pathtracer.h>
+#include <Magpie/bvh.h>
+#include <Magpie/thread_pool.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 using namespace Magpie;
 
@@ -41,6 +61,21 @@ typedef struct {
     float3 albedo;
 } Material;
 
+typedef struct {
+    float origin[3];
+    char exponent[3];
+    uchar childCount;
+    uchar qmin[12];
+    uchar qmax[12];
+    int child[4];
+    ushort count[4];
+} WideBVHNode;
+
+typedef struct {
+    float4 worldToObject[3];
+    int root;
+} Instance;
+
 RayHit create_ray_hit() {
     RayHit hit;
     hit.position = (float3)(0.0f, 0.0f, 0.0f);
@@ -95,24 +130,141 @@ int intersect_triangle(Ray ray, float3 vert0, float3 vert1, float3 vert2, float*
     return 1;
 }
 
-RayHit trace(Ray ray, int ground, __global Sphere* spheres, int numSpheres, __global Triangle* triangles, int numTriangles, __global Material* materials) {
-    RayHit bestHit = create_ray_hit();
-    if (ground) intersect_ground_plane(ray, &bestHit, materials);
-    for (int i = 0; i < numSpheres; i++) {
-        intersect_sphere(ray, &bestHit, spheres[i], materials);
-    }
-    for (int i = 0; i < numTriangles; i++) {
-        float t;
-        if (intersect_triangle(ray, triangles[i].a, triangles[i].b, triangles[i].c, &t)) {
-            if (t > 0 && t < bestHit.distance) {
-                bestHit.distance = t;
-                bestHit.position = ray.origin + t * ray.direction;
-                bestHit.normal = normalize(cross(triangles[i].b - triangles[i].a, triangles[i].c - triangles[i].a));
-                bestHit.specular = materials[triangles[i].materialIndex].specular;
-                bestHit.albedo = materials[triangles[i].materialIndex].albedo;
+void intersect_primitive(Ray ray, RayHit* hit, int primitive, __global Sphere* spheres, int numSpheres, __global Triangle* triangles, __global Material* materials) {
+    if (primitive < numSpheres) {
+        intersect_sphere(ray, hit, spheres[primitive], materials);
+        return;
+    }
+    Triangle triangle = triangles[primitive - numSpheres];
+    float t;
+    if (intersect_triangle(ray, triangle.a, triangle.b, triangle.c, &t)) {
+        if (t > 0 && t < hit->distance) {
+            hit->distance = t;
+            hit->position = ray.origin + t * ray.direction;
+            hit->normal = normalize(cross(triangle.b - triangle.a, triangle.c - triangle.a));
+            hit->specular = materials[triangle.materialIndex].specular;
+            hit->albedo = materials[triangle.materialIndex].albedo;
+        }
+    }
+}
+
+// returns the distance at which the ray enters the box, or INFINITY on a miss
+float intersect_aabb(Ray ray, float3 invDirection, float3 boxMin, float3 boxMax, float maxDistance) {
+    float3 t1 = (boxMin - ray.origin) * invDirection;
+    float3 t2 = (boxMax - ray.origin) * invDirection;
+    float3 tNear = fmin(t1, t2);
+    float3 tFar = fmax(t1, t2);
+    float enter = fmax(fmax(tNear.x, tNear.y), tNear.z);
+    float exit = fmin(fmin(tFar.x, tFar.y), tFar.z);
+    if (exit < fmax(enter, 0.0f) || enter >= maxDistance)
+        return INFINITY;
+    return enter;
+}
+
+// Tests the ray against the quantized child boxes of a wide node. Leaf children that
+// are hit are returned through leafFirst and leafCount, interior ones are pushed so
+// that the nearest of them is visited next.
+int visit_wide_node(Ray ray, float3 invDirection, __global WideBVHNode* node, float maxDistance, int* stack, int* stackSize, int* leafFirst, int* leafCount) {
+    float3 origin = (float3)(node->origin[0], node->origin[1], node->origin[2]);
+    float3 scale = (float3)(as_float((node->exponent[0] + 127) << 23),
+                            as_float((node->exponent[1] + 127) << 23),
+                            as_float((node->exponent[2] + 127) << 23));
+    int numLeaves = 0;
+    int innerNodes[4];
+    float innerDistances[4];
+    int numInner = 0;
+    for (int i = 0; i < node->childCount; i++) {
+        float3 qmin = (float3)((float)node->qmin[i], (float)node->qmin[4 + i], (float)node->qmin[8 + i]);
+        float3 qmax = (float3)((float)node->qmax[i], (float)node->qmax[4 + i], (float)node->qmax[8 + i]);
+        float t = intersect_aabb(ray, invDirection, origin + qmin * scale, origin + qmax * scale, maxDistance);
+        if (t == INFINITY)
+            continue;
+        if (node->count[i] > 0) {
+            leafFirst[numLeaves] = node->child[i];
+            leafCount[numLeaves++] = node->count[i];
+        } else {
+            // keep interior hits sorted farthest first
+            int j = numInner++;
+            while (j > 0 && innerDistances[j - 1] < t) {
+                innerDistances[j] = innerDistances[j - 1];
+                innerNodes[j] = innerNodes[j - 1];
+                j--;
+            }
+            innerDistances[j] = t;
+            innerNodes[j] = node->child[i];
+        }
+    }
+    for (int i = 0; i < numInner; i++) {
+        stack[(*stackSize)++] = innerNodes[i];
+    }
+    return numLeaves;
+}
+
+void traverse_primitives(Ray ray, RayHit* hit, int root, __global WideBVHNode* nodes, __global int* primitives, __global Sphere* spheres, int numSpheres, __global Triangle* triangles, __global Material* materials) {
+    float3 invDirection = 1.0f / ray.direction;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = root;
+    int leafFirst[4];
+    int leafCount[4];
+    while (stackSize > 0) {
+        int nodeIndex = stack[--stackSize];
+        int numLeaves = visit_wide_node(ray, invDirection, &nodes[nodeIndex], hit->distance, stack, &stackSize, leafFirst, leafCount);
+        for (int l = 0; l < numLeaves; l++) {
+            for (int i = 0; i < leafCount[l]; i++) {
+                intersect_primitive(ray, hit, primitives[leafFirst[l] + i], spheres, numSpheres, triangles, materials);
             }
         }
     }
+}
+
+// Intersects the instanced mesh in object space. Hit distances carry over unchanged
+// because the direction is transformed without renormalizing it.
+void intersect_instance(Ray ray, RayHit* hit, __global Instance* instance, __global WideBVHNode* nodes, __global int* primitives, __global Sphere* spheres, int numSpheres, __global Triangle* triangles, __global Material* materials) {
+    float4 row0 = instance->worldToObject[0];
+    float4 row1 = instance->worldToObject[1];
+    float4 row2 = instance->worldToObject[2];
+    Ray local;
+    float4 origin = (float4)(ray.origin, 1.0f);
+    local.origin = (float3)(dot(row0, origin), dot(row1, origin), dot(row2, origin));
+    local.direction = (float3)(dot(row0.xyz, ray.direction), dot(row1.xyz, ray.direction), dot(row2.xyz, ray.direction));
+    local.energy = ray.energy;
+
+    float distance = hit->distance;
+    traverse_primitives(local, hit, instance->root, nodes, primitives, spheres, numSpheres, triangles, materials);
+    if (hit->distance < distance) {
+        // normals transform by the inverse transpose
+        float3 n = hit->normal;
+        hit->position = ray.origin + hit->distance * ray.direction;
+        hit->normal = normalize(n.x * row0.xyz + n.y * row1.xyz + n.z * row2.xyz);
+    }
+}
+
+void traverse_instances(Ray ray, RayHit* hit, int root, __global WideBVHNode* nodes, __global int* primitives, __global Instance* instances, __global Sphere* spheres, int numSpheres, __global Triangle* triangles, __global Material* materials) {
+    float3 invDirection = 1.0f / ray.direction;
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = root;
+    int leafFirst[4];
+    int leafCount[4];
+    while (stackSize > 0) {
+        int nodeIndex = stack[--stackSize];
+        int numLeaves = visit_wide_node(ray, invDirection, &nodes[nodeIndex], hit->distance, stack, &stackSize, leafFirst, leafCount);
+        for (int l = 0; l < numLeaves; l++) {
+            for (int i = 0; i < leafCount[l]; i++) {
+                intersect_instance(ray, hit, &instances[leafFirst[l] + i], nodes, primitives, spheres, numSpheres, triangles, materials);
+            }
+        }
+    }
+}
+
+RayHit trace(Ray ray, int ground, __global WideBVHNode* nodes, __global int* primitives, __global Instance* instances, __global Sphere* spheres, int numSpheres, __global Triangle* triangles, int numTriangles, int numInstances, int instanceRoot, __global Material* materials) {
+    RayHit bestHit = create_ray_hit();
+    if (ground) intersect_ground_plane(ray, &bestHit, materials);
+    if (numSpheres + numTriangles > 0)
+        traverse_primitives(ray, &bestHit, 0, nodes, primitives, spheres, numSpheres, triangles, materials);
+    if (numInstances > 0)
+        traverse_instances(ray, &bestHit, instanceRoot, nodes, primitives, instances, spheres, numSpheres, triangles, materials);
     return bestHit;
 }
 
@@ -132,34 +284,206 @@ float4 shade(__global const float4* sky, int skyWidth, int skyHeight, float4 dir
         float y = acospi(-r->direction.y);
         int row = (int)(y*skyHeight);
         int col = (int)(x*skyWidth);
-        return sky[row*skyWidth + col];
+        return sky[clamp(row*skyWidth + col, 0, skyWidth*skyHeight - 1)];
     }
 }
 
-__kernel void raytrace(__global const Ray* rays, 
-                       __global const float4* sky, 
+// column-major matrix, as laid out by Mat4
+float4 transform(float16 m, float4 v) {
+    return m.s0123 * v.x + m.s4567 * v.y + m.s89ab * v.z + m.scdef * v.w;
+}
+
+uint hash(uint x) {
+    x = (x ^ 61u) ^ (x >> 16);
+    x *= 9u;
+    x = x ^ (x >> 4);
+    x *= 0x27d4eb2du;
+    x = x ^ (x >> 15);
+    return x;
+}
+
+// uniform in [0, 1)
+float random_float(uint* state) {
+    *state = hash(*state);
+    return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// x and y are in pixels and may be fractional
+Ray generate_camera_ray(float16 cameraToWorld, float16 inverseProjection, float x, float y, int width, int height) {
+    float u = ((x / width) * 2.0f) - 1.0f;
+    float v = ((y / height) * 2.0f) - 1.0f;
+    float4 direction = transform(inverseProjection, (float4)(u, v, 0.0f, 1.0f));
+    direction = transform(cameraToWorld, (float4)(direction.xyz, 0.0f));
+    Ray ray;
+    ray.origin = transform(cameraToWorld, (float4)(0.0f, 0.0f, 0.0f, 1.0f)).xyz;
+    ray.direction = normalize(direction.xyz);
+    ray.energy = (float3)(1.0f);
+    return ray;
+}
+
+__kernel void raytrace(__global const float4* sky, 
                        __global float4* frame, 
                        __global Sphere* spheres, 
                        __global Triangle* triangles, 
                        __global Material* materials, 
+                       __global WideBVHNode* nodes, 
+                       __global int* primitives, 
+                       __global Instance* instances, 
                        int ground, 
                        float4 directionalLight, 
                        int skyWidth, 
                        int skyHeight,
                        int numSpheres, 
-                       int numTriangles)
+                       int numTriangles, 
+                       int numInstances, 
+                       int instanceRoot,
+                       float16 cameraToWorld,
+                       float16 inverseProjection,
+                       __global float4* accumulation,
+                       int sampleIndex,
+                       int imageWidth,
+                       int imageHeight,
+                       int tileX,
+                       int tileY,
+                       int firstSample)
 {
-    int gid = get_global_id(0);
+    // the range covers one tile of the image, or all of it when not tiling
+    int x = tileX + get_global_id(0);
+    int y = tileY + get_global_id(1);
+    int gid = get_global_id(1) * get_global_size(0) + get_global_id(0);
 
-    Ray r = rays[gid];
-    frame[gid] = (float4)(0.0f);
-    for (int i = 0; i < 8; i++) {
-        RayHit hit = trace(r, ground, spheres, numSpheres, triangles, numTriangles, materials);
-        frame[gid] += (float4)(r.energy, 1.0f) * shade(sky, skyWidth, skyHeight, directionalLight, &r, hit);
+    // the first sample goes through the pixel corner as before, later ones are jittered
+    float2 offset = (float2)(0.0f);
+    int sequenceIndex = firstSample + sampleIndex;
+    if (sequenceIndex > 0) {
+        uint state = hash((y * imageWidth + x) * 9781u + sequenceIndex * 6271u);
+        offset.x = random_float(&state);
+        offset.y = random_float(&state);
+    }
+    Ray r = generate_camera_ray(cameraToWorld, inverseProjection, x + offset.x, y + offset.y, imageWidth, imageHeight);
+    float4 color = (float4)(0.0f);
+    for (int i = 0; i < MAX_BOUNCES; i++) {
+        RayHit hit = trace(r, ground, nodes, primitives, instances, spheres, numSpheres, triangles, numTriangles, numInstances, instanceRoot, materials);
+        color += (float4)(r.energy, 1.0f) * shade(sky, skyWidth, skyHeight, directionalLight, &r, hit);
         if (r.energy.r == 0.0f || r.energy.g == 0.0f || r.energy.b == 0.0f) {
             break;
         }
     }
+
+    // running sum of every sample since the last reset, the frame holds its average
+    float4 sum = sampleIndex > 0 ? accumulation[gid] + color : color;
+    accumulation[gid] = sum;
+    frame[gid] = sum / (sampleIndex + 1);
+}
+
+// Wavefront pipeline. Paths live in device queues between passes: generate fills
+// the first queue, then every bounce runs extend (closest hit) and shade over the
+// live paths, and compact moves the survivors into the other queue. Each pass reads
+// the live count from the device, so work-items past it return immediately.
+typedef struct {
+    Ray ray;
+    int pixel; // -1 once the path has terminated
+} PathState;
+
+__kernel void generate(__global PathState* paths,
+                       __global float4* radiance,
+                       float16 cameraToWorld,
+                       float16 inverseProjection,
+                       int sequenceIndex)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int gid = y * get_global_size(0) + x;
+
+    float2 offset = (float2)(0.0f);
+    if (sequenceIndex > 0) {
+        uint state = hash(gid * 9781u + sequenceIndex * 6271u);
+        offset.x = random_float(&state);
+        offset.y = random_float(&state);
+    }
+    paths[gid].ray = generate_camera_ray(cameraToWorld, inverseProjection, x + offset.x, y + offset.y, get_global_size(0), get_global_size(1));
+    paths[gid].pixel = gid;
+    radiance[gid] = (float4)(0.0f);
+}
+
+__kernel void extend(__global const PathState* paths,
+                     __global const int* count,
+                     __global RayHit* hits,
+                     __global Sphere* spheres,
+                     __global Triangle* triangles,
+                     __global Material* materials,
+                     __global WideBVHNode* nodes,
+                     __global int* primitives,
+                     __global Instance* instances,
+                     int ground,
+                     int numSpheres,
+                     int numTriangles,
+                     int numInstances,
+                     int instanceRoot)
+{
+    int gid = get_global_id(0);
+    if (gid >= *count) return;
+    hits[gid] = trace(paths[gid].ray, ground, nodes, primitives, instances, spheres, numSpheres, triangles, numTriangles, numInstances, instanceRoot, materials);
+}
+
+__kernel void shade_paths(__global PathState* paths,
+                          __global const int* count,
+                          __global const RayHit* hits,
+                          __global float4* radiance,
+                          __global const float4* sky,
+                          int bounce,
+                          int skyWidth,
+                          int skyHeight,
+                          float4 directionalLight)
+{
+    int gid = get_global_id(0);
+    if (gid >= *count) return;
+    Ray r = paths[gid].ray;
+    float3 energy = r.energy;
+    float4 contribution = (float4)(energy, 1.0f) * shade(sky, skyWidth, skyHeight, directionalLight, &r, hits[gid]);
+    radiance[paths[gid].pixel] += contribution;
+    paths[gid].ray = r;
+    if (bounce + 1 == MAX_BOUNCES || r.energy.r == 0.0f || r.energy.g == 0.0f || r.energy.b == 0.0f) {
+        paths[gid].pixel = -1;
+    }
+}
+
+__kernel void compact(__global const PathState* paths,
+                      __global const int* count,
+                      __global PathState* survivors,
+                      __global int* survivorCount)
+{
+    int gid = get_global_id(0);
+    if (gid >= *count || paths[gid].pixel < 0) return;
+    survivors[atomic_inc(survivorCount)] = paths[gid];
+}
+
+__kernel void accumulate(__global const float4* radiance,
+                         __global float4* accumulation,
+                         __global float4* frame,
+                         int sampleIndex)
+{
+    int gid = get_global_id(0);
+    float4 sum = sampleIndex > 0 ? accumulation[gid] + radiance[gid] : radiance[gid];
+    accumulation[gid] = sum;
+    frame[gid] = sum / (sampleIndex + 1);
+}
+
+// filmic curve fitted to the ACES reference transform
+float3 tonemap_aces(float3 x) {
+    return clamp((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f, 1.0f);
+}
+
+float3 linear_to_srgb(float3 c) {
+    float3 low = c * 12.92f;
+    float3 high = 1.055f * pow(c, (float3)(1.0f / 2.4f)) - 0.055f;
+    return select(high, low, c <= 0.0031308f);
+}
+
+__kernel void tonemap(__global const float4* frame, __global uchar4* output, float exposure) {
+    int gid = get_global_id(0);
+    float3 color = linear_to_srgb(tonemap_aces(frame[gid].xyz * exp2(exposure)));
+    output[gid] = convert_uchar4_sat_rte((float4)(color * 255.0f, 255.0f));
 }
 )cl";
 
@@ -186,101 +510,1007 @@ struct OpenCLMaterial {
     Vec4 albedo;
 };
 
+struct OpenCLInstance {
+    Vec4 worldToObject[3];
+    int root;
+    int pad1;
+    int pad2;
+    int pad3;
+};
+
+// trees are rebuilt instead of refit once refitting has made them this much more expensive
+static const float RebuildCostRatio = 1.5f;
+
+// Host copies of everything uploaded for the scene, kept so that UpdateScene can
+// refit the trees and rewrite only the parts that changed.
+struct OpenCLPathTracer::SceneData {
+    std::vector<OpenCLSphere> spheres;
+    std::vector<OpenCLTriangle> triangles; // loose triangles, then those of every mesh
+    std::vector<OpenCLMaterial> materials;
+    std::vector<WideBVHNode> nodes;        // world tree, then every mesh tree, then the instance tree
+    std::vector<int> primitives;
+    std::vector<OpenCLInstance> instances; // in instance tree leaf order
+    // binary trees are kept for refitting, their wide versions are uploaded
+    std::vector<AABB> worldBounds;         // of the spheres, then the loose triangles
+    BVH worldBVH;
+    std::vector<BVH> meshBVHs;
+    BVH instanceBVH;
+    WideBVH worldWideBVH;
+    std::vector<WideBVH> meshWideBVHs;
+    WideBVH instanceWideBVH;
+    int looseTriangles;
+    std::vector<int> meshTriangleOffsets;
+    std::vector<int> meshNodeOffsets;
+    std::vector<int> meshPrimitiveOffsets;
+    int instanceNodeOffset;
+    std::vector<int> instanceMeshes;       // mesh of every scene instance
+    std::vector<int> placed;               // scene instances of non-empty meshes
+    std::vector<Mat4> transforms;          // of the placed instances
+};
+
+static OpenCLSphere ToOpenCLSphere(const Sphere& s) {
+    OpenCLSphere sphere = OpenCLSphere();
+    sphere.center = Vec4(s.center.x, s.center.y, s.center.z, 0.0f);
+    sphere.radius = s.radius;
+    sphere.materialIndex = s.materialIndex;
+    return sphere;
+}
+
+static OpenCLTriangle ToOpenCLTriangle(const Triangle& t) {
+    OpenCLTriangle triangle = OpenCLTriangle();
+    triangle.a = Vec4(t.a.x ,t.a.y ,t.a.z , 0.0f);
+    triangle.b = Vec4(t.b.x ,t.b.y ,t.b.z , 0.0f);
+    triangle.c = Vec4(t.c.x ,t.c.y ,t.c.z , 0.0f);
+    triangle.materialIndex = t.materialIndex;
+    return triangle;
+}
+
+static OpenCLMaterial ToOpenCLMaterial(const Material& m) {
+    OpenCLMaterial material;
+    material.specular = Vec4(m.specular.x, m.specular.y, m.specular.z, 0.0f);
+    material.albedo = Vec4(m.albedo.x, m.albedo.y, m.albedo.z, 0.0f);
+    return material;
+}
+
+// Writes a tree into the shared node array starting at nodeOffset. Interior child
+// links are offset by nodeOffset, leaf ranges by primitiveOffset.
+static void WriteNodes(std::vector<WideBVHNode>& nodeData, int nodeOffset, WideBVH& bvh, int primitiveOffset) {
+    const std::vector<WideBVHNode>& nodes = bvh.GetNodes();
+    for (int i = 0; i < nodes.size(); i++) {
+        WideBVHNode& node = nodeData[nodeOffset + i];
+        node = nodes[i];
+        for (int c = 0; c < node.childCount; c++) {
+            node.child[c] += node.count[c] > 0 ? primitiveOffset : nodeOffset;
+        }
+    }
+}
+
+// appends a tree to the shared node array and returns the index of its root
+static int AppendNodes(std::vector<WideBVHNode>& nodeData, WideBVH& bvh, int primitiveOffset) {
+    int nodeOffset = nodeData.size();
+    nodeData.resize(nodeOffset + bvh.GetNodes().size());
+    WriteNodes(nodeData, nodeOffset, bvh, primitiveOffset);
+    return nodeOffset;
+}
+
+static std::vector<AABB> WorldBounds(const Scene& scene) {
+    // spheres come first in the primitive numbering, triangles follow
+    const std::vector<Sphere>& spheres = scene.GetSpheres();
+    const std::vector<Triangle>& triangles = scene.GetTriangles();
+    std::vector<AABB> bounds;
+    bounds.reserve(spheres.size() + triangles.size());
+    for (int i = 0; i < spheres.size(); i++) {
+        bounds.push_back(Bounds::Of(spheres[i]));
+    }
+    for (int i = 0; i < triangles.size(); i++) {
+        bounds.push_back(Bounds::Of(triangles[i]));
+    }
+    return bounds;
+}
+
+static std::vector<AABB> MeshBounds(const Mesh& mesh) {
+    std::vector<AABB> bounds(mesh.triangles.size());
+    for (int i = 0; i < mesh.triangles.size(); i++) {
+        bounds[i] = Bounds::Of(mesh.triangles[i]);
+    }
+    return bounds;
+}
+
+static void ConvertScene(const Scene& scene, std::vector<OpenCLSphere>& sphereData, std::vector<OpenCLTriangle>& triangleData, std::vector<OpenCLMaterial>& materialData) {
+    const std::vector<Sphere>& spheres = scene.GetSpheres();
+    sphereData.resize(spheres.size());
+    for (int i = 0; i < spheres.size(); i++) {
+        sphereData[i] = ToOpenCLSphere(spheres[i]);
+    }
+
+    // loose triangles come first, the triangles of every mesh follow
+    const std::vector<Triangle>& triangles = scene.GetTriangles();
+    const std::vector<Mesh>& meshes = scene.GetMeshes();
+    triangleData.clear();
+    for (int i = 0; i < triangles.size(); i++) {
+        triangleData.push_back(ToOpenCLTriangle(triangles[i]));
+    }
+    for (int m = 0; m < meshes.size(); m++) {
+        for (int i = 0; i < meshes[m].triangles.size(); i++) {
+            triangleData.push_back(ToOpenCLTriangle(meshes[m].triangles[i]));
+        }
+    }
+
+    const std::vector<Material>& materials = scene.GetMaterials();
+    materialData.resize(materials.size());
+    for (int i = 0; i < materials.size(); i++) {
+        materialData[i] = ToOpenCLMaterial(materials[i]);
+    }
+}
+
+template<typename T>
+static void WriteRange(cl::CommandQueue& queue, cl::Buffer& buffer, const std::vector<T>& data, int first, int count) {
+    if (count > 0) {
+        queue.enqueueWriteBuffer(buffer, CL_TRUE, first * sizeof(T), count * sizeof(T), &data[first]);
+    }
+}
+
+// Owns the buffers of one device for the lifetime of the path tracer. A buffer is only
+// reallocated when a request no longer fits, so frames and reloads of a scene of
+// similar size reuse what is already there.
+class OpenCLPathTracer::DeviceMemory {
+    public:
+        struct Allocation {
+            cl::Buffer* buffer = nullptr;
+            std::size_t capacity = 0;
+        };
+
+        DeviceMemory(cl::Context& context) : context(context) {}
+
+        ~DeviceMemory() {
+            Allocation* all[] = { &sky, &frames[0], &frames[1], &packedFrames[0], &packedFrames[1], &accumulation,
+                                  &tileFrame, &tileAccumulation,
+                                  &paths[0], &paths[1], &pathCounts[0], &pathCounts[1], &hits, &radiance,
+                                  &spheres, &triangles, &materials, &nodes, &primitives, &instances };
+            for (int i = 0; i < 20; i++) {
+                delete all[i]->buffer;
+            }
+        }
+
+        cl::Buffer& Reserve(Allocation& allocation, std::size_t bytes) {
+            if (allocation.buffer && bytes <= allocation.capacity) {
+                stats.reuses++;
+                return *allocation.buffer;
+            }
+            // scene data grows with headroom so that small edits do not reallocate every time
+            std::size_t capacity = std::max(bytes, allocation.capacity + allocation.capacity / 2);
+            delete allocation.buffer;
+            stats.allocatedBytes -= allocation.capacity;
+            allocation.buffer = new cl::Buffer(context, CL_MEM_READ_WRITE, capacity);
+            allocation.capacity = capacity;
+            stats.allocatedBytes += capacity;
+            stats.allocations++;
+            return *allocation.buffer;
+        }
+
+        // OpenCL does not allow zero-sized buffers, so empty data still reserves one element
+        template<typename T>
+        cl::Buffer& Upload(cl::CommandQueue& queue, Allocation& allocation, const std::vector<T>& data) {
+            cl::Buffer& buffer = Reserve(allocation, sizeof(T) * std::max<std::size_t>(1, data.size()));
+            WriteRange(queue, buffer, data, 0, data.size());
+            return buffer;
+        }
+
+        Allocation sky;
+        Allocation frames[FramesInFlight];
+        Allocation packedFrames[FramesInFlight];
+        Allocation accumulation;
+        // tiles run in order on a device's queue, so one tile's worth is enough
+        Allocation tileFrame;
+        Allocation tileAccumulation;
+        Allocation paths[2];
+        Allocation pathCounts[2];
+        Allocation hits;
+        Allocation radiance;
+        Allocation spheres;
+        Allocation triangles;
+        Allocation materials;
+        Allocation nodes;
+        Allocation primitives;
+        Allocation instances;
+        DeviceMemoryStats stats;
+    private:
+        cl::Context& context;
+};
+
+// Kernels of the wavefront pipeline. Buffers go through the functors, scene and
+// lighting scalars are set once with setArg like for raytrace.
+struct OpenCLPathTracer::WavefrontKernels {
+    // sizes of the device-only PathState and RayHit structs, float3 members take 16 bytes
+    static const std::size_t PathStateSize = 64;
+    static const std::size_t RayHitSize = 80;
+
+    WavefrontKernels(cl::Program& program) :
+        generate(program, "generate"),
+        extend(program, "extend"),
+        shade(program, "shade_paths"),
+        compact(program, "compact"),
+        accumulate(program, "accumulate") {}
+
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, Mat4, Mat4, int> generate;
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> extend;
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int> shade;
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> compact;
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, int> accumulate;
+};
+
+// Host copy of one frame. Every device reads its band of rows back into it, and
+// the events of each device's kernel and readback are kept per device. Only the
+// buffer for the format the frame was rendered in is filled.
+struct OpenCLPathTracer::FrameSlot {
+    std::vector<float> pixels;
+    std::vector<unsigned char> packedPixels;
+    PixelFormat format;
+    std::vector<int> rows;
+    std::vector<cl::Event> rendered;
+    std::vector<cl::Event> ready;
+};
+
+// One device with its own queues and its own copy of the scene. Kernels are timed
+// with profiling events so that rows can be split by measured throughput.
+struct OpenCLPathTracer::RenderDevice {
+    RenderDevice(cl::Context& context, const cl::Device& device) :
+        device(device),
+        queue(context, device, CL_QUEUE_PROFILING_ENABLE),
+        transferQueue(context, device),
+        memory(context) {}
+
+    cl::Device device;
+    cl::CommandQueue queue;         // kernels and scene uploads
+    cl::CommandQueue transferQueue; // frame readback
+    DeviceMemory memory;
+    // rows of the interactive frame rendered on this device
+    int firstRow = 0;
+    int rowCount = 0;
+    double rowsPerSecond = 0.0; // 0 until the first frame was timed
+    // host staging area for each tile in flight, so readbacks never wait on copying
+    std::vector<float> staging[TilesInFlight];
+};
+
+// FNV-1a, only used to name cache entries
+static uint64_t HashString(const std::string& text, uint64_t hash = 14695981039346656037ull) {
+    for (std::size_t i = 0; i < text.size(); i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// MAGPIE_CACHE_DIR wins, otherwise the per-user cache directory. Empty disables caching.
+static std::string ProgramCacheDirectory() {
+    const char* dir = std::getenv("MAGPIE_CACHE_DIR");
+    if (dir) return dir;
+    dir = std::getenv("XDG_CACHE_HOME");
+    if (dir) return std::string(dir) + "/magpie";
+    dir = std::getenv("HOME");
+    if (dir) return std::string(dir) + "/.cache/magpie";
+    dir = std::getenv("LOCALAPPDATA");
+    if (dir) return std::string(dir) + "/magpie";
+    return "";
+}
+
+static void MakeDirectories(const std::string& path) {
+    for (std::size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+#ifdef _WIN32
+            _mkdir(path.substr(0, i).c_str());
+#else
+            mkdir(path.substr(0, i).c_str(), 0755);
+#endif
+        }
+    }
+}
+
+// The key covers everything that can invalidate a binary: the source, the build
+// options and the name and driver version of every device it was built for.
+static std::string ProgramCacheKey(const std::vector<cl::Device>& devices, const std::string& options) {
+    uint64_t hash = HashString(kernelSource);
+    hash = HashString(options, hash);
+    for (int i = 0; i < devices.size(); i++) {
+        hash = HashString(devices[i].getInfo<CL_DEVICE_NAME>(), hash);
+        hash = HashString(devices[i].getInfo<CL_DRIVER_VERSION>(), hash);
+    }
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return key;
+}
+
+// One file per device, named after the key and the device's position in the context.
+static std::string ProgramCachePath(const std::string& directory, const std::string& key, int device) {
+    return directory + "/" + key + "-" + std::to_string(device) + ".bin";
+}
+
+static bool LoadProgramBinaries(const std::string& directory, const std::string& key, int deviceCount, cl::Program::Binaries& binaries) {
+    for (int i = 0; i < deviceCount; i++) {
+        std::ifstream file(ProgramCachePath(directory, key, i), std::ios::binary);
+        if (!file) return false;
+        binaries.push_back(std::vector<unsigned char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()));
+        if (binaries.back().empty()) return false;
+    }
+    return true;
+}
+
+static void StoreProgramBinaries(const std::string& directory, const std::string& key, const cl::Program::Binaries& binaries) {
+    MakeDirectories(directory);
+#ifdef _WIN32
+    int process = _getpid();
+#else
+    int process = getpid();
+#endif
+    for (int i = 0; i < binaries.size(); i++) {
+        // Written under a temporary name so a concurrent start never reads half a
+        // file, one per process so two starts never write into the same one.
+        std::string path = ProgramCachePath(directory, key, i);
+        std::string temporary = path + "." + std::to_string(process) + ".tmp";
+        bool written;
+        {
+            std::ofstream file(temporary, std::ios::binary);
+            file.write((const char*)binaries[i].data(), binaries[i].size());
+            written = file.good();
+        }
+        if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            // on Windows an entry another process stored first makes rename fail
+            std::remove(temporary.c_str());
+        }
+    }
+}
+
+// Builds the kernels, loading a cached binary when one matches and caching the
+// result of a source build otherwise. A stale or rejected binary falls back to source.
+static cl::Program BuildProgram(cl::Context& context, const std::string& options) {
+    std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+    std::string directory = ProgramCacheDirectory();
+    std::string key = ProgramCacheKey(devices, options);
+
+    cl::Program::Binaries binaries;
+    if (!directory.empty() && LoadProgramBinaries(directory, key, devices.size(), binaries)) {
+        try {
+            cl::Program program(context, devices, binaries);
+            program.build(devices, options.c_str());
+            return program;
+        } catch (cl::Error&) {
+            // fall through to a source build, which replaces the cache entry
+        }
+    }
+
+    cl::Program program(context, kernelSource);
+    program.build(devices, options.c_str());
+    if (!directory.empty()) {
+        StoreProgramBinaries(directory, key, program.getInfo<CL_PROGRAM_BINARIES>());
+    }
+    return program;
+}
+
 OpenCLPathTracer::~OpenCLPathTracer() {
-    delete materialBuffer;
-    delete triangleBuffer;
-    delete sphereBuffer;
-    delete deviceFrame;
-    delete skyBuffer;
+    while (pendingFrames > 0) {
+        WaitForOldestFrame();
+    }
+    delete[] frameSlots;
+    delete sceneData;
+    delete threadPool;
+    for (int d = 0; d < devices.size(); d++) {
+        delete devices[d];
+    }
+    delete wavefront;
+    delete tonemap;
     delete raytrace;
-    delete queue;
     delete context;
 }
 
 void OpenCLPathTracer::Initialize(){
-    frame = std::vector<float>(width*height*4);
-    context = new cl::Context(CL_DEVICE_TYPE_DEFAULT);
-    queue = new cl::CommandQueue(*context);
-    cl::Program program(*context, kernelSource , true);
-    raytrace = new cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>(program, "raytrace");
-    deviceFrame = new cl::Buffer(*context, CL_MEM_READ_WRITE, sizeof(float) * width*height*4);
+    threadPool = new ThreadPool();
+    std::vector<cl::Device> selected;
+    if (multiDevice) {
+        // a context can only span one platform, so take every device of the default one
+        cl::Platform::getDefault().getDevices(CL_DEVICE_TYPE_ALL, &selected);
+        context = new cl::Context(selected);
+    } else {
+        context = new cl::Context(CL_DEVICE_TYPE_DEFAULT);
+        selected = context->getInfo<CL_CONTEXT_DEVICES>();
+    }
+    for (int d = 0; d < selected.size(); d++) {
+        devices.push_back(new RenderDevice(*context, selected[d]));
+    }
+    frameSlots = new FrameSlot[FramesInFlight];
+    // a wide node pushes at most Width - 1 more entries than it pops
+    int stackSize = (WideBVH::Width - 1) * BVH::MaxDepth + 1;
+    std::string options = "-D BVH_STACK_SIZE=" + std::to_string(stackSize) + " -D MAX_BOUNCES=" + std::to_string(MaxBounces);
+    cl::Program program = BuildProgram(*context, options);
+    raytrace = new cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>(program, "raytrace");
+    tonemap = new cl::KernelFunctor<cl::Buffer, cl::Buffer, float>(program, "tonemap");
+    wavefront = new WavefrontKernels(program);
 }
 
 void OpenCLPathTracer::SetSky(std::string filename){
-    int skyWidth, skyHeight, nrChannels;
-    stbi_set_flip_vertically_on_load(true);
-    unsigned char *data = stbi_load(filename.c_str(), &skyWidth, &skyHeight, &nrChannels, 0);
-    std::vector<Vec4> skyData(skyHeight*skyWidth);
-    for (int i = 0; i < (skyWidth*skyHeight); i++) {
-        int pos = i*nrChannels;
-        skyData[i] = Vec4(*(data+pos)/255.0f, *(data+pos+1)/255.0f, *(data+pos+2)/255.0f, 1.0f);
+    SetSky(LoadTexture(filename));
+}
+
+void OpenCLPathTracer::SetSky(const Texture& texture){
+    raytrace->getKernel().setArg(10, texture.width);
+    raytrace->getKernel().setArg(11, texture.height);
+    wavefront->shade.getKernel().setArg(6, texture.width);
+    wavefront->shade.getKernel().setArg(7, texture.height);
+    for (int d = 0; d < devices.size(); d++) {
+        devices[d]->memory.Upload(devices[d]->queue, devices[d]->memory.sky, texture.pixels);
     }
-    raytrace->getKernel().setArg(8, skyWidth);
-    raytrace->getKernel().setArg(9, skyHeight);
-    skyBuffer = new cl::Buffer(*context, skyData.begin(), skyData.end(), true);
-    stbi_image_free(data);
+    sampleCount = 0;
 }
 
 void OpenCLPathTracer::LoadScene(Scene scene){
-    if (!scene.skyFilename.empty()) {
+    if (!scene.sky.pixels.empty()) {
+        SetSky(scene.sky);
+    } else if (!scene.skyFilename.empty()) {
         SetSky(scene.skyFilename);
+    } else {
+        // no sky is black, as on the CPU, but the kernels still need a texture to read
+        Texture black;
+        black.width = black.height = 1;
+        black.pixels.assign(1, Vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        SetSky(black);
     }
+    SetLightingArgs(scene);
+    sampleCount = 0;
 
-    raytrace->getKernel().setArg(6, scene.ground);
-    raytrace->getKernel().setArg(7, Vec4(scene.directionalLight.direction.x, 
-                                         scene.directionalLight.direction.y, 
-                                         scene.directionalLight.direction.z, 
-                                         scene.directionalLight.intensity));
+    delete sceneData;
+    sceneData = new SceneData();
+    SceneData& data = *sceneData;
+    ConvertScene(scene, data.spheres, data.triangles, data.materials);
+
+    const std::vector<Mesh>& meshes = scene.GetMeshes();
+    data.looseTriangles = scene.GetTriangles().size();
+    if (!scene.HasBVHs()) {
+        scene.BuildBVHs(threadPool);
+    }
+    data.worldBounds = WorldBounds(scene);
+    data.worldBVH = scene.GetWorldBVH();
+    data.worldWideBVH.Build(data.worldBVH);
+    data.meshBVHs.resize(meshes.size());
+    data.meshWideBVHs.resize(meshes.size());
+    data.meshTriangleOffsets.resize(meshes.size());
+    int triangleOffset = data.looseTriangles;
+    for (int m = 0; m < meshes.size(); m++) {
+        data.meshTriangleOffsets[m] = triangleOffset;
+        triangleOffset += meshes[m].triangles.size();
+        data.meshBVHs[m] = scene.GetMeshBVHs()[m];
+        data.meshWideBVHs[m].Build(data.meshBVHs[m]);
+    }
+
+    const std::vector<Instance>& instances = scene.GetInstances();
+    for (int i = 0; i < instances.size(); i++) {
+        data.instanceMeshes.push_back(instances[i].meshIndex);
+        if (meshes[instances[i].meshIndex].triangles.empty()) continue;
+        data.placed.push_back(i);
+        data.transforms.push_back(instances[i].transform);
+    }
+    data.instanceBVH.Build(InstanceBounds(), threadPool);
+    data.instanceWideBVH.Build(data.instanceBVH);
+
+    AssembleSceneData();
+    UploadSceneData();
+}
+
+void OpenCLPathTracer::UpdateScene(const Scene& scene){
+    if (!sceneData || !SameTopology(scene)) {
+        LoadScene(scene);
+        return;
+    }
+    sampleCount = 0;
+    SetLightingArgs(scene);
 
+    // Only what the scene recorded as moved can differ, everything else changes the
+    // topology and was reloaded above. Refit the trees of whatever moved, falling
+    // back to a rebuild once a tree has degraded too far.
+    SceneData& data = *sceneData;
     const std::vector<Sphere>& spheres = scene.GetSpheres();
-    raytrace->getKernel().setArg(10, spheres.size());
-    std::vector<OpenCLSphere> sphereData(spheres.size());
-    for (int i = 0; i < spheres.size(); i++) {
-        Sphere s = spheres[i];
-        sphereData[i].center = Vec4(s.center.x, s.center.y, s.center.z, 0.0f);
-        sphereData[i].radius = s.radius;
-        sphereData[i].materialIndex = s.materialIndex;
+    const std::vector<int>& movedSpheres = scene.GetMovedSpheres();
+    int firstSphere = spheres.size(), lastSphere = -1;
+    for (int i = 0; i < movedSpheres.size(); i++) {
+        int sphere = movedSpheres[i];
+        data.spheres[sphere] = ToOpenCLSphere(spheres[sphere]);
+        data.worldBounds[sphere] = Bounds::Of(spheres[sphere]);
+        firstSphere = std::min(firstSphere, sphere);
+        lastSphere = std::max(lastSphere, sphere);
     }
-    sphereBuffer = new cl::Buffer(*context, sphereData.begin(), sphereData.end() , true);
-    
-    const std::vector<Triangle>& triangles = scene.GetTriangles();
-    std::vector<OpenCLTriangle> triangleData(triangles.size());
-    for (int i = 0; i < triangles.size(); i++) {
-        Triangle t = triangles[i];
-        triangleData[i].a = Vec4(t.a.x ,t.a.y ,t.a.z , 0.0f);
-        triangleData[i].b = Vec4(t.b.x ,t.b.y ,t.b.z , 0.0f);
-        triangleData[i].c = Vec4(t.c.x ,t.c.y ,t.c.z , 0.0f);
-        triangleData[i].materialIndex = t.materialIndex;
+    bool rebuilt = false;
+    bool worldChanged = lastSphere >= 0;
+    if (worldChanged) {
+        rebuilt |= RefitOrRebuild(data.worldBVH, data.worldWideBVH, data.worldBounds);
+    }
+    const std::vector<Instance>& instances = scene.GetInstances();
+    const std::vector<int>& movedInstances = scene.GetMovedInstances();
+    bool instancesChanged = false;
+    for (int i = 0; i < movedInstances.size(); i++) {
+        // instances of empty meshes are not placed
+        std::vector<int>::iterator placed = std::lower_bound(data.placed.begin(), data.placed.end(), movedInstances[i]);
+        if (placed == data.placed.end() || *placed != movedInstances[i]) continue;
+        data.transforms[placed - data.placed.begin()] = instances[movedInstances[i]].transform;
+        instancesChanged = true;
+    }
+    if (instancesChanged) {
+        rebuilt |= RefitOrRebuild(data.instanceBVH, data.instanceWideBVH, InstanceBounds());
+    }
+    if (rebuilt) {
+        AssembleSceneData();
+        UploadSceneData();
+        return;
     }
-    raytrace->getKernel().setArg(11, triangleData.size());
-    triangleBuffer = new cl::Buffer(*context, triangleData.begin(), triangleData.end() , true);
 
-    const std::vector<Material>& materials = scene.GetMaterials();
-    std::vector<OpenCLMaterial> materialData(materials.size());
-    for (int i = 0; i < materials.size(); i++) {
-        Material m = materials[i];
-        materialData[i].specular = Vec4(m.specular.x, m.specular.y, m.specular.z, 0.0f);
-        materialData[i].albedo = Vec4(m.albedo.x, m.albedo.y, m.albedo.z, 0.0f);
+    // the topology is unchanged, so only the moved ranges are rewritten in place
+    if (worldChanged) {
+        WriteNodes(data.nodes, 0, data.worldWideBVH, 0);
+    }
+    if (instancesChanged) {
+        WriteNodes(data.nodes, data.instanceNodeOffset, data.instanceWideBVH, 0);
+        WriteInstances();
+    }
+    // every device holds its own copy of the scene
+    for (int d = 0; d < devices.size(); d++) {
+        cl::CommandQueue& queue = devices[d]->queue;
+        DeviceMemory& memory = devices[d]->memory;
+        if (worldChanged) {
+            WriteRange(queue, *memory.spheres.buffer, data.spheres, firstSphere, lastSphere - firstSphere + 1);
+            WriteRange(queue, *memory.nodes.buffer, data.nodes, 0, data.worldWideBVH.GetNodes().size());
+        }
+        if (instancesChanged) {
+            WriteRange(queue, *memory.nodes.buffer, data.nodes, data.instanceNodeOffset, data.instanceWideBVH.GetNodes().size());
+            WriteRange(queue, *memory.instances.buffer, data.instances, 0, data.instances.size());
+        }
+    }
+}
+
+void OpenCLPathTracer::SetLightingArgs(const Scene& scene){
+    Vec4 directionalLight(scene.directionalLight.direction.x, 
+                          scene.directionalLight.direction.y, 
+                          scene.directionalLight.direction.z, 
+                          scene.directionalLight.intensity);
+    raytrace->getKernel().setArg(8, (int)scene.ground);
+    raytrace->getKernel().setArg(9, directionalLight);
+    wavefront->extend.getKernel().setArg(9, (int)scene.ground);
+    wavefront->shade.getKernel().setArg(8, directionalLight);
+}
+
+bool OpenCLPathTracer::SameTopology(const Scene& scene){
+    SceneData& data = *sceneData;
+    const std::vector<Mesh>& meshes = scene.GetMeshes();
+    const std::vector<Instance>& instances = scene.GetInstances();
+    if (scene.GetSpheres().size() != data.spheres.size() ||
+        scene.GetTriangles().size() != data.looseTriangles ||
+        scene.GetMaterials().size() != data.materials.size() ||
+        meshes.size() != data.meshBVHs.size() ||
+        instances.size() != data.instanceMeshes.size()) {
+        return false;
     }
-    materialBuffer = new cl::Buffer(*context, materialData.begin(), materialData.end(), true);
+    for (int m = 0; m < meshes.size(); m++) {
+        int end = m + 1 < meshes.size() ? data.meshTriangleOffsets[m + 1] : data.triangles.size();
+        if (meshes[m].triangles.size() != end - data.meshTriangleOffsets[m]) return false;
+    }
+    for (int i = 0; i < instances.size(); i++) {
+        if (instances[i].meshIndex != data.instanceMeshes[i]) return false;
+    }
+    return true;
+}
+
+std::vector<AABB> OpenCLPathTracer::InstanceBounds(){
+    SceneData& data = *sceneData;
+    std::vector<AABB> bounds(data.placed.size());
+    for (int i = 0; i < data.placed.size(); i++) {
+        BVH& meshBVH = data.meshBVHs[data.instanceMeshes[data.placed[i]]];
+        bounds[i] = Bounds::Transform(meshBVH.GetNodes()[0].bounds, data.transforms[i]);
+    }
+    return bounds;
+}
+
+bool OpenCLPathTracer::RefitOrRebuild(BVH& bvh, WideBVH& wideBVH, const std::vector<AABB>& bounds){
+    bvh.Refit(bounds, threadPool);
+    if (bvh.GetCostRatio() > RebuildCostRatio) {
+        bvh.Build(bounds, threadPool);
+        wideBVH.Build(bvh);
+        return true;
+    }
+    wideBVH.Refit(bvh);
+    return false;
+}
+
+void OpenCLPathTracer::AssembleSceneData(){
+    SceneData& data = *sceneData;
+    data.nodes.clear();
+    data.primitives = data.worldBVH.GetPrimitiveIndices();
+    AppendNodes(data.nodes, data.worldWideBVH, 0);
+
+    // every mesh gets its own bottom-level tree in the shared node and primitive arrays
+    data.meshNodeOffsets.resize(data.meshBVHs.size());
+    data.meshPrimitiveOffsets.resize(data.meshBVHs.size());
+    for (int m = 0; m < data.meshBVHs.size(); m++) {
+        data.meshPrimitiveOffsets[m] = data.primitives.size();
+        data.meshNodeOffsets[m] = AppendNodes(data.nodes, data.meshWideBVHs[m], data.primitives.size());
+        const std::vector<int>& indices = data.meshBVHs[m].GetPrimitiveIndices();
+        for (int i = 0; i < indices.size(); i++) {
+            data.primitives.push_back(data.spheres.size() + data.meshTriangleOffsets[m] + indices[i]);
+        }
+    }
+
+    // the top-level tree over the world bounds of every placed instance comes last
+    data.instanceNodeOffset = AppendNodes(data.nodes, data.instanceWideBVH, 0);
+    WriteInstances();
+}
+
+void OpenCLPathTracer::WriteInstances(){
+    // instances are stored in leaf order so top-level leaves index them directly
+    SceneData& data = *sceneData;
+    const std::vector<int>& order = data.instanceBVH.GetPrimitiveIndices();
+    data.instances.resize(data.placed.size());
+    for (int i = 0; i < data.placed.size(); i++) {
+        OpenCLInstance& instance = data.instances[i];
+        Mat4 worldToObject = Matrix::Inverse(data.transforms[order[i]]);
+        for (int row = 0; row < 3; row++) {
+            instance.worldToObject[row] = Vec4(worldToObject[0][row], worldToObject[1][row], worldToObject[2][row], worldToObject[3][row]);
+        }
+        instance.root = data.meshNodeOffsets[data.instanceMeshes[data.placed[order[i]]]];
+        instance.pad1 = 0;
+        instance.pad2 = 0;
+        instance.pad3 = 0;
+    }
+}
+
+void OpenCLPathTracer::UploadSceneData(){
+    SceneData& data = *sceneData;
+    for (int d = 0; d < devices.size(); d++) {
+        cl::CommandQueue& queue = devices[d]->queue;
+        DeviceMemory& memory = devices[d]->memory;
+        memory.Upload(queue, memory.spheres, data.spheres);
+        memory.Upload(queue, memory.triangles, data.triangles);
+        memory.Upload(queue, memory.materials, data.materials);
+        memory.Upload(queue, memory.nodes, data.nodes);
+        memory.Upload(queue, memory.primitives, data.primitives);
+        memory.Upload(queue, memory.instances, data.instances);
+    }
+    raytrace->getKernel().setArg(12, (int)data.spheres.size());
+    raytrace->getKernel().setArg(13, data.looseTriangles);
+    raytrace->getKernel().setArg(14, (int)data.instances.size());
+    raytrace->getKernel().setArg(15, data.instanceNodeOffset);
+    wavefront->extend.getKernel().setArg(10, (int)data.spheres.size());
+    wavefront->extend.getKernel().setArg(11, data.looseTriangles);
+    wavefront->extend.getKernel().setArg(12, (int)data.instances.size());
+    wavefront->extend.getKernel().setArg(13, data.instanceNodeOffset);
 }
 
 void OpenCLPathTracer::Render(){
-    // in OpenCL, 3-component vector data types are aligned to a 4 * sizeof(component) boundary
-    std::vector<Vec4> rays(width*height*3);
-    Mat4 cameraToWorld = Matrix::Inverse(view);
-    Mat4 inverseProjection = Matrix::Inverse(projection);
-    for (int i = 0; i < (width*height*3)-2; i += 3) {
-        rays[i] = cameraToWorld * Vec4(0.0f, 0.0f, 0.0f, 1.0f);
-        float u = (((float)((i/3)%width)/width) * 2.0f) - 1.0f;
-        float v = (((float)(i/(3*width))/height) * 2.0f) - 1.0f;
-        Vec4 direction = inverseProjection * Vec4(u, v, 0.0f, 1.0f);
-        direction = cameraToWorld * Vec4(direction.x, direction.y, direction.z, 0.0f);
-        rays[i+1] = Vector::Normalize(direction);
-        rays[i+2] = Vec4(1.0f, 1.0f, 1.0f, 0.0f);
-    }
-    cl::Buffer rayBuffer(*context, rays.begin(), rays.end(), true);
-    (*raytrace)(cl::EnqueueArgs(*queue, cl::NDRange(width*height)), rayBuffer, *skyBuffer, *deviceFrame, *sphereBuffer, *triangleBuffer, *materialBuffer);
-    cl::copy(*queue, *deviceFrame, frame.begin(), frame.end());
-    pixels = (float*)frame.data();
+    BeginFrame();
+    while (pendingFrames > 0) {
+        WaitForOldestFrame();
+    }
+}
+
+void OpenCLPathTracer::BeginFrame(){
+    // a slot is only reused once the frame it held has been handed out
+    if (pendingFrames == FramesInFlight) {
+        WaitForOldestFrame();
+    }
+    // both formats hold four channels per pixel
+    std::size_t frameSize = width*height*4;
+    bool packed = pixelFormat == PixelFormat::RGBA8;
+    std::size_t hostSize = packed ? frameSlots[nextSlot].packedPixels.size() : frameSlots[nextSlot].pixels.size();
+    if (hostSize != frameSize) {
+        // resizing must not race with readbacks into the old host memory
+        while (pendingFrames > 0) {
+            WaitForOldestFrame();
+        }
+        for (int i = 0; i < FramesInFlight; i++) {
+            if (packed) frameSlots[i].packedPixels.resize(frameSize);
+            else frameSlots[i].pixels.resize(frameSize);
+        }
+        pixels = nullptr;
+        packedPixels = nullptr;
+    }
+    FrameSlot& slot = frameSlots[nextSlot];
+    slot.format = pixelFormat;
+    slot.rows.assign(devices.size(), 0);
+    slot.rendered.assign(devices.size(), cl::Event());
+    slot.ready.assign(devices.size(), cl::Event());
+
+    // every device accumulates its own rows, so the split only moves on a reset
+    if (sampleCount == 0) {
+        BalanceRows();
+    }
+
+    // primary rays are generated on the device, only the camera matrices are uploaded
+    raytrace->getKernel().setArg(16, Matrix::Inverse(view));
+    raytrace->getKernel().setArg(17, Matrix::Inverse(projection));
+    for (int d = 0; d < devices.size(); d++) {
+        RenderDevice& device = *devices[d];
+        if (device.rowCount == 0) continue;
+        std::size_t bandSize = width*device.rowCount*4;
+        std::size_t bandOffset = width*device.firstRow*4;
+
+        // band buffers only grow when the dimensions or the split change
+        DeviceMemory& m = device.memory;
+        cl::Buffer& deviceFrame = m.Reserve(m.frames[nextSlot], sizeof(float) * bandSize);
+        cl::Buffer& accumulation = m.Reserve(m.accumulation, sizeof(float) * bandSize);
+        cl::Event rendered;
+        if (useWavefront) {
+            rendered = RenderWavefront(device, deviceFrame, accumulation);
+        } else {
+            raytrace->getKernel().setArg(18, accumulation);
+            raytrace->getKernel().setArg(19, (int)sampleCount);
+            SetRegionArgs(0, device.firstRow);
+            rendered = (*raytrace)(cl::EnqueueArgs(device.queue, cl::NDRange(width, device.rowCount)), *m.sky.buffer, deviceFrame, *m.spheres.buffer, *m.triangles.buffer, *m.materials.buffer, *m.nodes.buffer, *m.primitives.buffer, *m.instances.buffer);
+        }
+        slot.rows[d] = device.rowCount;
+        slot.rendered[d] = rendered;
+
+        // the readback runs on its own queue so it overlaps the next frame's kernel
+        std::vector<cl::Event> waitFor(1, rendered);
+        if (packed) {
+            // tonemapping on the device cuts the readback to a quarter of the float frame
+            cl::Buffer& devicePacked = m.Reserve(m.packedFrames[nextSlot], bandSize);
+            waitFor[0] = (*tonemap)(cl::EnqueueArgs(device.queue, cl::NDRange(width*device.rowCount)), deviceFrame, devicePacked, exposure);
+            device.queue.flush();
+            device.transferQueue.enqueueReadBuffer(devicePacked, CL_FALSE, 0, bandSize, slot.packedPixels.data() + bandOffset, &waitFor, &slot.ready[d]);
+        } else {
+            device.queue.flush();
+            device.transferQueue.enqueueReadBuffer(deviceFrame, CL_FALSE, 0, sizeof(float) * bandSize, slot.pixels.data() + bandOffset, &waitFor, &slot.ready[d]);
+        }
+        device.transferQueue.flush();
+    }
+
+    nextSlot = (nextSlot + 1) % FramesInFlight;
+    pendingFrames++;
+    sampleCount++;
+}
+
+void OpenCLPathTracer::BalanceRows(){
+    // Devices get rows in proportion to their measured throughput. Devices not yet
+    // timed count as average, and the wavefront pipeline indexes whole frames so it
+    // stays on the first device.
+    std::vector<double> weights(devices.size(), 0.0);
+    if (useWavefront) {
+        weights[0] = 1.0;
+    } else {
+        double measured = 0.0;
+        int measuredCount = 0;
+        for (int d = 0; d < devices.size(); d++) {
+            if (devices[d]->rowsPerSecond > 0.0) {
+                measured += devices[d]->rowsPerSecond;
+                measuredCount++;
+            }
+        }
+        double fallback = measuredCount > 0 ? measured / measuredCount : 1.0;
+        for (int d = 0; d < devices.size(); d++) {
+            weights[d] = devices[d]->rowsPerSecond > 0.0 ? devices[d]->rowsPerSecond : fallback;
+        }
+    }
+    double total = 0.0;
+    for (int d = 0; d < devices.size(); d++) {
+        total += weights[d];
+    }
+
+    // boundaries are rounded from the running sum so the bands always cover every row
+    double sum = 0.0;
+    int row = 0;
+    for (int d = 0; d < devices.size(); d++) {
+        sum += weights[d];
+        int end = d + 1 == devices.size() ? height : (int)(height * sum / total + 0.5);
+        devices[d]->firstRow = row;
+        devices[d]->rowCount = end - row;
+        row = end;
+    }
+}
+
+cl::Event OpenCLPathTracer::RenderWavefront(RenderDevice& device, cl::Buffer& deviceFrame, cl::Buffer& accumulation){
+    DeviceMemory& m = device.memory;
+    cl::CommandQueue& queue = device.queue;
+    WavefrontKernels& k = *wavefront;
+    int pixelCount = width*height;
+    cl::Buffer* paths[2] = {
+        &m.Reserve(m.paths[0], WavefrontKernels::PathStateSize * pixelCount),
+        &m.Reserve(m.paths[1], WavefrontKernels::PathStateSize * pixelCount)
+    };
+    cl::Buffer* counts[2] = {
+        &m.Reserve(m.pathCounts[0], sizeof(int)),
+        &m.Reserve(m.pathCounts[1], sizeof(int))
+    };
+    cl::Buffer& hits = m.Reserve(m.hits, WavefrontKernels::RayHitSize * pixelCount);
+    cl::Buffer& radiance = m.Reserve(m.radiance, sizeof(float) * 4 * pixelCount);
+
+    // every pixel starts one path, the live count then only ever shrinks
+    k.generate(cl::EnqueueArgs(queue, cl::NDRange(width, height)), *paths[0], radiance, Matrix::Inverse(view), Matrix::Inverse(projection), (int)(sampleOffset + sampleCount));
+    queue.enqueueFillBuffer(*counts[0], pixelCount, 0, sizeof(int));
+    int current = 0;
+    for (int bounce = 0; bounce < MaxBounces; bounce++) {
+        // the live count stays on the device, so passes are sized for the worst case
+        cl::EnqueueArgs args(queue, cl::NDRange(pixelCount));
+        k.extend(args, *paths[current], *counts[current], hits, *m.spheres.buffer, *m.triangles.buffer, *m.materials.buffer, *m.nodes.buffer, *m.primitives.buffer, *m.instances.buffer);
+        k.shade(args, *paths[current], *counts[current], hits, radiance, *m.sky.buffer, bounce);
+        if (bounce + 1 == MaxBounces) break;
+        queue.enqueueFillBuffer(*counts[1 - current], 0, 0, sizeof(int));
+        k.compact(args, *paths[current], *counts[current], *paths[1 - current], *counts[1 - current]);
+        current = 1 - current;
+    }
+    return k.accumulate(cl::EnqueueArgs(queue, cl::NDRange(pixelCount)), radiance, accumulation, deviceFrame, (int)sampleCount);
+}
+
+// Tiles report their readback through event callbacks, so RenderTiled sleeps
+// instead of polling on a core that a CPU device would render with. The callbacks
+// share ownership, as they may still run after a failed tile ended the render.
+struct TileCompletions {
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::deque<int> tiles;
+};
+
+struct TileNotice {
+    std::shared_ptr<TileCompletions> completions;
+    int tile;
+};
+
+static void CL_CALLBACK NotifyTileFinished(cl_event, cl_int, void* data) {
+    TileNotice* notice = (TileNotice*)data;
+    {
+        std::lock_guard<std::mutex> lock(notice->completions->mutex);
+        notice->completions->tiles.push_back(notice->tile);
+    }
+    notice->completions->finished.notify_one();
+    delete notice;
+}
+
+void OpenCLPathTracer::RenderTiled(unsigned int samplesPerPixel){
+    // frames still in flight would otherwise race with the arguments set here
+    while (pendingFrames > 0) {
+        WaitForOldestFrame();
+    }
+    struct Tile {
+        int x, y, width, height;
+    };
+    int size = std::max(1u, tileSize);
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += size) {
+        for (int x = 0; x < width; x += size) {
+            Tile tile = { x, y, std::min(size, (int)width - x), std::min(size, (int)height - y) };
+            tiles.push_back(tile);
+        }
+    }
+    tiledImage.resize(width*height*4);
+    // no kernel would write the tile buffers, so their readback would be garbage
+    if (samplesPerPixel == 0) {
+        std::fill(tiledImage.begin(), tiledImage.end(), 0.0f);
+        pixels = tiledImage.data();
+        return;
+    }
+
+    raytrace->getKernel().setArg(16, Matrix::Inverse(view));
+    raytrace->getKernel().setArg(17, Matrix::Inverse(projection));
+    std::size_t tileBytes = sizeof(float) * 4 * size * size;
+
+    // Kernel arguments are captured at enqueue time, so the one kernel object can
+    // feed every device.
+    struct Submitted {
+        int device;
+        int staging;
+        int index;
+        Tile tile;
+        cl::Event ready;
+    };
+    std::vector<Submitted> submitted;
+    std::shared_ptr<TileCompletions> completions = std::make_shared<TileCompletions>();
+    std::size_t nextTile = 0;
+    auto submit = [&](int d, int staging) {
+        Submitted entry = { d, staging, (int)nextTile, tiles[nextTile], cl::Event() };
+        nextTile++;
+        RenderDevice& device = *devices[d];
+        DeviceMemory& m = device.memory;
+        cl::Buffer& frame = m.Reserve(m.tileFrame, tileBytes);
+        cl::Buffer& accumulation = m.Reserve(m.tileAccumulation, tileBytes);
+        raytrace->getKernel().setArg(18, accumulation);
+        SetRegionArgs(entry.tile.x, entry.tile.y);
+        for (unsigned int sample = 0; sample < samplesPerPixel; sample++) {
+            raytrace->getKernel().setArg(19, (int)sample);
+            (*raytrace)(cl::EnqueueArgs(device.queue, cl::NDRange(entry.tile.width, entry.tile.height)), *m.sky.buffer, frame, *m.spheres.buffer, *m.triangles.buffer, *m.materials.buffer, *m.nodes.buffer, *m.primitives.buffer, *m.instances.buffer);
+        }
+        device.staging[staging].resize(4 * size * size);
+        device.queue.enqueueReadBuffer(frame, CL_FALSE, 0, sizeof(float) * 4 * entry.tile.width * entry.tile.height, device.staging[staging].data(), nullptr, &entry.ready);
+        TileNotice* notice = new TileNotice();
+        notice->completions = completions;
+        notice->tile = entry.index;
+        entry.ready.setCallback(CL_COMPLETE, NotifyTileFinished, notice);
+        device.queue.flush();
+        submitted.push_back(entry);
+    };
+
+    // keep every device a tile ahead, then hand the next tile to whichever finishes
+    // first, so faster devices end up taking more of the image
+    for (int staging = 0; staging < TilesInFlight; staging++) {
+        for (int d = 0; d < devices.size() && nextTile < tiles.size(); d++) {
+            submit(d, staging);
+        }
+    }
+    while (!submitted.empty()) {
+        int tile;
+        {
+            std::unique_lock<std::mutex> lock(completions->mutex);
+            completions->finished.wait(lock, [&] { return !completions->tiles.empty(); });
+            tile = completions->tiles.front();
+            completions->tiles.pop_front();
+        }
+        std::size_t index = 0;
+        while (submitted[index].index != tile) {
+            index++;
+        }
+        Submitted done = submitted[index];
+        submitted.erase(submitted.begin() + index);
+        // rethrows if the tile failed
+        done.ready.wait();
+        const std::vector<float>& staging = devices[done.device]->staging[done.staging];
+        for (int row = 0; row < done.tile.height; row++) {
+            const float* source = &staging[4 * row * done.tile.width];
+            std::copy(source, source + 4 * done.tile.width, &tiledImage[4 * ((done.tile.y + row) * width + done.tile.x)]);
+        }
+        if (nextTile < tiles.size()) {
+            submit(done.device, done.staging);
+        }
+    }
+    pixels = tiledImage.data();
+}
+
+void OpenCLPathTracer::SetRegionArgs(int tileX, int tileY){
+    raytrace->getKernel().setArg(20, (int)width);
+    raytrace->getKernel().setArg(21, (int)height);
+    raytrace->getKernel().setArg(22, tileX);
+    raytrace->getKernel().setArg(23, tileY);
+    raytrace->getKernel().setArg(24, (int)sampleOffset);
+}
+
+void OpenCLPathTracer::SetWavefront(bool enabled){
+    useWavefront = enabled;
+    sampleCount = 0;
+}
+
+void OpenCLPathTracer::EndFrame(){
+    // keep the newest frame running unless nothing has been finished in the current
+    // format yet, which is also the case right after the format changed
+    while (pendingFrames > 1 || (pendingFrames == 1 && (pixelFormat == PixelFormat::RGBA8 ? !packedPixels : !pixels))) {
+        WaitForOldestFrame();
+    }
+}
+
+void OpenCLPathTracer::WaitForOldestFrame(){
+    int oldest = (nextSlot + FramesInFlight - pendingFrames) % FramesInFlight;
+    FrameSlot& slot = frameSlots[oldest];
+    for (int d = 0; d < slot.ready.size(); d++) {
+        if (slot.rows[d] == 0) continue;
+        slot.ready[d].wait();
+        // smoothed so that one slow frame does not throw the split around
+        cl_ulong start = slot.rendered[d].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong end = slot.rendered[d].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        if (end > start) {
+            double rate = slot.rows[d] / ((end - start) * 1e-9);
+            double& rowsPerSecond = devices[d]->rowsPerSecond;
+            rowsPerSecond = rowsPerSecond > 0.0 ? 0.8 * rowsPerSecond + 0.2 * rate : rate;
+        }
+    }
+    if (slot.format == PixelFormat::RGBA8) {
+        packedPixels = slot.packedPixels.data();
+    } else {
+        pixels = slot.pixels.data();
+    }
+    pendingFrames--;
+}
+
+void OpenCLPathTracer::SetMultiDevice(bool enabled){
+    multiDevice = enabled;
+}
+
+DeviceMemoryStats OpenCLPathTracer::GetDeviceMemoryStats(){
+    // summed over every device
+    DeviceMemoryStats stats;
+    for (int d = 0; d < devices.size(); d++) {
+        stats.allocations += devices[d]->memory.stats.allocations;
+        stats.reuses += devices[d]->memory.stats.reuses;
+        stats.allocatedBytes += devices[d]->memory.stats.allocatedBytes;
+    }
+    return stats;
 }
\ No newline at end of file
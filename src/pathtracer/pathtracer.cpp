@@ -3,14 +3,74 @@
 using namespace Magpie;
 
 void PathTracer::SetDimensions(unsigned int width, unsigned int height) {
+    if (width != this->width || height != this->height) {
+        sampleCount = 0;
+    }
     this->width = width;
     this->height = height;
+    this->projection = Matrix::Perspective(Radians(fieldOfView), (float)width / height, 0.1f, 100.0f);
 }
 
 void PathTracer::SetViewMatrix(Mat4 matrix) {
+    if (matrix != view) {
+        sampleCount = 0;
+    }
     this->view = matrix;
 }
 
+void PathTracer::SetFieldOfView(float degrees) {
+    if (degrees != fieldOfView) {
+        sampleCount = 0;
+    }
+    this->fieldOfView = degrees;
+    this->projection = Matrix::Perspective(Radians(fieldOfView), (float)width / height, 0.1f, 100.0f);
+}
+
+void PathTracer::UpdateScene(const Scene& scene) {
+    LoadScene(scene);
+}
+
+void PathTracer::BeginFrame() {
+    Render();
+}
+
+void PathTracer::EndFrame() {}
+
+void PathTracer::SetPixelFormat(PixelFormat format) {
+    this->pixelFormat = format;
+}
+
+void PathTracer::SetExposure(float stops) {
+    this->exposure = stops;
+}
+
+void PathTracer::RenderTiled(unsigned int samplesPerPixel) {
+    // without tiling support, accumulate whole frames instead
+    sampleCount = 0;
+    for (unsigned int i = 0; i < samplesPerPixel; i++) {
+        Render();
+    }
+}
+
+void PathTracer::SetTileSize(unsigned int size) {
+    this->tileSize = size;
+}
+
 float* PathTracer::GetPixels() {
     return pixels;
+}
+
+unsigned char* PathTracer::GetPackedPixels() {
+    return packedPixels;
+}
+
+void PathTracer::SetSampleOffset(unsigned int first) {
+    if (first != sampleOffset) {
+        sampleCount = 0;
+    }
+    this->sampleOffset = first;
+}
+
+unsigned int PathTracer::GetSampleCount() {
+    return sampleCount;
 }
\ No newline at end of file
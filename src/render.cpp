@@ -0,0 +1,59 @@
+#include <Magpie.h>
+
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Renders a scene to an image file without a window, for batch jobs on machines
+// without a display.
+
+static void PrintUsage() {
+    std::cerr << "usage: MagpieRender <scene.yaml> [options]\n"
+                 "  -o, --output <file>    image to write, .png, .exr or .pfm (render.png)\n"
+                 "  --width <pixels>       image width (800)\n"
+                 "  --height <pixels>      image height (600)\n"
+                 "  --spp <samples>        samples per pixel (64)\n"
+                 "  --first-sample <index> first sample of a render split across processes (0)\n"
+                 "  --camera <x,y,z>       camera position (0,0,0)\n"
+                 "  --target <x,y,z>       point the camera looks at (0,0,-1)\n"
+                 "  --up <x,y,z>           up direction of the camera (0,1,0)\n"
+                 "  --fov <degrees>        vertical field of view (45)\n"
+                 "  --exposure <stops>     exposure of png output (0)\n"
+                 "  --backend <cpu|opencl> device to render on (cpu)\n"
+                 "  --checkpoint <file>    save progress to file after every chunk of samples\n"
+                 "  --resume <file>        continue from file if it exists, saving progress to it\n"
+                 "  --checkpoint-every <samples> samples per chunk between checkpoints (16)\n";
+}
+
+int main(int argc, char ** argv) {
+    std::vector<std::string> arguments(argv + 1, argv + argc);
+    for (std::size_t i = 0; i < arguments.size(); i++) {
+        if (arguments[i] == "--help") {
+            PrintUsage();
+            return EXIT_SUCCESS;
+        }
+    }
+
+    Magpie::RenderJob job;
+    std::string error;
+    if (!Magpie::ParseRenderJob(arguments, job, error)) {
+        std::cerr << error << "\n";
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+    // the same path as a job sent to MagpieServer, minus the cache
+    Magpie::RenderService service(1, 1);
+    std::future<Magpie::RenderResult> pending;
+    service.Submit(job, pending);
+    Magpie::RenderResult result = pending.get();
+    if (!result.ok) {
+        std::cerr << "render failed: " << result.error << "\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << job.output << ": " << job.width << "x" << job.height << ", " << job.samples << " spp in "
+              << result.renderSeconds << " s" << std::endl;
+    return EXIT_SUCCESS;
+}
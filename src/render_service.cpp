@@ -0,0 +1,354 @@
+#include <Magpie/render_service.h>
+#include <Magpie/checkpoint.h>
+#include <Magpie/image.h>
+#include <Magpie/scene.h>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+using namespace Magpie;
+
+struct RenderService::Entry {
+    Backend backend;
+    std::string scene;
+    // Modification time and size of the scene file when it was loaded. Times only
+    // have whole seconds everywhere, the size catches most quick rewrites.
+    long long modified;
+    long long size;
+    PathTracer* renderer = nullptr;
+    ~Entry() { delete renderer; }
+};
+
+struct RenderService::Pending {
+    RenderJob job;
+    std::promise<RenderResult> result;
+    std::chrono::steady_clock::time_point submitted;
+};
+
+static bool ParseVec3(const std::string& text, Vec3& result) {
+    char end;
+    return std::sscanf(text.c_str(), "%f,%f,%f%c", &result.x, &result.y, &result.z, &end) == 3;
+}
+
+static bool ParseCount(const std::string& text, long minimum, unsigned int& result) {
+    char* end;
+    long value = std::strtol(text.c_str(), &end, 10);
+    if (*end != '\0' || end == text.c_str() || value < minimum) return false;
+    result = value;
+    return true;
+}
+
+static bool ParseFloat(const std::string& text, float& result) {
+    char* end;
+    result = std::strtof(text.c_str(), &end);
+    return *end == '\0' && end != text.c_str();
+}
+
+bool Magpie::ParseRenderJob(const std::vector<std::string>& arguments, RenderJob& job, std::string& error) {
+    for (std::size_t i = 0; i < arguments.size(); i++) {
+        const std::string& arg = arguments[i];
+        if (arg.empty() || arg[0] != '-') {
+            if (!job.scene.empty()) {
+                error = "more than one scene file specified";
+                return false;
+            }
+            job.scene = arg;
+            continue;
+        }
+        if (i + 1 >= arguments.size()) {
+            error = "missing value for " + arg;
+            return false;
+        }
+        const std::string& value = arguments[++i];
+        bool valid;
+        if (arg == "-o" || arg == "--output") {
+            job.output = value;
+            valid = Image::IsSupported(value);
+        } else if (arg == "--width") {
+            valid = ParseCount(value, 1, job.width);
+        } else if (arg == "--height") {
+            valid = ParseCount(value, 1, job.height);
+        } else if (arg == "--spp") {
+            valid = ParseCount(value, 1, job.samples);
+        } else if (arg == "--first-sample") {
+            valid = ParseCount(value, 0, job.firstSample);
+        } else if (arg == "--checkpoint" || arg == "--resume") {
+            job.checkpoint = value;
+            job.resume = arg == "--resume";
+            valid = true;
+        } else if (arg == "--checkpoint-every") {
+            valid = ParseCount(value, 1, job.checkpointInterval);
+        } else if (arg == "--camera") {
+            valid = ParseVec3(value, job.camera);
+        } else if (arg == "--target") {
+            valid = ParseVec3(value, job.target);
+        } else if (arg == "--up") {
+            valid = ParseVec3(value, job.up);
+        } else if (arg == "--fov") {
+            valid = ParseFloat(value, job.fieldOfView) && job.fieldOfView > 0.0f && job.fieldOfView < 180.0f;
+        } else if (arg == "--exposure") {
+            valid = ParseFloat(value, job.exposure);
+        } else if (arg == "--backend") {
+            valid = value == "cpu" || value == "opencl";
+            job.backend = value == "opencl" ? Backend::OpenCL : Backend::CPU;
+        } else {
+            error = "unknown option " + arg;
+            return false;
+        }
+        if (!valid) {
+            error = "invalid value for " + arg + ": " + value;
+            return false;
+        }
+    }
+    if (job.scene.empty()) {
+        error = "no scene file specified";
+        return false;
+    }
+    return true;
+}
+
+PathTracer* Magpie::CreatePathTracer(Backend backend) {
+    if (backend == Backend::OpenCL) {
+        return new OpenCLPathTracer();
+    }
+    return new CPUPathTracer();
+}
+
+static void FileStamp(const std::string& file, long long& modified, long long& size) {
+    struct stat info;
+    if (stat(file.c_str(), &info) != 0) {
+        modified = size = -1;
+        return;
+    }
+    modified = info.st_mtime;
+    size = info.st_size;
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// FNV-1a over every setting of a job that changes its pixels. The scene is hashed
+// by its contents rather than its path, so editing it invalidates a checkpoint while
+// moving it does not. Files the scene refers to are covered only by their paths.
+static uint64_t Fingerprint(const RenderJob& job) {
+    std::ifstream sceneFile(job.scene, std::ios::binary);
+    std::string key((std::istreambuf_iterator<char>(sceneFile)), std::istreambuf_iterator<char>());
+    key += '\0';
+    unsigned int counts[6] = {(unsigned int)job.backend, job.width, job.height, job.samples, job.firstSample, job.checkpointInterval};
+    key.append((const char*)counts, sizeof(counts));
+    float camera[10] = {job.camera.x, job.camera.y, job.camera.z, job.target.x, job.target.y, job.target.z,
+                        job.up.x, job.up.y, job.up.z, job.fieldOfView};
+    key.append((const char*)camera, sizeof(camera));
+    uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < key.size(); i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Renders job in chunks of samples, adding each chunk's average weighted by its
+// sample count to the sum. The file is written on another thread while the next
+// chunk renders, from a copy that stays untouched until the write is done.
+static void RenderWithCheckpoints(PathTracer& renderer, const RenderJob& job, std::vector<float>& pixels) {
+    uint64_t fingerprint = Fingerprint(job);
+    RenderCheckpoint state;
+    if (job.resume && LoadCheckpoint(job.checkpoint, state)) {
+        if (state.fingerprint != fingerprint) {
+            throw std::runtime_error("checkpoint " + job.checkpoint + " belongs to a different render");
+        }
+    } else {
+        state.width = job.width;
+        state.height = job.height;
+        state.firstSample = job.firstSample;
+        state.samples = job.samples;
+        state.fingerprint = fingerprint;
+        state.sum.assign((std::size_t)job.width * job.height * 4, 0.0f);
+    }
+
+    RenderCheckpoint saved;
+    bool saveFailed = false;
+    std::thread writer;
+    while (state.samplesDone < state.samples) {
+        unsigned int count = std::min(job.checkpointInterval, state.samples - state.samplesDone);
+        renderer.SetSampleOffset(state.firstSample + state.samplesDone);
+        try {
+            renderer.RenderTiled(count);
+        } catch (...) {
+            // the last checkpoint still gets written
+            if (writer.joinable()) writer.join();
+            throw;
+        }
+        const float* chunk = renderer.GetPixels();
+        for (std::size_t i = 0; i < state.sum.size(); i++) {
+            state.sum[i] += chunk[i] * count;
+        }
+        state.samplesDone += count;
+
+        if (writer.joinable()) writer.join();
+        if (saveFailed) break;
+        saved = state;
+        writer = std::thread([&saved, &saveFailed, &job]() {
+            saveFailed = !SaveCheckpoint(job.checkpoint, saved);
+        });
+    }
+    if (writer.joinable()) writer.join();
+    if (saveFailed) {
+        throw std::runtime_error("failed to write checkpoint " + job.checkpoint);
+    }
+
+    pixels.resize(state.sum.size());
+    for (std::size_t i = 0; i < state.sum.size(); i++) {
+        pixels[i] = state.sum[i] / state.samples;
+    }
+}
+
+RenderService::RenderService(unsigned int cacheSize, unsigned int queueSize)
+    : cacheSize(std::max(1u, cacheSize)), queueSize(std::max(1u, queueSize)) {
+    worker = std::thread(&RenderService::WorkerLoop, this);
+}
+
+RenderService::~RenderService() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    worker.join();
+    for (std::size_t i = 0; i < queue.size(); i++) {
+        RenderResult result;
+        result.error = "render service stopped";
+        queue[i]->result.set_value(result);
+        delete queue[i];
+    }
+    for (std::list<Entry*>::iterator it = cache.begin(); it != cache.end(); ++it) {
+        delete *it;
+    }
+}
+
+bool RenderService::Submit(const RenderJob& job, std::future<RenderResult>& result) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || queue.size() >= queueSize) {
+            stats.rejected++;
+            return false;
+        }
+        Pending* pending = new Pending();
+        pending->job = job;
+        pending->submitted = std::chrono::steady_clock::now();
+        result = pending->result.get_future();
+        queue.push_back(pending);
+    }
+    available.notify_one();
+    return true;
+}
+
+RenderServiceStats RenderService::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    RenderServiceStats current = stats;
+    current.queued = queue.size();
+    return current;
+}
+
+void RenderService::WorkerLoop() {
+    while (true) {
+        Pending* pending;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) return;
+            pending = queue.front();
+            queue.pop_front();
+        }
+        double queueSeconds = SecondsSince(pending->submitted);
+        RenderResult result = Run(pending->job);
+        result.queueSeconds = queueSeconds;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.jobs++;
+            if (result.cached) stats.hits++;
+            stats.cachedScenes = cache.size();
+        }
+        pending->result.set_value(result);
+        delete pending;
+    }
+}
+
+RenderService::Entry& RenderService::Acquire(const RenderJob& job, bool& cached) {
+    long long modified, size;
+    FileStamp(job.scene, modified, size);
+    for (std::list<Entry*>::iterator it = cache.begin(); it != cache.end(); ++it) {
+        Entry* entry = *it;
+        if (entry->backend != job.backend || entry->scene != job.scene) continue;
+        cache.splice(cache.begin(), cache, it);
+        cached = entry->modified == modified && entry->size == size;
+        if (!cached) {
+            entry->renderer->LoadScene(LoadSceneFromFile(job.scene));
+            entry->modified = modified;
+            entry->size = size;
+        }
+        return *entry;
+    }
+
+    // free the device memory of the evicted scene before uploading the new one
+    while (cache.size() >= cacheSize) {
+        delete cache.back();
+        cache.pop_back();
+    }
+    Entry* entry = new Entry();
+    entry->backend = job.backend;
+    entry->scene = job.scene;
+    entry->modified = modified;
+    entry->size = size;
+    try {
+        entry->renderer = CreatePathTracer(job.backend);
+        entry->renderer->Initialize();
+        entry->renderer->LoadScene(LoadSceneFromFile(job.scene));
+    } catch (...) {
+        delete entry;
+        throw;
+    }
+    cache.push_front(entry);
+    cached = false;
+    return *entry;
+}
+
+RenderResult RenderService::Run(const RenderJob& job) {
+    RenderResult result;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try {
+        PathTracer& renderer = *Acquire(job, result.cached).renderer;
+        renderer.SetPixelFormat(PixelFormat::Float);
+        renderer.SetDimensions(job.width, job.height);
+        renderer.SetFieldOfView(job.fieldOfView);
+        renderer.SetViewMatrix(Matrix::LookAt(job.camera, job.target, job.up));
+        if (job.checkpoint.empty()) {
+            renderer.SetSampleOffset(job.firstSample);
+            renderer.RenderTiled(job.samples);
+            result.pixels.assign(renderer.GetPixels(), renderer.GetPixels() + (std::size_t)job.width * job.height * 4);
+        } else {
+            RenderWithCheckpoints(renderer, job, result.pixels);
+        }
+        result.ok = job.output.empty() || Image::Write(job.output, job.width, job.height, result.pixels.data(), job.exposure);
+        if (!result.ok) {
+            result.error = "failed to write " + job.output;
+        } else if (!job.output.empty()) {
+            // only partial renders hand their pixels back
+            result.pixels.clear();
+        }
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    result.renderSeconds = SecondsSince(start);
+    return result;
+}
@@ -1,6 +1,15 @@
 #include <yaml-cpp/yaml.h>
+#include <stb_image.h>
 
 #include <Magpie/scene.h>
+#include <Magpie/angle.h>
+#include <Magpie/gltf.h>
+#include <Magpie/mesh_file.h>
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
 
 using namespace Magpie;
 
@@ -71,10 +80,95 @@ namespace YAML {
             return true;
         }
     };
+
+    template<>
+    struct convert<Triangle> {
+        static Node encode(const Triangle& t) {
+            Node vertices;
+            vertices.push_back(t.a);
+            vertices.push_back(t.b);
+            vertices.push_back(t.c);
+            Node node;
+            node.push_back(vertices);
+            node.push_back(t.materialIndex);
+            return node;
+        }
+
+        static bool decode(const Node& node, Triangle& t) {
+            if (!node.IsSequence() || node.size() != 2 || node[0].size() != 3) {
+                return false;
+            }
+
+            t.a = node[0][0].as<Vec3>();
+            t.b = node[0][1].as<Vec3>();
+            t.c = node[0][2].as<Vec3>();
+            t.materialIndex = node[1].as<int>();
+            return true;
+        }
+    };
+}
+
+// translation, rotation (degrees about x, then y, then z) and scale, all optional
+static Mat4 ParseTransform(const YAML::Node& node) {
+    Mat4 transform(1.0f);
+    if (node["translation"]) {
+        transform = transform * Matrix::Translate(node["translation"].as<Vec3>());
+    }
+    if (node["rotation"]) {
+        Vec3 rotation = node["rotation"].as<Vec3>();
+        transform = transform * Matrix::Rotate(Radians(rotation.z), Vec3(0.0f, 0.0f, 1.0f));
+        transform = transform * Matrix::Rotate(Radians(rotation.y), Vec3(0.0f, 1.0f, 0.0f));
+        transform = transform * Matrix::Rotate(Radians(rotation.x), Vec3(1.0f, 0.0f, 0.0f));
+    }
+    if (node["scale"]) {
+        transform = transform * Matrix::Scale(node["scale"].as<Vec3>());
+    }
+    return transform;
 }
 
+// mesh files are found relative to the scene file
+static std::string ResolvePath(const std::string& sceneFile, const std::string& path) {
+    bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+    std::size_t slash = sceneFile.find_last_of("/\\");
+    if (absolute || slash == std::string::npos) return path;
+    return sceneFile.substr(0, slash + 1) + path;
+}
+
+Texture Magpie::LoadTexture(const std::string& filename) {
+    Texture texture;
+    int channels;
+    stbi_set_flip_vertically_on_load(true);
+    unsigned char *data = stbi_load(filename.c_str(), &texture.width, &texture.height, &channels, 0);
+    if (!data) {
+        throw std::runtime_error("failed to load " + filename + ": " + stbi_failure_reason());
+    }
+    texture.pixels.resize(texture.width*texture.height);
+    for (int i = 0; i < texture.width*texture.height; i++) {
+        int pos = i*channels;
+        texture.pixels[i] = Vec4(*(data+pos)/255.0f, *(data+pos+1)/255.0f, *(data+pos+2)/255.0f, 1.0f);
+    }
+    stbi_image_free(data);
+    return texture;
+}
+
+// binary scenes start with this, see scene_file.cpp
+static const char BinarySceneMagic[8] = {'M', 'G', 'P', 'S', 'C', 'E', 'N', 'E'};
+static const char GLTFMagic[4] = {'g', 'l', 'T', 'F'};
+
 Scene Magpie::LoadSceneFromFile(std::string file) {
+    char magic[sizeof(BinarySceneMagic)] = {};
+    std::ifstream(file, std::ios::binary).read(magic, sizeof(magic));
+    if (std::memcmp(magic, BinarySceneMagic, sizeof(magic)) == 0) {
+        return LoadBinaryScene(file);
+    }
     Scene scene;
+    // a .glb file on its own, lit from above
+    if (std::memcmp(magic, GLTFMagic, sizeof(GLTFMagic)) == 0) {
+        scene.ground = false;
+        scene.directionalLight = DirectionalLight(Vec3(0.0f, -1.0f, 0.0f), 1.0f);
+        GLTF::Import(file, scene);
+        return scene;
+    }
     YAML::Node sceneData = YAML::LoadFile(file);
     scene.skyFilename = sceneData["sky"].as<std::string>();
     scene.ground = sceneData["ground"].as<bool>();
@@ -94,6 +188,32 @@ Scene Magpie::LoadSceneFromFile(std::string file) {
     for (std::size_t i = 0; i < materialData.size(); i++) {
         scene.AddMaterial(materialData[i].as<Material>());
     }
+    YAML::Node meshData = sceneData["meshes"];
+    for (std::size_t i = 0; i < meshData.size(); i++) {
+        // either a list of triangles or a file with one material for all of them
+        if (meshData[i]["file"]) {
+            int material = meshData[i]["material"] ? meshData[i]["material"].as<int>() : 0;
+            scene.AddMeshFromFile(ResolvePath(file, meshData[i]["file"].as<std::string>()), material);
+            continue;
+        }
+        Mesh mesh;
+        mesh.triangles = meshData[i]["triangles"].as<std::vector<Triangle>>();
+        scene.AddMesh(mesh);
+    }
+    YAML::Node instanceData = sceneData["instances"];
+    for (std::size_t i = 0; i < instanceData.size(); i++) {
+        int mesh = instanceData[i]["mesh"].as<int>();
+        if (mesh < 0 || mesh >= scene.GetMeshes().size()) {
+            throw std::runtime_error(file + ": instance " + std::to_string(i) + " uses mesh " + std::to_string(mesh) +
+                                     ", which does not exist");
+        }
+        scene.AddInstance(mesh, ParseTransform(instanceData[i]));
+    }
+    // imported after the meshes above so their indices stay as written
+    YAML::Node gltfData = sceneData["gltf"];
+    for (std::size_t i = 0; i < gltfData.size(); i++) {
+        GLTF::Import(ResolvePath(file, gltfData[i]["file"].as<std::string>()), scene, ParseTransform(gltfData[i]));
+    }
     return scene;
 }
 
@@ -103,6 +223,7 @@ void Scene::AddSphere(Vec3 center, float radius, int materialIndex) {
     s.radius = radius;
     s.materialIndex = materialIndex;
     spheres.push_back(s);
+    DropBVHs();
 }
 
 void Scene::AddTriangle(Vec3 a, Vec3 b, Vec3 c, int materialIndex) {
@@ -112,20 +233,131 @@ void Scene::AddTriangle(Vec3 a, Vec3 b, Vec3 c, int materialIndex) {
     t.c = c;
     t.materialIndex = materialIndex;
     triangles.push_back(t);
+    DropBVHs();
 }
 
 void Scene::AddMaterial(Material material) {
     materials.push_back(material);
 }
 
-const std::vector<Sphere>& Scene::GetSpheres() {
+int Scene::AddMesh(Mesh mesh) {
+    meshes.push_back(std::move(mesh));
+    DropBVHs();
+    return meshes.size() - 1;
+}
+
+int Scene::AddMeshFromFile(const std::string& filename, int materialIndex) {
+    DropBVHs();
+    meshes.push_back(Mesh());
+    try {
+        MeshFile::Load(filename, materialIndex, meshes.back().triangles);
+    } catch (...) {
+        meshes.pop_back();
+        throw;
+    }
+    return meshes.size() - 1;
+}
+
+void Scene::AddInstance(int meshIndex, Mat4 transform) {
+    Instance i;
+    i.meshIndex = meshIndex;
+    i.transform = transform;
+    instances.push_back(i);
+}
+
+void Scene::SetSphereCenter(int sphereIndex, Vec3 center) {
+    spheres[sphereIndex].center = center;
+    DropBVHs();
+    if (sphereMoved.size() < spheres.size()) sphereMoved.resize(spheres.size());
+    if (!sphereMoved[sphereIndex]) {
+        sphereMoved[sphereIndex] = true;
+        movedSpheres.push_back(sphereIndex);
+    }
+}
+
+void Scene::SetInstanceTransform(int instanceIndex, Mat4 transform) {
+    instances[instanceIndex].transform = transform;
+    if (instanceMoved.size() < instances.size()) instanceMoved.resize(instances.size());
+    if (!instanceMoved[instanceIndex]) {
+        instanceMoved[instanceIndex] = true;
+        movedInstances.push_back(instanceIndex);
+    }
+}
+
+const std::vector<int>& Scene::GetMovedSpheres() const {
+    return movedSpheres;
+}
+
+const std::vector<int>& Scene::GetMovedInstances() const {
+    return movedInstances;
+}
+
+void Scene::ClearMoved() {
+    for (std::size_t i = 0; i < movedSpheres.size(); i++) {
+        sphereMoved[movedSpheres[i]] = false;
+    }
+    for (std::size_t i = 0; i < movedInstances.size(); i++) {
+        instanceMoved[movedInstances[i]] = false;
+    }
+    movedSpheres.clear();
+    movedInstances.clear();
+}
+
+void Scene::BuildBVHs(ThreadPool* pool) {
+    std::vector<AABB> bounds;
+    for (std::size_t i = 0; i < spheres.size(); i++) {
+        bounds.push_back(Bounds::Of(spheres[i]));
+    }
+    for (std::size_t i = 0; i < triangles.size(); i++) {
+        bounds.push_back(Bounds::Of(triangles[i]));
+    }
+    worldBVH.Build(bounds, pool);
+    meshBVHs.resize(meshes.size());
+    for (std::size_t m = 0; m < meshes.size(); m++) {
+        bounds.resize(meshes[m].triangles.size());
+        for (std::size_t i = 0; i < bounds.size(); i++) {
+            bounds[i] = Bounds::Of(meshes[m].triangles[i]);
+        }
+        meshBVHs[m].Build(bounds, pool);
+    }
+    hasBVHs = true;
+}
+
+bool Scene::HasBVHs() const {
+    return hasBVHs;
+}
+
+const BVH& Scene::GetWorldBVH() const {
+    return worldBVH;
+}
+
+const std::vector<BVH>& Scene::GetMeshBVHs() const {
+    return meshBVHs;
+}
+
+void Scene::DropBVHs() {
+    if (!hasBVHs) return;
+    hasBVHs = false;
+    worldBVH = BVH();
+    meshBVHs.clear();
+}
+
+const std::vector<Sphere>& Scene::GetSpheres() const {
     return spheres;
 }
 
-const std::vector<Triangle>& Scene::GetTriangles() {
+const std::vector<Triangle>& Scene::GetTriangles() const {
     return triangles;
 }
 
-const std::vector<Material>& Scene::GetMaterials() {
+const std::vector<Material>& Scene::GetMaterials() const {
     return materials;
+}
+
+const std::vector<Mesh>& Scene::GetMeshes() const {
+    return meshes;
+}
+
+const std::vector<Instance>& Scene::GetInstances() const {
+    return instances;
 }
\ No newline at end of file
@@ -0,0 +1,381 @@
+#include <Magpie/scene.h>
+#include <Magpie/thread_pool.h>
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+using namespace Magpie;
+
+// A binary scene is a 64 byte header, a table of sections and the sections
+// themselves, each at a multiple of 64 bytes. Sections are arrays of the structs
+// the library works with, byte for byte, so reading one is a single copy and the
+// sphere, triangle and material arrays already have the layout the OpenCL kernels
+// read. Files are only read on hosts with the byte order and struct layout they
+// were written with, which the header and the element sizes in the table record.
+// Padding bytes are written as zeros, so equal scenes give equal files.
+
+static const char Magic[8] = {'M', 'G', 'P', 'S', 'C', 'E', 'N', 'E'};
+static const uint32_t Version = 1;
+static const uint32_t ByteOrderMark = 0x01020304;
+static const std::size_t Alignment = 64;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t sectionCount;
+    uint32_t ground;
+    float light[4]; // direction and intensity
+    int32_t skyWidth;
+    int32_t skyHeight;
+    uint32_t reserved[4];
+};
+
+static_assert(sizeof(Header) == Alignment, "the header fills the first 64 bytes");
+
+enum SectionType : uint32_t {
+    Spheres = 1,
+    Triangles,       // loose triangles
+    Materials,
+    Meshes,          // MeshRecord per mesh
+    MeshTriangles,   // of every mesh in turn
+    Instances,
+    SkyPixels,
+    SkyFilename,
+    WorldNodes,
+    WorldPrimitives,
+    MeshNodes,       // the tree of every mesh in turn
+    MeshPrimitives
+};
+
+struct Section {
+    uint32_t type;
+    uint32_t elementSize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+// where the triangles and the tree of a mesh are in the shared sections
+struct MeshRecord {
+    uint64_t firstTriangle;
+    uint64_t triangleCount;
+    uint64_t firstNode;
+    uint64_t nodeCount;
+    uint64_t firstPrimitive;
+    uint64_t primitiveCount;
+};
+
+// copies without the bytes that padding leaves undefined
+
+static void Copy(Vec3& to, const Vec3& from) {
+    to.x = from.x;
+    to.y = from.y;
+    to.z = from.z;
+}
+
+static void Clean(Sphere& to, const Sphere& from) {
+    Copy(to.center, from.center);
+    to.radius = from.radius;
+    to.materialIndex = from.materialIndex;
+}
+
+static void Clean(Triangle& to, const Triangle& from) {
+    Copy(to.a, from.a);
+    Copy(to.b, from.b);
+    Copy(to.c, from.c);
+    to.materialIndex = from.materialIndex;
+}
+
+static void Clean(Material& to, const Material& from) {
+    Copy(to.specular, from.specular);
+    Copy(to.albedo, from.albedo);
+}
+
+static void Clean(Instance& to, const Instance& from) {
+    to.meshIndex = from.meshIndex;
+    to.transform = from.transform;
+}
+
+static void Clean(BVHNode& to, const BVHNode& from) {
+    Copy(to.bounds.min, from.bounds.min);
+    Copy(to.bounds.max, from.bounds.max);
+    to.leftFirst = from.leftFirst;
+    to.count = from.count;
+}
+
+// the other types have no padding
+template<typename T>
+static void Clean(T& to, const T& from) {
+    to = from;
+}
+
+class SceneWriter {
+    public:
+        SceneWriter(const std::string& filename) : file(filename, std::ios::binary) {}
+        // sections are added to the table first, then written in the same order
+        template<typename T>
+        void Plan(uint32_t type, std::size_t count) {
+            Section section;
+            section.type = type;
+            section.elementSize = sizeof(T);
+            section.count = count;
+            section.offset = 0;
+            sections.push_back(section);
+        }
+        void Begin(Header& header) {
+            header.sectionCount = sections.size();
+            uint64_t offset = Align(sizeof(Header) + sections.size() * sizeof(Section));
+            for (std::size_t i = 0; i < sections.size(); i++) {
+                sections[i].offset = offset;
+                offset = Align(offset + sections[i].count * sections[i].elementSize);
+            }
+            file.write((const char*)&header, sizeof(header));
+            file.write((const char*)sections.data(), sections.size() * sizeof(Section));
+            position = sizeof(Header) + sections.size() * sizeof(Section);
+        }
+        // moves on to the next section, whose items may come in several parts
+        void Start() {
+            Pad(sections[next++].offset);
+        }
+        template<typename T>
+        void Append(const T* items, std::size_t count) {
+            // cleaned in batches, so a large array is not copied whole
+            const std::size_t batchSize = 1 << 14;
+            std::vector<T> batch(std::min(count, batchSize));
+            for (std::size_t first = 0; first < count; first += batchSize) {
+                std::size_t size = std::min(batchSize, count - first);
+                std::memset((void*)batch.data(), 0, size * sizeof(T));
+                for (std::size_t i = 0; i < size; i++) {
+                    Clean(batch[i], items[first + i]);
+                }
+                file.write((const char*)batch.data(), size * sizeof(T));
+            }
+            position += count * sizeof(T);
+        }
+        template<typename T>
+        void Write(const T* items, std::size_t count) {
+            Start();
+            Append(items, count);
+        }
+        bool Finish() {
+            file.flush();
+            return file.good();
+        }
+    private:
+        static uint64_t Align(uint64_t offset) {
+            return (offset + Alignment - 1) / Alignment * Alignment;
+        }
+        void Pad(uint64_t offset) {
+            static const char zeros[Alignment] = {};
+            file.write(zeros, offset - position);
+            position = offset;
+        }
+        std::ofstream file;
+        std::vector<Section> sections;
+        std::size_t next = 0;
+        uint64_t position = 0;
+};
+
+bool Magpie::SaveBinaryScene(const std::string& filename, Scene scene) {
+    if (scene.sky.pixels.empty() && !scene.skyFilename.empty()) {
+        try {
+            scene.sky = LoadTexture(scene.skyFilename);
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    if (!scene.HasBVHs()) {
+        ThreadPool pool;
+        scene.BuildBVHs(&pool);
+    }
+
+    // the meshes, their trees and the world tree laid end to end
+    const std::vector<Mesh>& meshes = scene.GetMeshes();
+    std::vector<BVH> meshBVHs = scene.GetMeshBVHs();
+    BVH worldBVH = scene.GetWorldBVH();
+    std::vector<MeshRecord> records(meshes.size());
+    MeshRecord total = MeshRecord();
+    for (std::size_t m = 0; m < meshes.size(); m++) {
+        MeshRecord& record = records[m];
+        record.firstTriangle = total.triangleCount;
+        record.triangleCount = meshes[m].triangles.size();
+        record.firstNode = total.nodeCount;
+        record.nodeCount = meshBVHs[m].GetNodes().size();
+        record.firstPrimitive = total.primitiveCount;
+        record.primitiveCount = meshBVHs[m].GetPrimitiveIndices().size();
+        total.triangleCount += record.triangleCount;
+        total.nodeCount += record.nodeCount;
+        total.primitiveCount += record.primitiveCount;
+    }
+
+    Header header = Header();
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.byteOrder = ByteOrderMark;
+    header.ground = scene.ground;
+    header.light[0] = scene.directionalLight.direction.x;
+    header.light[1] = scene.directionalLight.direction.y;
+    header.light[2] = scene.directionalLight.direction.z;
+    header.light[3] = scene.directionalLight.intensity;
+    header.skyWidth = scene.sky.width;
+    header.skyHeight = scene.sky.height;
+
+    SceneWriter writer(filename);
+    writer.Plan<Sphere>(Spheres, scene.GetSpheres().size());
+    writer.Plan<Triangle>(Triangles, scene.GetTriangles().size());
+    writer.Plan<Material>(Materials, scene.GetMaterials().size());
+    writer.Plan<MeshRecord>(Meshes, records.size());
+    writer.Plan<Triangle>(MeshTriangles, total.triangleCount);
+    writer.Plan<Instance>(Instances, scene.GetInstances().size());
+    writer.Plan<Vec4>(SkyPixels, scene.sky.pixels.size());
+    writer.Plan<char>(SkyFilename, scene.skyFilename.size());
+    writer.Plan<BVHNode>(WorldNodes, worldBVH.GetNodes().size());
+    writer.Plan<int>(WorldPrimitives, worldBVH.GetPrimitiveIndices().size());
+    writer.Plan<BVHNode>(MeshNodes, total.nodeCount);
+    writer.Plan<int>(MeshPrimitives, total.primitiveCount);
+    writer.Begin(header);
+    writer.Write(scene.GetSpheres().data(), scene.GetSpheres().size());
+    writer.Write(scene.GetTriangles().data(), scene.GetTriangles().size());
+    writer.Write(scene.GetMaterials().data(), scene.GetMaterials().size());
+    writer.Write(records.data(), records.size());
+    writer.Start();
+    for (std::size_t m = 0; m < meshes.size(); m++) {
+        writer.Append(meshes[m].triangles.data(), meshes[m].triangles.size());
+    }
+    writer.Write(scene.GetInstances().data(), scene.GetInstances().size());
+    writer.Write(scene.sky.pixels.data(), scene.sky.pixels.size());
+    writer.Write(scene.skyFilename.data(), scene.skyFilename.size());
+    writer.Write(worldBVH.GetNodes().data(), worldBVH.GetNodes().size());
+    writer.Write(worldBVH.GetPrimitiveIndices().data(), worldBVH.GetPrimitiveIndices().size());
+    writer.Start();
+    for (std::size_t m = 0; m < meshes.size(); m++) {
+        writer.Append(meshBVHs[m].GetNodes().data(), meshBVHs[m].GetNodes().size());
+    }
+    writer.Start();
+    for (std::size_t m = 0; m < meshes.size(); m++) {
+        writer.Append(meshBVHs[m].GetPrimitiveIndices().data(), meshBVHs[m].GetPrimitiveIndices().size());
+    }
+    return writer.Finish();
+}
+
+class SceneReader {
+    public:
+        SceneReader(const std::string& filename) : filename(filename) {}
+        void Open() {
+            if (!file.Open(filename)) {
+                throw std::runtime_error("failed to open " + filename);
+            }
+            if (file.size < sizeof(Header)) Damaged();
+            std::memcpy(&header, file.data, sizeof(header));
+            if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+                throw std::runtime_error(filename + " is not a binary scene");
+            }
+            if (header.version != Version || header.byteOrder != ByteOrderMark) {
+                throw std::runtime_error(filename + " was written by another version or on another kind of host");
+            }
+            if ((file.size - sizeof(Header)) / sizeof(Section) < header.sectionCount) Damaged();
+            sections.resize(header.sectionCount);
+            std::memcpy(sections.data(), file.data + sizeof(Header), sections.size() * sizeof(Section));
+        }
+        // zero if the file has no such section
+        template<typename T>
+        std::size_t Count(uint32_t type) {
+            const Section* section = Find<T>(type);
+            return section != nullptr ? section->count : 0;
+        }
+        // items [first, first + count) of a section in one copy
+        template<typename T>
+        void Read(uint32_t type, std::size_t first, std::size_t count, std::vector<T>& items) {
+            items.resize(count);
+            if (count == 0) return;
+            const Section* section = Find<T>(type);
+            if (section == nullptr || first > section->count || section->count - first < count) Damaged();
+            std::memcpy((void*)items.data(), file.data + section->offset + first * sizeof(T), count * sizeof(T));
+        }
+        template<typename T>
+        void Read(uint32_t type, std::vector<T>& items) {
+            Read(type, 0, Count<T>(type), items);
+        }
+        [[noreturn]] void Damaged() {
+            throw std::runtime_error(filename + " is damaged");
+        }
+        Header header;
+    private:
+        template<typename T>
+        const Section* Find(uint32_t type) {
+            for (std::size_t i = 0; i < sections.size(); i++) {
+                const Section& section = sections[i];
+                if (section.type != type) continue;
+                if (section.elementSize != sizeof(T)) {
+                    throw std::runtime_error(filename + " was written by another version or on another kind of host");
+                }
+                if (section.offset > file.size || (file.size - section.offset) / sizeof(T) < section.count) Damaged();
+                return &section;
+            }
+            return nullptr;
+        }
+        std::string filename;
+        MappedFile file;
+        std::vector<Section> sections;
+};
+
+// whether every primitive names one of materialCount materials
+template<typename T>
+static bool MaterialsExist(const std::vector<T>& primitives, std::size_t materialCount) {
+    for (std::size_t i = 0; i < primitives.size(); i++) {
+        if (primitives[i].materialIndex < 0 || primitives[i].materialIndex >= materialCount) return false;
+    }
+    return true;
+}
+
+Scene Magpie::LoadBinaryScene(const std::string& filename) {
+    SceneReader reader(filename);
+    reader.Open();
+    Scene scene;
+    scene.ground = reader.header.ground != 0;
+    scene.directionalLight = DirectionalLight(Vec3(reader.header.light[0], reader.header.light[1], reader.header.light[2]),
+                                              reader.header.light[3]);
+    reader.Read(Spheres, scene.spheres);
+    reader.Read(Triangles, scene.triangles);
+    reader.Read(Materials, scene.materials);
+    reader.Read(Instances, scene.instances);
+    reader.Read(SkyPixels, scene.sky.pixels);
+    std::vector<char> skyFilename;
+    reader.Read(SkyFilename, skyFilename);
+    scene.skyFilename.assign(skyFilename.begin(), skyFilename.end());
+    scene.sky.width = reader.header.skyWidth;
+    scene.sky.height = reader.header.skyHeight;
+    if ((uint64_t)std::max(scene.sky.width, 0) * std::max(scene.sky.height, 0) != scene.sky.pixels.size()) reader.Damaged();
+
+    // every index is checked, the renderers look them up without bounds checks
+    if (!MaterialsExist(scene.spheres, scene.materials.size()) || !MaterialsExist(scene.triangles, scene.materials.size())) {
+        reader.Damaged();
+    }
+    std::vector<BVHNode> nodes;
+    std::vector<int> primitives;
+    reader.Read(WorldNodes, nodes);
+    reader.Read(WorldPrimitives, primitives);
+    if (!scene.worldBVH.Load(std::move(nodes), std::move(primitives), scene.spheres.size() + scene.triangles.size())) reader.Damaged();
+    std::vector<MeshRecord> records;
+    reader.Read(Meshes, records);
+    scene.meshes.resize(records.size());
+    scene.meshBVHs.resize(records.size());
+    for (std::size_t m = 0; m < records.size(); m++) {
+        const MeshRecord& record = records[m];
+        reader.Read(MeshTriangles, record.firstTriangle, record.triangleCount, scene.meshes[m].triangles);
+        reader.Read(MeshNodes, record.firstNode, record.nodeCount, nodes);
+        reader.Read(MeshPrimitives, record.firstPrimitive, record.primitiveCount, primitives);
+        if (!scene.meshBVHs[m].Load(std::move(nodes), std::move(primitives), record.triangleCount)) reader.Damaged();
+        if (!MaterialsExist(scene.meshes[m].triangles, scene.materials.size())) reader.Damaged();
+    }
+    for (std::size_t i = 0; i < scene.instances.size(); i++) {
+        if (scene.instances[i].meshIndex < 0 || scene.instances[i].meshIndex >= scene.meshes.size()) reader.Damaged();
+    }
+    scene.hasBVHs = true;
+    return scene;
+}
@@ -0,0 +1,213 @@
+#include <Magpie.h>
+#include "net.h"
+
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A render daemon on a Unix domain or TCP socket. Clients send one request per line
+// and get one reply line per request:
+//
+//   render <scene.yaml> [MagpieRender options]
+//     ok <render seconds> <queue seconds> hit|miss
+//     busy                  the queue is full, try again later
+//     error <message>
+//   partial <scene.yaml> [MagpieRender options]
+//     ok <width> <height> <samples>, followed by width * height RGBA pixels as
+//     little endian floats, rows bottom up, instead of writing the image
+//   stats
+//     ok jobs=<n> hits=<n> rejected=<n> queued=<n> scenes=<n>
+//
+// A client connecting while --connections others are being served gets a single
+// busy line and is disconnected.
+//
+// Clients on a TCP socket are not authenticated, so they may only send partial and
+// stats requests, and partial requests from them may not name a checkpoint. Nothing
+// a network peer sends decides where the daemon writes. TCP addresses without a
+// host listen on loopback only.
+//
+// Paths are resolved by the daemon, so clients should send absolute ones, and
+// none may contain spaces. For example:
+//   echo "render /data/scene.yaml --spp 16 -o /data/out.png" | socat - UNIX-CONNECT:/tmp/magpie.sock
+// SIGINT and SIGTERM stop accepting connections, finish the queued jobs and exit.
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void RequestStop(int) {
+    stopRequested = 1;
+}
+
+static void PrintUsage() {
+    std::cerr << "usage: MagpieServer [options]\n"
+                 "  --socket <path>     Unix domain socket to listen on (/tmp/magpie.sock)\n"
+                 "  --listen <address>  unix:<path> or <host>:<port> to listen on instead, an empty host\n"
+                 "                      means loopback, 0.0.0.0:<port> every interface\n"
+                 "  --cache <count>     scenes kept loaded (4)\n"
+                 "  --queue <count>     jobs waiting before requests are turned away (16)\n"
+                 "  --connections <count> clients served at once, others are turned away (64)\n";
+}
+
+// connections still being served, so the service outlives them all
+struct Connections {
+    std::mutex mutex;
+    std::set<int> open;
+    std::atomic<int> active;
+    Connections() : active(0) {}
+};
+
+// remote is set for TCP clients, which must not make the daemon write files
+static std::string HandleRequest(const std::string& line, Magpie::RenderService& service, bool remote) {
+    std::istringstream stream(line);
+    std::string command;
+    stream >> command;
+    if (command == "stats") {
+        Magpie::RenderServiceStats stats = service.GetStats();
+        std::ostringstream reply;
+        reply << "ok jobs=" << stats.jobs << " hits=" << stats.hits << " rejected=" << stats.rejected
+              << " queued=" << stats.queued << " scenes=" << stats.cachedScenes << "\n";
+        return reply.str();
+    }
+    if (command != "render" && command != "partial") {
+        return "error unknown command " + command + "\n";
+    }
+    if (remote && command == "render") {
+        return "error render writes files on the server, TCP clients must send partial\n";
+    }
+
+    std::vector<std::string> arguments;
+    std::string argument;
+    while (stream >> argument) {
+        arguments.push_back(argument);
+    }
+    Magpie::RenderJob job;
+    std::string error;
+    if (!Magpie::ParseRenderJob(arguments, job, error)) {
+        return "error " + error + "\n";
+    }
+    if (remote && (!job.checkpoint.empty() || job.resume)) {
+        return "error TCP clients cannot use checkpoints\n";
+    }
+    if (command == "partial") {
+        job.output.clear();
+    }
+    std::future<Magpie::RenderResult> pending;
+    if (!service.Submit(job, pending)) {
+        return "busy\n";
+    }
+    Magpie::RenderResult result = pending.get();
+    if (!result.ok) {
+        return "error " + result.error + "\n";
+    }
+    std::ostringstream reply;
+    if (command == "partial") {
+        reply << "ok " << job.width << " " << job.height << " " << job.samples << "\n";
+        std::string data = reply.str();
+        Magpie::Net::AppendFloats(data, result.pixels.data(), result.pixels.size());
+        return data;
+    }
+    reply << "ok " << result.renderSeconds << " " << result.queueSeconds << " " << (result.cached ? "hit" : "miss") << "\n";
+    return reply.str();
+}
+
+static void Serve(int client, bool remote, Magpie::RenderService& service, Connections& connections) {
+    std::string buffer, line;
+    while (Magpie::Net::ReadLine(client, buffer, line)) {
+        if (line.empty()) continue;
+        if (!Magpie::Net::SendAll(client, HandleRequest(line, service, remote))) break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(connections.mutex);
+        connections.open.erase(client);
+    }
+    close(client);
+    connections.active--;
+}
+
+int main(int argc, char ** argv) {
+    std::string address = "unix:/tmp/magpie.sock";
+    unsigned int cacheSize = 4, queueSize = 16;
+    int maxConnections = 64;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || i + 1 >= argc) {
+            PrintUsage();
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        const char* value = argv[++i];
+        if (arg == "--socket") {
+            address = std::string("unix:") + value;
+        } else if (arg == "--listen") {
+            address = value;
+        } else if (arg == "--cache" && std::atoi(value) > 0) {
+            cacheSize = std::atoi(value);
+        } else if (arg == "--queue" && std::atoi(value) > 0) {
+            queueSize = std::atoi(value);
+        } else if (arg == "--connections" && std::atoi(value) > 0) {
+            maxConnections = std::atoi(value);
+        } else {
+            PrintUsage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    // a client hanging up must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, RequestStop);
+    signal(SIGTERM, RequestStop);
+
+    int server = Magpie::Net::Listen(address);
+    if (server < 0) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "listening on " << address << std::endl;
+    bool remote = address.compare(0, 5, "unix:") != 0;
+
+    Magpie::RenderService* service = new Magpie::RenderService(cacheSize, queueSize);
+    Connections connections;
+    while (!stopRequested) {
+        pollfd listening = {server, POLLIN, 0};
+        if (poll(&listening, 1, 200) <= 0) continue;
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) continue;
+        // every connection holds a thread and a descriptor, so they are bounded like the queue
+        if (connections.active >= maxConnections) {
+            Magpie::Net::SendAll(client, "busy\n");
+            close(client);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(connections.mutex);
+            connections.open.insert(client);
+        }
+        connections.active++;
+        std::thread(Serve, client, remote, std::ref(*service), std::ref(connections)).detach();
+    }
+
+    close(server);
+    Magpie::Net::Unlink(address);
+    // Idle connections stop reading, the ones waiting on a job get their reply once
+    // the queue drains.
+    {
+        std::lock_guard<std::mutex> lock(connections.mutex);
+        for (std::set<int>::iterator it = connections.open.begin(); it != connections.open.end(); ++it) {
+            shutdown(*it, SHUT_RD);
+        }
+    }
+    while (connections.active > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    delete service;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,248 @@
+#include <Magpie/thread_pool.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+
+using namespace Magpie;
+
+// idle rounds spent yielding before a worker goes to sleep, new tasks often arrive
+// right away in a fork-join
+static const int SpinCount = 64;
+
+struct ThreadPool::WorkQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    std::atomic<unsigned long long> tasksRun;
+    std::atomic<unsigned long long> steals;
+    std::atomic<unsigned long long> idleNanoseconds;
+    WorkQueue() : tasksRun(0), steals(0), idleNanoseconds(0) {}
+};
+
+// the pool and queue of the calling thread, if it is a worker
+static thread_local ThreadPool* currentPool = nullptr;
+static thread_local int currentIndex = -1;
+
+// xorshift, seeded differently per thread, to pick steal victims
+static unsigned int NextRandom() {
+    static std::atomic<unsigned int> seeds(0x9e3779b9u);
+    static thread_local unsigned int state = 0;
+    if (state == 0) {
+        state = seeds.fetch_add(0x6d2b79f5u) | 1u;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void AddIdleTime(std::atomic<unsigned long long>& counter, std::chrono::steady_clock::time_point start) {
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+    counter.fetch_add(elapsed.count(), std::memory_order_relaxed);
+}
+
+ThreadPool::ThreadPool(unsigned int threadCount) : queued(0), sleeping(0) {
+    // the thread calling TaskGroup::Wait counts towards the total
+    unsigned int workerCount = std::max(1u, threadCount) - 1;
+    for (unsigned int i = 0; i <= workerCount; i++) {
+        queues.push_back(new WorkQueue());
+    }
+    for (unsigned int i = 0; i < workerCount; i++) {
+        workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (std::size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    for (std::size_t i = 0; i < queues.size(); i++) {
+        delete queues[i];
+    }
+}
+
+unsigned int ThreadPool::GetThreadCount() {
+    return workers.size() + 1;
+}
+
+// Splits off the upper half of the chunks as a task until one chunk is left, keeping
+// chunk boundaries at multiples of grainSize from the start of the whole range.
+static void SplitRange(TaskGroup& group, int begin, int end, int grainSize, const std::function<void(int, int)>& body) {
+    while (end - begin > grainSize) {
+        int chunks = (end - begin + grainSize - 1) / grainSize;
+        int middle = begin + (chunks / 2) * grainSize;
+        group.Run([&group, &body, middle, end, grainSize]() {
+            SplitRange(group, middle, end, grainSize, body);
+        });
+        end = middle;
+    }
+    body(begin, end);
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grainSize, const std::function<void(int, int)>& body) {
+    if (begin >= end) return;
+    grainSize = std::max(1, grainSize);
+    TaskGroup group(*this);
+    SplitRange(group, begin, end, grainSize, body);
+    group.Wait();
+}
+
+ThreadPoolStats ThreadPool::GetStats() {
+    std::vector<ThreadPoolStats> threads = GetThreadStats();
+    ThreadPoolStats total;
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        total.tasks += threads[i].tasks;
+        total.steals += threads[i].steals;
+        total.idleSeconds += threads[i].idleSeconds;
+    }
+    return total;
+}
+
+std::vector<ThreadPoolStats> ThreadPool::GetThreadStats() {
+    std::vector<ThreadPoolStats> threads(queues.size());
+    for (std::size_t i = 0; i < queues.size(); i++) {
+        threads[i].tasks = queues[i]->tasksRun.load(std::memory_order_relaxed);
+        threads[i].steals = queues[i]->steals.load(std::memory_order_relaxed);
+        threads[i].idleSeconds = queues[i]->idleNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+    }
+    return threads;
+}
+
+void ThreadPool::ResetStats() {
+    for (std::size_t i = 0; i < queues.size(); i++) {
+        queues[i]->tasksRun = 0;
+        queues[i]->steals = 0;
+        queues[i]->idleNanoseconds = 0;
+    }
+}
+
+int ThreadPool::CurrentQueue() {
+    return currentPool == this ? currentIndex : (int)queues.size() - 1;
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    WorkQueue& queue = *queues[CurrentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    // A worker about to sleep counts itself as sleeping before it checks queued, and
+    // here queued is raised before sleeping is read, so one of the two sees the other.
+    queued++;
+    if (sleeping > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        available.notify_one();
+    }
+}
+
+bool ThreadPool::FindTask(int self, std::function<void()>& task) {
+    if (queued == 0) return false;
+    WorkQueue& own = *queues[self];
+    {
+        // newest first keeps the working set of nested fork-join tasks small
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    int count = queues.size();
+    int start = NextRandom() % count;
+    for (int i = 0; i < count; i++) {
+        int victim = (start + i) % count;
+        if (victim == self) continue;
+        WorkQueue& queue = *queues[victim];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            // thieves take the oldest tasks, which are the largest in a recursive split
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued--;
+            own.steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::Wait(std::atomic<int>& pending) {
+    int self = CurrentQueue();
+    WorkQueue& own = *queues[self];
+    bool idle = false;
+    std::chrono::steady_clock::time_point idleStart;
+    while (pending > 0) {
+        std::function<void()> task;
+        if (FindTask(self, task)) {
+            if (idle) AddIdleTime(own.idleNanoseconds, idleStart);
+            idle = false;
+            task();
+            own.tasksRun.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        // the remaining tasks of the group are running on other threads
+        if (!idle) idleStart = std::chrono::steady_clock::now();
+        idle = true;
+        std::this_thread::yield();
+    }
+    if (idle) AddIdleTime(own.idleNanoseconds, idleStart);
+}
+
+void ThreadPool::WorkerLoop(int index) {
+    currentPool = this;
+    currentIndex = index;
+    WorkQueue& own = *queues[index];
+    while (true) {
+        std::function<void()> task;
+        if (!FindTask(index, task)) {
+            std::chrono::steady_clock::time_point idleStart = std::chrono::steady_clock::now();
+            for (int spin = 0; spin < SpinCount && !task; spin++) {
+                std::this_thread::yield();
+                FindTask(index, task);
+            }
+            while (!task) {
+                bool stop;
+                sleeping++;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    available.wait(lock, [this]() { return stopping || queued > 0; });
+                    stop = stopping;
+                }
+                sleeping--;
+                if (!FindTask(index, task) && stop && queued == 0) {
+                    AddIdleTime(own.idleNanoseconds, idleStart);
+                    return;
+                }
+            }
+            AddIdleTime(own.idleNanoseconds, idleStart);
+        }
+        task();
+        own.tasksRun.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// TaskGroup
+TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool), pending(0) {}
+
+TaskGroup::~TaskGroup() {
+    Wait();
+}
+
+void TaskGroup::Run(std::function<void()> task) {
+    pending++;
+    pool.Submit([this, task]() {
+        task();
+        pending--;
+    });
+}
+
+void TaskGroup::Wait() {
+    pool.Wait(pending);
+}